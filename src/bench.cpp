@@ -0,0 +1,359 @@
+/********************************************************************
+ * bench.cpp: Replay recorded temperature traces against a config
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "thinkfan.h"
+#include "config.h"
+#include "sensors.h"
+#include "fans.h"
+#include "message.h"
+#include "error.h"
+#include "stats.h"
+#include "trace.h"
+#include "simd.h"
+#include "self_check.h"
+#include "parser.h"
+
+#include <getopt.h>
+
+#include <climits>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#define MSG_BENCH_USAGE \
+ "Usage: thinkfan-bench [-v] [-b BIAS] [-c CONFIG] TRACE" \
+ "\n       thinkfan-bench -P CONFIG" \
+ "\n       thinkfan-bench -S CHECK" \
+ "\nReplay TRACE (recorded with thinkfan -r) against CONFIG as fast as possible." \
+ "\n -b  Same as thinkfan -b. Default: 0.0" \
+ "\n -c  The config to evaluate (default: the same as thinkfan)" \
+ "\n -P  Parse the legacy-format CONFIG over and over for a second and exit" \
+ "\n -S  Run one of the self checks and exit:" \
+ "\n     simd    The SIMD kernels must agree with the scalar ones" \
+ "\n     alloc   The steady-state main loop must not allocate" \
+ "\n     parser  The legacy config parser must behave like the old one" \
+ "\n     workers Slow sensor reads must fall back to the last value at their deadline" \
+ "\n     metrics The metrics exporter must serve what was published in OpenMetrics format" \
+ "\n     cache   Cached hwmon lookups must be dropped when the config or the hwmons change" \
+ "\n -v  Log what thinkfan would log\n"
+
+#define MSG_BENCH_LAYOUT(file, n) file + ": The number of temperatures changes at sample " \
+	+ std::to_string(n) + ". Split the trace at config reloads."
+
+#define MSG_BENCH_ZONES "Fans with a 'sensors:' list aren't supported, since a trace doesn't" \
+	" record which sensor a temperature came from."
+
+namespace thinkfan {
+
+
+/// Feeds the temperatures of the current trace sample into the @a TemperatureState.
+class ReplaySensorDriver : public SensorDriver {
+public:
+	ReplaySensorDriver(unsigned int num_temps)
+	: SensorDriver(false),
+	  num_temps_(num_temps),
+	  temps_(nullptr)
+	{}
+
+	void set_temps(const vector<int> &temps)
+	{ temps_ = &temps; }
+
+protected:
+	virtual void init() override
+	{ set_num_temps(num_temps_); }
+
+	virtual string lookup() override
+	{ return "trace"; }
+
+	virtual string type_name() const override
+	{ return "replay sensor driver"; }
+
+	virtual void read_temps_() override
+	{
+		for (int t : *temps_)
+			temp_state_.add_temp(t);
+	}
+
+private:
+	const unsigned int num_temps_;
+	const vector<int> *temps_;
+};
+
+
+/// Counts the writes it would do instead of doing them.
+class ReplayFanDriver : public FanDriver {
+public:
+	ReplayFanDriver(const string &name)
+	: FanDriver(false),
+	  name_(name),
+	  writes_(0)
+	{}
+
+	virtual void set_speed(const Level &level) override
+	{
+		++writes_;
+		current_speed_ = &speed_str(level);
+	}
+
+	unsigned long writes() const
+	{ return writes_; }
+
+protected:
+	virtual void init() override
+	{}
+
+	virtual string lookup() override
+	{ return name_; }
+
+	virtual string type_name() const override
+	{ return "replay fan driver"; }
+
+	virtual const string &speed_str(const Level &level) const override
+	{ return level.num() == INT_MIN ? level.str() : level.num_str(); }
+
+private:
+	const string name_;
+	unsigned long writes_;
+};
+
+
+static void print_latency(const char *what, const Histogram &hist)
+{
+	std::printf("%s: n=%llu p50=%lldus p99=%lldus max=%lldus\n", what,
+		static_cast<unsigned long long>(hist.count()),
+		static_cast<long long>(hist.percentile(0.5).count()),
+		static_cast<long long>(hist.percentile(0.99).count()),
+		static_cast<long long>(hist.max().count())
+	);
+}
+
+
+static const struct {
+	const char *name;
+	string (*run)();
+} self_checks[] = {
+	{ "simd", simd::self_check },
+	{ "alloc", self_check::alloc },
+	{ "parser", self_check::parser },
+	{ "workers", self_check::workers },
+	{ "metrics", self_check::metrics },
+	{ "cache", self_check::cache },
+};
+
+
+static int run_self_check(const string &name)
+{
+	for (const auto &check : self_checks) {
+		if (name != check.name)
+			continue;
+
+		string failure;
+		try {
+			failure = check.run();
+		} catch (std::exception &e) {
+			failure = e.what();
+		}
+		if (!failure.empty()) {
+			std::fprintf(stderr, "%s self check failed: %s\n", check.name, failure.c_str());
+			return 1;
+		}
+		if (name == "simd")
+			std::printf("simd self check passed, using %s\n", simd::isa());
+		else
+			std::printf("%s self check passed\n", check.name);
+		return 0;
+	}
+
+	std::cerr << "Unknown self check: " << name << std::endl << MSG_BENCH_USAGE;
+	return 3;
+}
+
+
+static int bench_parser(const string &config_file)
+{
+	std::ifstream f(config_file);
+	if (!f.is_open())
+		throw IOerror(config_file + ": ", errno);
+	std::stringstream ss;
+	ss << f.rdbuf();
+	const string data = ss.str();
+
+	unsigned long parses = 0;
+	std::chrono::duration<double> elapsed;
+	auto start = std::chrono::steady_clock::now();
+	do {
+		// Check the clock only every so often, since a small config parses in microseconds
+		for (unsigned int i = 0; i < 64; ++i, ++parses) {
+			const char *input = data.c_str();
+			ConfigParser parser;
+			unique_ptr<Config> config(parser.parse_config(input));
+			if (!config)
+				throw SyntaxError(config_file, parser.get_max_addr() - data.c_str(), data);
+		}
+		elapsed = std::chrono::steady_clock::now() - start;
+	} while (elapsed.count() < 1);
+
+	std::printf("%lu parses in %.3f s: %.1f us/parse, %.1f MiB/s\n",
+		parses, elapsed.count(), elapsed.count() * 1e6 / double(parses),
+		double(data.size()) * double(parses) / elapsed.count() / (1024 * 1024)
+	);
+	return 0;
+}
+
+
+static int bench(const string &trace_file)
+{
+	TraceReader trace(trace_file);
+	const unsigned int num_temps = trace.num_temps();
+
+	// Keep the levels from the real config, but swap the drivers for our mocks
+	unique_ptr<Config> real_config(Config::read_config(config_files));
+	Config config;
+	config.src_file = real_config->src_file;
+	ReplaySensorDriver *sensor = new ReplaySensorDriver(num_temps);
+	config.add_sensor(unique_ptr<SensorDriver>(sensor));
+
+	vector<ReplayFanDriver *> fans;
+	for (unique_ptr<FanConfig> &fan_cfg : real_config->take_fan_configs()) {
+		if (!fan_cfg->zone_ids().empty())
+			throw ExpectedError(MSG_BENCH_ZONES);
+		fans.push_back(new ReplayFanDriver("fan" + std::to_string(fans.size())));
+		fan_cfg->set_fan(unique_ptr<FanDriver>(fans.back()));
+		config.add_fan_config(std::move(fan_cfg));
+	}
+
+	TraceReader::Sample sample;
+	if (!trace.next(sample))
+		throw ExpectedError(trace_file + ": No samples.");
+	sensor->set_temps(sample.temps);
+
+	config.init(temp_state);
+	read_sensors(config);
+	for (auto &fan_config : config.fan_configs())
+		fan_config->init_fanspeed(temp_state);
+	config.commit_fans();
+
+	vector<std::map<string, std::chrono::milliseconds>> time_at_level(fans.size());
+	std::chrono::milliseconds replayed(0);
+	Histogram tick_latency;
+	unsigned long ticks = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	while (trace.next(sample)) {
+		if (sample.temps.size() != num_temps)
+			throw ExpectedError(MSG_BENCH_LAYOUT(trace_file, ticks + 1));
+
+		// The time since the last sample was spent at the level we've set back then
+		replayed += sample.delta;
+		for (size_t i = 0; i < fans.size(); ++i)
+			time_at_level[i][fans[i]->current_speed()] += sample.delta;
+
+		ScopedTimer timer(tick_latency);
+		read_sensors(config);
+		for (auto &fan_config : config.fan_configs()) {
+			if (fan_config->set_fanspeed(temp_state))
+				log(TF_NFY) << temp_state << " -> " << config.fan_configs() << flush;
+		}
+		config.commit_fans();
+		++ticks;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	std::printf("%lu ticks in %.3f s (%.0f ticks/s), replaying %.0f s of recorded time\n",
+		ticks, elapsed.count(), double(ticks) / elapsed.count(),
+		std::chrono::duration<double>(replayed).count()
+	);
+	print_latency("Tick latency", tick_latency);
+	for (size_t i = 0; i < fans.size(); ++i) {
+		std::printf("%s: %lu writes\n", fans[i]->path().c_str(), fans[i]->writes());
+		for (const auto &lvl : time_at_level[i]) {
+			std::printf("  level %s: %.0f s (%.1f %%)\n", lvl.first.c_str(),
+				std::chrono::duration<double>(lvl.second).count(),
+				replayed.count() ? 100.0 * double(lvl.second.count()) / double(replayed.count()) : 0.0
+			);
+		}
+	}
+
+	return 0;
+}
+
+
+} // namespace thinkfan
+
+
+int main(int argc, char **argv)
+{
+	using namespace thinkfan;
+
+	Logger::instance().log_lvl() = TF_WRN;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:c:vP:S:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			try {
+				size_t invalid;
+				bias_level = std::stof(optarg, &invalid) / 10;
+				if (invalid != string(optarg).length())
+					throw std::invalid_argument(optarg);
+			} catch (std::logic_error &) {
+				std::cerr << MSG_OPT_B_INVAL(optarg) << std::endl << MSG_BENCH_USAGE;
+				return 3;
+			}
+			break;
+		case 'c':
+			config_files = vector<string>({ optarg });
+			break;
+		case 'v':
+			Logger::instance().log_lvl() = TF_INF;
+			break;
+		case 'P':
+			try {
+				return bench_parser(optarg);
+			} catch (ExpectedError &e) {
+				log(TF_ERR) << e.what() << flush;
+				return 1;
+			}
+		case 'S':
+			return run_self_check(optarg);
+		case 'h':
+			std::cout << MSG_BENCH_USAGE;
+			return 0;
+		default:
+			std::cerr << MSG_BENCH_USAGE;
+			return 3;
+		}
+	}
+
+	if (optind != argc - 1) {
+		std::cerr << MSG_BENCH_USAGE;
+		return 3;
+	}
+
+	try {
+		return bench(argv[optind]);
+	} catch (ExpectedError &e) {
+		log(TF_ERR) << e.what() << flush;
+		return 1;
+	}
+}
@@ -26,8 +26,13 @@
 #include <cstring>
 #include <cerrno>
 #include <numeric>
+#include <cmath>
 #include "parser.h"
+#include "error.h"
+#include "sensors.h"
+#include "fans.h"
 #include "message.h"
+#include "hwmon.h"
 #include "thinkfan.h"
 
 #ifdef USE_YAML
@@ -47,10 +52,56 @@ const unique_ptr<FanDriver> &FanConfig::fan() const
 void FanConfig::set_fan(unique_ptr<FanDriver> &&fan)
 { fan_ = std::move(fan); }
 
+unique_ptr<FanDriver> FanConfig::take_fan()
+{ return std::move(fan_); }
+
+const Histogram &FanConfig::eval_latency() const
+{ return eval_latency_; }
+
+void FanConfig::set_zone(const vector<string> &sensor_ids)
+{ zone_ids_ = sensor_ids; }
+
+const vector<string> &FanConfig::zone_ids() const
+{ return zone_ids_; }
+
+const TemperatureZone &FanConfig::zone() const
+{ return zone_; }
+
+
+void FanConfig::init_zone(const Config &config)
+{
+	zone_sensors_.clear();
+	vector<unsigned int> temps;
+	unsigned int offset = 0;
+	for (unsigned int i = 0; i < config.sensors().size(); ++i) {
+		const SensorDriver &sensor = *config.sensors()[i];
+		if (zone_ids_.empty() || std::find(zone_ids_.begin(), zone_ids_.end(), sensor.id()) != zone_ids_.end()) {
+			zone_sensors_.push_back(i);
+			for (unsigned int t = 0; t < sensor.num_temps(); ++t)
+				temps.push_back(offset + t);
+		}
+		offset += sensor.num_temps();
+	}
+
+	if (temps.empty() && !zone_ids_.empty())
+		throw ConfigError(MSG_CONF_ZONE_EMPTY);
+	zone_.assign(temps, offset);
+}
+
+
+bool FanConfig::inputs_changed(const vector<bool> &changed_sensors) const
+{
+	for (unsigned int i : zone_sensors_)
+		if (changed_sensors[i])
+			return true;
+	return false;
+}
+
 
 
 StepwiseMapping::StepwiseMapping(unique_ptr<FanDriver> &&fan_drv)
 : FanConfig(std::move(fan_drv))
+, cur_lvl_(0)
 {}
 
 const vector<unique_ptr<Level>> &StepwiseMapping::levels() const
@@ -58,35 +109,45 @@ const vector<unique_ptr<Level>> &StepwiseMapping::levels() const
 
 void StepwiseMapping::init_fanspeed(const TemperatureState &ts)
 {
-	cur_lvl_ = --levels().end();
-	while (cur_lvl_ != levels().begin() && (*cur_lvl_)->down(ts))
-		cur_lvl_--;
-	fan()->set_speed(**cur_lvl_);
+	set_level(table_.evaluate(levels().size() - 1, ts));
 }
 
 bool StepwiseMapping::set_fanspeed(const TemperatureState &ts)
 {
-	if (unlikely(cur_lvl_ != --levels().end() && (*cur_lvl_)->up(ts))) {
-		while (cur_lvl_ != --levels().end() && (*cur_lvl_)->up(ts))
-			cur_lvl_++;
-		fan()->set_speed(**cur_lvl_);
-		return true;
+	size_t next;
+	{
+		ScopedTimer timer(eval_latency_);
+		next = table_.evaluate(cur_lvl_, ts);
 	}
-	else if (unlikely(cur_lvl_ != levels().begin() && (*cur_lvl_)->down(ts))) {
-		while (cur_lvl_ != levels().begin() && (*cur_lvl_)->down(ts))
-			cur_lvl_--;
-		fan()->set_speed(**cur_lvl_);
-		tmp_sleeptime = sleeptime;
+	if (unlikely(next != cur_lvl_)) {
+		if (next < cur_lvl_)
+			tmp_sleeptime = sleeptime;
+		set_level(next);
 		return true;
 	}
 	else {
-		fan()->ping_watchdog_and_depulse(**cur_lvl_);
+		keep_fanspeed();
 		return false;
 	}
 }
 
+void StepwiseMapping::set_level(size_t lvl)
+{
+	cur_lvl_ = lvl;
+	fan()->request_speed(*levels()[cur_lvl_]);
+}
+
+bool StepwiseMapping::keep_fanspeed()
+{
+	fan()->request_speed(*levels()[cur_lvl_]);
+	return false;
+}
+
+void StepwiseMapping::compile(const Config &)
+{ table_.compile(levels(), zone()); }
+
 
-void StepwiseMapping::ensure_consistency(const Config &config) const
+void StepwiseMapping::ensure_consistency(const Config &) const
 {
 	if (levels().size() == 0)
 		throw ConfigError("No fan levels specified.");
@@ -95,7 +156,7 @@ void StepwiseMapping::ensure_consistency(const Config &config) const
 		throw ConfigError("No fan specified in stepwise mapping.");
 
 	for (auto &lvl : levels())
-		lvl->ensure_consistency(config);
+		lvl->ensure_consistency(*this);
 
 	int maxlvl = (*levels_.rbegin())->num();
 	if (dynamic_cast<const HwmonFanDriver *>(fan().get()) && maxlvl < 128)
@@ -133,11 +194,132 @@ void StepwiseMapping::add_level(unique_ptr<Level> &&level)
 
 
 
+/// One shared Level per PWM value, so a CurveMapping can hand out references without allocating.
+static const Level &pwm_level(int pwm)
+{
+	static const vector<unique_ptr<Level>> levels = [] () {
+		vector<unique_ptr<Level>> rv;
+		for (int i = 0; i < int(CurveMapping::table_size); ++i)
+			rv.push_back(std::make_unique<SimpleLevel>(i, numeric_limits<int>::min(), numeric_limits<int>::max()));
+		return rv;
+	} ();
+	return *levels[static_cast<size_t>(pwm)];
+}
+
+
+CurveMapping::CurveMapping(unique_ptr<FanDriver> &&fan_drv)
+: FanConfig(std::move(fan_drv))
+, table_()
+, target_pwm_(0)
+, cur_pwm_(0)
+, step_budget_(0)
+{}
+
+const vector<pair<int, int>> &CurveMapping::points() const
+{ return points_; }
+
+void CurveMapping::set_max_step(unsigned int pwm_per_second)
+{ max_step_ = pwm_per_second; }
+
+
+void CurveMapping::add_point(int temp, int pwm)
+{
+	if (pwm < 0 || pwm >= int(table_size))
+		throw ConfigError(MSG_CONF_CURVE_PWM(pwm));
+	if (points_.size() > 0 && points_.back().first >= temp)
+		throw ConfigError(MSG_CONF_CURVE_ORDER);
+	points_.push_back({ temp, pwm });
+}
+
+
+void CurveMapping::compile(const Config &)
+{
+	auto it = points_.begin();
+	for (int t = 0; t < int(table_size); ++t) {
+		while (it + 1 != points_.end() && (it + 1)->first <= t)
+			++it;
+
+		if (t <= points_.front().first)
+			table_[t] = uint8_t(points_.front().second);
+		else if (it + 1 == points_.end())
+			table_[t] = uint8_t(it->second);
+		else {
+			const pair<int, int> &p0 = *it, &p1 = *(it + 1);
+			table_[t] = uint8_t(std::lround(
+				p0.second + double(p1.second - p0.second) * (t - p0.first) / (p1.first - p0.first)
+			));
+		}
+	}
+}
+
+
+void CurveMapping::init_fanspeed(const TemperatureState &ts)
+{
+	target_pwm_ = cur_pwm_ = table_[size_t(std::clamp(zone().tmax(ts), 0, int(table_size) - 1))];
+	step_budget_ = 0;
+	last_step_ = std::chrono::steady_clock::now();
+	fan()->request_speed(pwm_level(cur_pwm_));
+}
+
+bool CurveMapping::set_fanspeed(const TemperatureState &ts)
+{
+	ScopedTimer timer(eval_latency_);
+	target_pwm_ = table_[size_t(std::clamp(zone().tmax(ts), 0, int(table_size) - 1))];
+	return step();
+}
+
+bool CurveMapping::keep_fanspeed()
+{
+	// The temperatures haven't changed, but we may still be ramping towards the target.
+	return step();
+}
+
+
+bool CurveMapping::step()
+{
+	auto now = std::chrono::steady_clock::now();
+	int next = target_pwm_;
+
+	if (max_step_) {
+		step_budget_ = std::min(
+			step_budget_ + float(*max_step_ * secondsf(now - last_step_).count()),
+			float(table_size)
+		);
+		int allowed = int(step_budget_);
+		next = std::clamp(target_pwm_, cur_pwm_ - allowed, cur_pwm_ + allowed);
+		if (next == target_pwm_)
+			step_budget_ = 0;
+		else
+			step_budget_ -= float(std::abs(next - cur_pwm_));
+	}
+	last_step_ = now;
+
+	bool changed = next != cur_pwm_;
+	cur_pwm_ = next;
+	fan()->request_speed(pwm_level(cur_pwm_));
+	return changed;
+}
+
+
+void CurveMapping::ensure_consistency(const Config &) const
+{
+	if (points_.empty())
+		throw ConfigError(MSG_CONF_CURVE_EMPTY);
+
+	if (!fan())
+		throw ConfigError("No fan specified in curve mapping.");
+
+	if (!dynamic_cast<const HwmonFanDriver *>(fan().get()))
+		throw ConfigError(MSG_CONF_CURVE_FAN);
+}
+
+
+
 
 
-const Config *Config::read_config(const vector<string> &filenames)
+Config *Config::read_config(const vector<string> &filenames)
 {
-	const Config *rv = nullptr;
+	Config *rv = nullptr;
 	for (auto it = filenames.begin(); it != filenames.end(); ++it) {
 		try {
 			rv = try_read_config(*it);
@@ -152,22 +334,12 @@ const Config *Config::read_config(const vector<string> &filenames)
 }
 
 
-const Config *Config::try_read_config(const string &filename)
+Config *Config::try_read_config(const string &filename)
 {
 	Config *rv = nullptr;
 
-	ifstream f_in(filename);
-	if (!(f_in.is_open() && f_in.good()))
-		throw IOerror(filename + ": ", errno);
-	if (!f_in.seekg(0, f_in.end))
-		throw IOerror(filename + ": ", errno);
-	ifstream::pos_type f_size = f_in.tellg();
-	if (!f_in.seekg(0, f_in.beg))
-		throw IOerror(filename + ": ", errno);
 	string f_data;
-	f_data.resize(f_size, 0);
-	if (!f_in.read(&*f_data.begin(), f_size))
-		throw IOerror(filename + ": ", errno);
+	ConfigFingerprint fingerprint = ConfigFingerprint::read(filename, f_data);
 
 #ifdef USE_YAML
 	try	{
@@ -221,11 +393,101 @@ const Config *Config::try_read_config(const string &filename)
 #endif //USE_YAML
 
 	rv->src_file = filename;
+	rv->src_fingerprint = fingerprint;
 
 	return rv;
 }
 
 
+bool Config::reload_needed(const vector<string> &filenames) const
+{
+	// Drivers keep the paths they've found, so they can't be reused if hwmons have moved
+	if (HwmonIndex::instance().check_uevents())
+		return true;
+
+	for (const string &filename : filenames) {
+		string data;
+		try {
+			return filename != src_file || ConfigFingerprint::read(filename, data) != src_fingerprint;
+		} catch (IOerror &e) {
+			if (e.code() != ENOENT)
+				return true;
+		}
+	}
+	return true;
+}
+
+
+void Config::take_over(Config &old)
+{
+	adopted_.clear();
+
+	// Drivers can only be compared once they know their path
+	unsigned int old_offset = 0;
+	vector<pair<SensorDriver *, unsigned int>> old_sensors;
+	for (unique_ptr<SensorDriver> &sensor : old.sensors_) {
+		if (sensor && sensor->available())
+			old_sensors.push_back({ sensor.get(), old_offset });
+		old_offset += sensor ? sensor->num_temps() : 0;
+	}
+
+	for (unique_ptr<SensorDriver> &sensor : sensors_) {
+		if (!sensor->try_lookup())
+			continue;
+		for (auto it = old_sensors.begin(); it != old_sensors.end(); ++it) {
+			if (*sensor == *it->first) {
+				auto old_it = std::find_if(old.sensors_.begin(), old.sensors_.end(),
+					[&] (const unique_ptr<SensorDriver> &s) { return s.get() == it->first; }
+				);
+				log(TF_DBG) << "Keeping " << it->first->name() << flush;
+				adopted_[it->first] = it->second;
+				// E.g. an edited interval or id must still take effect
+				it->first->take_settings(*sensor);
+				sensor = std::move(*old_it);
+				old_sensors.erase(it);
+				break;
+			}
+		}
+	}
+
+	for (unique_ptr<FanConfig> &fan_cfg : temp_mappings_) {
+		if (!fan_cfg->fan() || !fan_cfg->fan()->try_lookup())
+			continue;
+		for (unique_ptr<FanConfig> &old_cfg : old.temp_mappings_) {
+			const unique_ptr<FanDriver> &old_fan = old_cfg->fan();
+			if (old_fan && old_fan->available() && *fan_cfg->fan() == *old_fan) {
+				log(TF_DBG) << "Keeping " << old_fan->name() << flush;
+				// The levels it refers to belong to the old config
+				old_fan->forget_levels();
+				old_fan->take_settings(*fan_cfg->fan());
+				adopted_[old_fan.get()] = 0;
+				fan_cfg->set_fan(old_cfg->take_fan());
+				break;
+			}
+		}
+	}
+}
+
+
+void Config::keep_all() const
+{
+	adopted_.clear();
+	unsigned int offset = 0;
+	for (const unique_ptr<SensorDriver> &sensor : sensors_) {
+		if (sensor->initialized())
+			adopted_[sensor.get()] = offset;
+		offset += sensor->num_temps();
+	}
+	for (const unique_ptr<FanConfig> &fan_cfg : temp_mappings_)
+		if (fan_cfg->fan())
+			adopted_[fan_cfg->fan().get()] = 0;
+}
+
+
+bool Config::adopted(const Driver &drv) const
+{ return drv.initialized() && adopted_.count(&drv); }
+
+
 void Config::ensure_consistency() const
 {
 	// Consistency checks which require the complete config
@@ -269,18 +531,48 @@ const vector<unique_ptr<FanConfig>> &Config::fan_configs() const
 void Config::add_fan_config(unique_ptr<FanConfig> &&fan_cfg)
 { temp_mappings_.push_back(std::move(fan_cfg)); }
 
+vector<unique_ptr<FanConfig>> Config::take_fan_configs()
+{
+	vector<unique_ptr<FanConfig>> rv;
+	rv.swap(temp_mappings_);
+	return rv;
+}
+
 
 void Config::init_fans() const
 {
 	for (const unique_ptr<FanConfig> &fan_cfg : fan_configs())
-		try_init_driver(*fan_cfg->fan());
+		if (!adopted(*fan_cfg->fan()))
+			try_init_driver(*fan_cfg->fan());
+
+	// Several fan configs may resolve to the same fan, e.g. through different hwmon
+	// lookups. Let the first one do all the writing for them.
+	for (auto it = fan_configs().begin(); it != fan_configs().end(); ++it) {
+		FanDriver &fan = *(*it)->fan();
+		fan.alias(nullptr);
+		for (auto prev = fan_configs().begin(); prev != it; ++prev) {
+			FanDriver &other = *(*prev)->fan();
+			if (!other.is_alias() && fan.same_fan(other)) {
+				fan.alias(&other);
+				break;
+			}
+		}
+	}
+}
+
+
+void Config::commit_fans() const
+{
+	for (const unique_ptr<FanConfig> &fan_cfg : fan_configs())
+		fan_cfg->fan()->commit();
 }
 
 
 TemperatureState Config::init_sensors() const
 {
 	for (const unique_ptr<SensorDriver> &sensor : sensors())
-		try_init_driver(*sensor);
+		if (!adopted(*sensor))
+			try_init_driver(*sensor);
 	return TemperatureState(num_temps());
 }
 
@@ -295,10 +587,38 @@ void Config::init_temperature_refs(TemperatureState &tstate) const
 
 void Config::init(TemperatureState &ts) const
 {
-	ts = init_sensors();
+	// Reuse hwmon lookups from the last (re)load unless devices have changed since
+	if (HwmonIndex::instance().check_uevents())
+		ConfigCache::instance().clear();
+	ConfigCache::instance().load(src_fingerprint);
+
+	TemperatureState new_ts = init_sensors();
+
+	// Sensors kept by take_over() continue with their history from the previous config
+	unsigned int offset = 0;
+	for (const unique_ptr<SensorDriver> &sensor : sensors()) {
+		auto it = adopted_.find(sensor.get());
+		if (it != adopted_.end())
+			new_ts.copy(ts, it->second, offset, sensor->num_temps());
+		offset += sensor->num_temps();
+	}
+	ts = std::move(new_ts);
+
 	init_fans();
+	adopted_.clear();
+	for (const unique_ptr<FanConfig> &fan_cfg : fan_configs())
+		try {
+			fan_cfg->init_zone(*this);
+		} catch (ConfigError &err) {
+			err.set_filename(src_file);
+			throw;
+		}
 	ensure_consistency();
+	for (const unique_ptr<FanConfig> &fan_cfg : fan_configs())
+		fan_cfg->compile(*this);
 	init_temperature_refs(ts);
+
+	ConfigCache::instance().save();
 }
 
 
@@ -326,6 +646,7 @@ Level::Level(string level, int lower_limit, int upper_limit)
 Level::Level(int level, const vector<int> &lower_limit, const vector<int> &upper_limit)
 : level_s_("level " + std::to_string(level)),
   level_n_(level),
+  num_s_(std::to_string(level_n_)),
   lower_limit_(lower_limit),
   upper_limit_(upper_limit)
 {}
@@ -333,6 +654,7 @@ Level::Level(int level, const vector<int> &lower_limit, const vector<int> &upper
 Level::Level(string level, const vector<int> &lower_limit, const vector<int> &upper_limit)
 : level_s_(level),
   level_n_(string_to_int(level_s_)),
+  num_s_(std::to_string(level_n_)),
   lower_limit_(lower_limit),
   upper_limit_(upper_limit)
 {
@@ -376,6 +698,9 @@ const string &Level::str() const
 int Level::num() const
 { return this->level_n_; }
 
+const string &Level::num_str() const
+{ return this->num_s_; }
+
 
 
 SimpleLevel::SimpleLevel(int level, int lower_limit, int upper_limit)
@@ -392,7 +717,7 @@ bool SimpleLevel::up(const TemperatureState &temp_state) const
 bool SimpleLevel::down(const TemperatureState &temp_state) const
 { return *temp_state.tmax < lower_limit().front(); }
 
-void SimpleLevel::ensure_consistency(const Config &) const
+void SimpleLevel::ensure_consistency(const FanConfig &) const
 {}
 
 
@@ -433,23 +758,25 @@ bool ComplexLevel::down(const TemperatureState &temp_state) const
 }
 
 
-void ComplexLevel::ensure_consistency(const Config &cfg) const
+void ComplexLevel::ensure_consistency(const FanConfig &fan_cfg) const
 {
 	string limitstr;
 
 	const string restmsg = " must have the length "
-		+ std::to_string(cfg.num_temps())
-		+ " (one entry for each configured sensor)"
+		+ std::to_string(fan_cfg.zone().size())
+		+ (fan_cfg.zone_ids().empty()
+			? " (one entry for each configured sensor)"
+			: " (one entry for each temperature of the fan's sensors)")
 	;
 
-	if (lower_limit().size() != cfg.num_temps())
+	if (lower_limit().size() != fan_cfg.zone().size())
 		throw ConfigError(
 			"Lower limit "
 			+ format_limit(lower_limit())
 			+ restmsg
 		);
 
-	if (upper_limit().size() != cfg.num_temps())
+	if (upper_limit().size() != fan_cfg.zone().size())
 		throw ConfigError(
 			"Upper limit "
 			+ format_limit(upper_limit())
@@ -23,11 +23,17 @@
 #define THINKFAN_CONFIG_H_
 
 #include "temperature_state.h"
+#include "level_table.h"
+#include "stats.h"
+#include "config_cache.h"
 
 #include <string>
 #include <vector>
 #include <memory>
 #include <map>
+#include <unordered_map>
+#include <array>
+#include <cstdint>
 
 #include "thinkfan.h"
 
@@ -39,12 +45,45 @@ public:
 	virtual ~FanConfig() = default;
 	virtual void init_fanspeed(const TemperatureState &) = 0;
 	virtual bool set_fanspeed(const TemperatureState &) = 0;
+
+	/** @brief Called instead of @a set_fanspeed() when no temperature has changed.
+	 *  @return Whether the requested speed changed anyway, e.g. while ramping. */
+	virtual bool keep_fanspeed() = 0;
+
+	// Both of the above only request a speed from the fan driver. Nothing is written
+	// before Config::commit_fans().
+
+	/// Prepare for @a set_fanspeed() once the number of temperatures is known.
+	virtual void compile(const Config &) = 0;
+
 	virtual void ensure_consistency(const Config &) const = 0;
 	void set_fan(unique_ptr<FanDriver> &&);
 	const unique_ptr<FanDriver> &fan() const;
+	unique_ptr<FanDriver> take_fan();
+
+	/// Only depend on the sensors with these ids (cf. @a SensorDriver::id()). All if empty.
+	void set_zone(const vector<string> &sensor_ids);
+	const vector<string> &zone_ids() const;
+
+	/// Find the sensors and temperatures in our zone. Must be called before @a compile().
+	void init_zone(const Config &);
+	const TemperatureZone &zone() const;
+
+	/** @brief Whether any sensor in our zone has changed.
+	 *  @param changed_sensors Indexed like @a Config::sensors() */
+	bool inputs_changed(const vector<bool> &changed_sensors) const;
+
+	/// How long it takes to map the temperatures to a fan speed
+	const Histogram &eval_latency() const;
+
+protected:
+	Histogram eval_latency_;
 
 private:
 	unique_ptr<FanDriver> fan_;
+	vector<string> zone_ids_;
+	vector<unsigned int> zone_sensors_;
+	TemperatureZone zone_;
 };
 
 
@@ -54,13 +93,55 @@ public:
 	virtual ~StepwiseMapping() override = default;
 	virtual void init_fanspeed(const TemperatureState &) override;
 	virtual bool set_fanspeed(const TemperatureState &) override;
+	virtual bool keep_fanspeed() override;
+	virtual void compile(const Config &) override;
 	virtual void ensure_consistency(const Config &) const override;
 	void add_level(unique_ptr<Level> &&level);
 	const vector<unique_ptr<Level>> &levels() const;
 
 private:
+	void set_level(size_t lvl);
+
 	vector<unique_ptr<Level>> levels_;
-	vector<unique_ptr<Level>>::const_iterator cur_lvl_;
+	size_t cur_lvl_;
+	LevelTable table_;
+};
+
+
+/** @brief Maps the highest (biased) temperature to a PWM value by linear interpolation
+ *  between the points of a curve. The curve is sampled into a table indexed by degrees
+ *  Celsius at config time, so an update is a single lookup.
+ *  Optionally, the PWM value is only allowed to change by so much per second. */
+class CurveMapping : public FanConfig {
+public:
+	CurveMapping(unique_ptr<FanDriver> && = nullptr);
+	virtual ~CurveMapping() override = default;
+	virtual void init_fanspeed(const TemperatureState &) override;
+	virtual bool set_fanspeed(const TemperatureState &) override;
+	virtual bool keep_fanspeed() override;
+	virtual void compile(const Config &) override;
+	virtual void ensure_consistency(const Config &) const override;
+
+	/// @param pwm Fan speed at @a temp. Temperatures must be added in increasing order.
+	void add_point(int temp, int pwm);
+	const vector<pair<int, int>> &points() const;
+
+	/// Change the PWM value by at most @a pwm_per_second.
+	void set_max_step(unsigned int pwm_per_second);
+
+	static constexpr size_t table_size = 256;
+
+private:
+	/// Move towards @a target_pwm_ as far as the rate limit allows.
+	bool step();
+
+	vector<pair<int, int>> points_;
+	std::array<uint8_t, table_size> table_;
+	opt<unsigned int> max_step_;
+	int target_pwm_;
+	int cur_pwm_;
+	float step_budget_;
+	std::chrono::steady_clock::time_point last_step_;
 };
 
 
@@ -68,6 +149,7 @@ class Level {
 protected:
 	string level_s_;
 	int level_n_;
+	string num_s_;
 	vector<int> lower_limit_;
 	vector<int> upper_limit_;
 public:
@@ -84,11 +166,14 @@ public:
 	virtual bool up(const TemperatureState &) const = 0;
 	virtual bool down(const TemperatureState &) const = 0;
 
-	virtual void ensure_consistency(const Config &) const = 0;
+	virtual void ensure_consistency(const FanConfig &) const = 0;
 
 	const string &str() const;
 	int num() const;
 
+	/// @a num() as a string, precomputed so setting a hwmon fan speed doesn't allocate.
+	const string &num_str() const;
+
 	static int string_to_int(string &level);
 };
 
@@ -100,7 +185,7 @@ public:
 	SimpleLevel(string level, int lower_limit, int upper_limit);
 	virtual bool up(const TemperatureState &) const override;
 	virtual bool down(const TemperatureState &) const override;
-	virtual void ensure_consistency(const Config &) const override;
+	virtual void ensure_consistency(const FanConfig &) const override;
 };
 
 
@@ -110,7 +195,7 @@ public:
 	ComplexLevel(string level, const vector<int> &lower_limit, const vector<int> &upper_limit);
 	virtual bool up(const TemperatureState &) const override;
 	virtual bool down(const TemperatureState &) const override;
-	virtual void ensure_consistency(const Config &) const override;
+	virtual void ensure_consistency(const FanConfig &) const override;
 
 private:
 	static string format_limit(const vector<int> &limit);
@@ -122,11 +207,18 @@ public:
 	Config() = default;
 	~Config() = default;
 
-	static const Config *read_config(const vector<string> &filenames);
+	static Config *read_config(const vector<string> &filenames);
 	void add_sensor(unique_ptr<SensorDriver> &&sensor);
 	void add_fan_config(unique_ptr<FanConfig> &&fan_cfg);
+
+	/// Remove all fan configs from this config, e.g. to run them with different drivers.
+	vector<unique_ptr<FanConfig>> take_fan_configs();
 	void ensure_consistency() const;
 	void init_fans() const;
+
+	/// Write the speeds requested by all fan configs, once per fan.
+	void commit_fans() const;
+
 	TemperatureState init_sensors() const;
 	void init_temperature_refs(TemperatureState &tstate) const;
 	void init(TemperatureState &ts) const;
@@ -135,12 +227,33 @@ public:
 	const vector<unique_ptr<SensorDriver>> &sensors() const;
 	const vector<unique_ptr<FanConfig>> &fan_configs() const;
 
+	/** @brief Check whether a SIGHUP needs to parse the config again.
+	 *  @return false if @a filenames still resolve to our unchanged @a src_file and no hwmon
+	 *  devices have come or gone. */
+	bool reload_needed(const vector<string> &filenames) const;
+
+	/** @brief Move all drivers that are unchanged in this (new) config over from @a old, so
+	 *  they don't have to be torn down and re-initialized, and their temperature history
+	 *  survives. Fans in particular won't fall back to their initial state in between.
+	 *  Must be called before @a old is destroyed and before @a init(). */
+	void take_over(Config &old);
+
+	/** @brief Let the next @a init() keep all drivers that are running, with their temperature
+	 *  history, e.g. after a SIGHUP when nothing has changed. */
+	void keep_all() const;
+
 	string src_file;
+	ConfigFingerprint src_fingerprint;
 private:
-	static const Config *try_read_config(const string &data);
+	static Config *try_read_config(const string &data);
 	void try_init_driver(Driver &drv) const;
+	bool adopted(const Driver &drv) const;
 	vector<unique_ptr<SensorDriver>> sensors_;
 	vector<unique_ptr<FanConfig>> temp_mappings_;
+
+	/// Drivers that @a take_over() or @a keep_all() has kept, with their offset in the previous TemperatureState
+	/// (sensors only). Consumed by the next @a init().
+	mutable std::unordered_map<const Driver *, unsigned int> adopted_;
 };
 
 
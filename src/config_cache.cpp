@@ -0,0 +1,338 @@
+/********************************************************************
+ * config_cache.cpp: Persistent cache of hwmon lookups
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "config_cache.h"
+#include "error.h"
+#include "message.h"
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+
+namespace thinkfan {
+
+
+/*----------------------------------------------------------------------------
+| ConfigFingerprint                                                          |
+----------------------------------------------------------------------------*/
+
+ConfigFingerprint ConfigFingerprint::read(const string &filename, string &data)
+{
+	int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw IOerror(filename + ": ", errno);
+
+	ConfigFingerprint rv;
+	struct stat st;
+	if (::fstat(fd, &st)) {
+		int err = errno;
+		::close(fd);
+		throw IOerror(filename + ": ", err);
+	}
+	rv.size = uint64_t(st.st_size);
+	rv.mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+	data.resize(size_t(st.st_size));
+	size_t off = 0;
+	while (off < data.size()) {
+		ssize_t len = ::read(fd, &data[off], data.size() - off);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0) {
+			int err = errno;
+			::close(fd);
+			throw IOerror(filename + ": ", err);
+		}
+		if (len == 0)
+			break;
+		off += size_t(len);
+	}
+	data.resize(off);
+	::close(fd);
+
+	// 64 bit FNV-1a
+	rv.hash = 0xcbf29ce484222325ULL;
+	for (char c : data) {
+		rv.hash ^= static_cast<unsigned char>(c);
+		rv.hash *= 0x100000001b3ULL;
+	}
+
+	return rv;
+}
+
+
+bool ConfigFingerprint::operator == (const ConfigFingerprint &other) const
+{ return hash == other.hash && size == other.size && mtime_ns == other.mtime_ns; }
+
+bool ConfigFingerprint::operator != (const ConfigFingerprint &other) const
+{ return !(*this == other); }
+
+
+
+/*----------------------------------------------------------------------------
+| ConfigCache                                                                |
+----------------------------------------------------------------------------*/
+
+// Bump when the format changes
+static constexpr char cache_magic[8] = { 'T', 'F', 'C', 'A', 'C', 'H', 'E', '2' };
+
+
+ConfigCache::ConfigCache()
+: dirty_(false)
+{}
+
+
+ConfigCache &ConfigCache::instance()
+{
+	static ConfigCache instance;
+	return instance;
+}
+
+
+void ConfigCache::load(const ConfigFingerprint &fp)
+{
+	if (fingerprint_ == fp)
+		return;
+
+	entries_.clear();
+	fingerprint_ = fp;
+	dirty_ = false;
+
+	if (!read_file()) {
+		entries_.clear();
+		dirty_ = true;
+	}
+}
+
+
+const ConfigCache::Entry *ConfigCache::find(const string &key) const
+{
+	auto it = entries_.find(key);
+	if (it == entries_.end())
+		return nullptr;
+	return &it->second;
+}
+
+
+void ConfigCache::store(const string &key, Entry &&entry)
+{
+	entries_[key] = std::move(entry);
+	dirty_ = true;
+}
+
+
+void ConfigCache::drop(const string &key)
+{
+	if (entries_.erase(key))
+		dirty_ = true;
+}
+
+
+void ConfigCache::clear()
+{
+	if (!entries_.empty())
+		dirty_ = true;
+	entries_.clear();
+}
+
+
+#if defined(CACHE_FILE)
+
+static void put_u64(string &buf, uint64_t v)
+{
+	for (int i = 0; i < 8; ++i)
+		buf += char((v >> (8 * i)) & 0xff);
+}
+
+static void put_str(string &buf, const string &s)
+{
+	put_u64(buf, s.length());
+	buf += s;
+}
+
+static bool get_u64(const char *&p, const char *end, uint64_t &v)
+{
+	if (end - p < 8)
+		return false;
+	v = 0;
+	for (int i = 0; i < 8; ++i)
+		v |= uint64_t(static_cast<unsigned char>(*p++)) << (8 * i);
+	return true;
+}
+
+static bool get_str(const char *&p, const char *end, string &s)
+{
+	uint64_t len;
+	if (!get_u64(p, end, len) || uint64_t(end - p) < len)
+		return false;
+	s.assign(p, len);
+	p += len;
+	return true;
+}
+
+
+/** @brief Identifies the set of hwmon devices, since a lookup by name or model that was unique
+ *  when it was cached may have become ambiguous, which checking the cached entry can't tell. */
+static uint64_t hwmon_devices_hash()
+{
+	vector<string> devices;
+	if (DIR *d = ::opendir("/sys/class/hwmon")) {
+		while (const struct dirent *entry = ::readdir(d)) {
+			if (entry->d_name[0] == '.')
+				continue;
+			// The link target is the device's place in the hierarchy
+			char target[PATH_MAX];
+			const string link = string("/sys/class/hwmon/") + entry->d_name;
+			ssize_t len = ::readlink(link.c_str(), target, sizeof(target));
+			devices.push_back(link + '\0' + string(target, size_t(std::max<ssize_t>(len, 0))));
+		}
+		::closedir(d);
+	}
+	std::sort(devices.begin(), devices.end());
+
+	// 64 bit FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (const string &device : devices) {
+		for (char c : device + '\0') {
+			hash ^= static_cast<unsigned char>(c);
+			hash *= 0x100000001b3ULL;
+		}
+	}
+	return hash;
+}
+
+
+bool ConfigCache::read_file()
+{
+	string data;
+	try {
+		ConfigFingerprint::read(CACHE_FILE, data);
+	} catch (IOerror &e) {
+		if (e.code() != ENOENT)
+			log(TF_DBG) << "Ignoring cache: " << e.what() << flush;
+		return false;
+	}
+
+	auto corrupt = [] () {
+		log(TF_DBG) << MSG_CACHE_CORRUPT(CACHE_FILE) << flush;
+		return false;
+	};
+
+	const char *p = data.data();
+	const char *end = p + data.size();
+	if (data.size() < sizeof(cache_magic) || std::memcmp(p, cache_magic, sizeof(cache_magic)))
+		return corrupt();
+	p += sizeof(cache_magic);
+
+	uint64_t hash, size, mtime, devices, count;
+	if (!get_u64(p, end, hash) || !get_u64(p, end, size) || !get_u64(p, end, mtime)
+		|| !get_u64(p, end, devices) || !get_u64(p, end, count)
+	)
+		return corrupt();
+	if (hash != fingerprint_->hash || size != fingerprint_->size
+		|| int64_t(mtime) != fingerprint_->mtime_ns
+	) {
+		log(TF_DBG) << MSG_CACHE_STALE(CACHE_FILE) << flush;
+		return false;
+	}
+	if (devices != hwmon_devices_hash()) {
+		log(TF_DBG) << MSG_CACHE_DEVICES(CACHE_FILE) << flush;
+		return false;
+	}
+
+	for (uint64_t i = 0; i < count; ++i) {
+		string key;
+		Entry entry;
+		uint64_t num_paths;
+		if (!get_str(p, end, key) || !get_str(p, end, entry.hwmon_dir) || !get_u64(p, end, num_paths))
+			return corrupt();
+		for (uint64_t j = 0; j < num_paths; ++j) {
+			string path;
+			if (!get_str(p, end, path))
+				return corrupt();
+			entry.paths.push_back(std::move(path));
+		}
+		entries_.emplace(std::move(key), std::move(entry));
+	}
+
+	if (p != end)
+		return corrupt();
+
+	log(TF_DBG) << MSG_CACHE_LOADED(CACHE_FILE, static_cast<unsigned int>(entries_.size())) << flush;
+	return true;
+}
+
+
+void ConfigCache::save()
+{
+	if (!dirty_ || !fingerprint_)
+		return;
+
+	string buf(cache_magic, sizeof(cache_magic));
+	put_u64(buf, fingerprint_->hash);
+	put_u64(buf, fingerprint_->size);
+	put_u64(buf, uint64_t(fingerprint_->mtime_ns));
+	put_u64(buf, hwmon_devices_hash());
+	put_u64(buf, entries_.size());
+	for (const auto &kv : entries_) {
+		put_str(buf, kv.first);
+		put_str(buf, kv.second.hwmon_dir);
+		put_u64(buf, kv.second.paths.size());
+		for (const string &path : kv.second.paths)
+			put_str(buf, path);
+	}
+
+	// Write a temporary file and rename() it over the old one so a crash can't leave
+	// a truncated cache behind.
+	const string tmp_file(CACHE_FILE ".tmp");
+	int fd = ::open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		log(TF_DBG) << MSG_CACHE_WRITE(CACHE_FILE) << strerror(errno) << flush;
+		return;
+	}
+	bool ok = ::write(fd, buf.data(), buf.size()) == ssize_t(buf.size());
+	int err = errno;
+	ok = (::close(fd) == 0) && ok;
+	if (ok && ::rename(tmp_file.c_str(), CACHE_FILE) == 0)
+		dirty_ = false;
+	else {
+		log(TF_DBG) << MSG_CACHE_WRITE(CACHE_FILE) << strerror(ok ? errno : err) << flush;
+		::unlink(tmp_file.c_str());
+	}
+}
+
+#else
+
+bool ConfigCache::read_file()
+{ return false; }
+
+void ConfigCache::save()
+{ dirty_ = false; }
+
+#endif // defined(CACHE_FILE)
+
+
+} // namespace thinkfan
@@ -0,0 +1,84 @@
+#pragma once
+
+/********************************************************************
+ * config_cache.h: Persistent cache of hwmon lookups
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "thinkfan.h"
+
+#include <cstdint>
+#include <unordered_map>
+
+namespace thinkfan {
+
+
+/// Identifies the exact contents of a config file.
+struct ConfigFingerprint {
+	uint64_t hash = 0;
+	uint64_t size = 0;
+	int64_t mtime_ns = 0;
+
+	/// Read @a filename into @a data and fingerprint it. Throws an @a IOerror on failure.
+	static ConfigFingerprint read(const string &filename, string &data);
+
+	bool operator == (const ConfigFingerprint &other) const;
+	bool operator != (const ConfigFingerprint &other) const;
+};
+
+
+/** @brief Keeps the results of hwmon lookups in CACHE_FILE so a restart with an unchanged
+ *  config doesn't have to walk sysfs again. The whole cache is dropped when the config's
+ *  @a ConfigFingerprint changes, and every entry is checked before it's used since hwmons
+ *  may be renumbered at any time (e.g. by a module reload on resume). CACHE_FILE is also
+ *  ignored when the set of hwmon devices has changed since it was written. It should be
+ *  on a tmpfs so it doesn't survive a reboot. */
+class ConfigCache {
+public:
+	struct Entry {
+		string hwmon_dir;     ///< Where the name/model lookup ended up
+		vector<string> paths; ///< The files that were found in there
+	};
+
+	static ConfigCache &instance();
+
+	/// Switch to the config identified by @a fp, loading its entries from CACHE_FILE if possible.
+	void load(const ConfigFingerprint &fp);
+
+	const Entry *find(const string &key) const;
+	void store(const string &key, Entry &&entry);
+	void drop(const string &key);
+
+	/// Drop all entries, e.g. because hwmon devices have come or gone.
+	void clear();
+
+	/// Write CACHE_FILE if any entries have changed.
+	void save();
+
+private:
+	ConfigCache();
+	bool read_file();
+
+	opt<ConfigFingerprint> fingerprint_;
+	std::unordered_map<string, Entry> entries_;
+	bool dirty_;
+};
+
+
+} // namespace thinkfan
@@ -0,0 +1,362 @@
+/********************************************************************
+ * control.cpp: Runtime control over a UNIX socket
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "control.h"
+#include "config.h"
+#include "sensors.h"
+#include "fans.h"
+#include "event_loop.h"
+#include "error.h"
+#include "message.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+namespace thinkfan {
+
+
+ControlServer *ControlServer::instance_ = nullptr;
+
+
+ControlServer::ControlServer(const string &path)
+: path_(path)
+, listen_fd_(-1)
+, config_(nullptr)
+{
+	if (instance_)
+		throw Bug("Attempt to create a second ControlServer");
+
+	struct sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.empty() || path[0] != '/' || path.length() >= sizeof(addr.sun_path))
+		throw InvocationError(MSG_CONTROL_PATH(path));
+	std::strcpy(addr.sun_path, path.c_str());
+
+	// Remove a stale socket left behind by a killed instance
+	struct stat st;
+	if (::lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+		::unlink(addr.sun_path);
+
+	listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (listen_fd_ < 0)
+		throw IOerror(MSG_CONTROL_SOCKET(path), errno);
+
+	// Anyone who can connect can stop the fan, so don't rely on the umask
+	mode_t old_umask = ::umask(0177);
+	int rv = ::bind(listen_fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+	::umask(old_umask);
+	if (rv || ::listen(listen_fd_, 4)) {
+		int err = errno;
+		::close(listen_fd_);
+		throw IOerror(MSG_CONTROL_SOCKET(path), err);
+	}
+
+	EventLoop::instance().add_handler(listen_fd_, [this] () { accept_client(); });
+	log(TF_NFY) << MSG_CONTROL_LISTENING(path) << flush;
+	instance_ = this;
+}
+
+
+ControlServer::~ControlServer()
+{
+	while (!clients_.empty())
+		close_client(clients_.begin()->first);
+	EventLoop::instance().remove_handler(listen_fd_);
+	::close(listen_fd_);
+	::unlink(path_.c_str());
+	instance_ = nullptr;
+}
+
+
+ControlServer *ControlServer::instance()
+{ return instance_; }
+
+
+void ControlServer::set_config(const Config *config)
+{ config_ = config; }
+
+
+void ControlServer::accept_client()
+{
+	int fd;
+	while ((fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+		if (clients_.size() >= max_clients_) {
+			send_reply(fd, "ERR Too many clients\n");
+			::close(fd);
+			continue;
+		}
+		try {
+			EventLoop::instance().add_handler(fd, [this, fd] () { handle_client(fd); });
+		} catch (IOerror &e) {
+			log(TF_ERR) << e.what() << flush;
+			::close(fd);
+			continue;
+		}
+		clients_[fd];
+	}
+}
+
+
+void ControlServer::handle_client(int fd)
+{
+	string &buf = clients_[fd];
+	char data[512];
+	ssize_t n;
+	while ((n = ::recv(fd, data, sizeof(data), 0)) > 0)
+		buf.append(data, size_t(n));
+	bool eof = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+
+	string::size_type eol;
+	while ((eol = buf.find('\n')) != string::npos) {
+		string line = buf.substr(0, eol);
+		buf.erase(0, eol + 1);
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (!send_reply(fd, execute(line))) {
+			close_client(fd);
+			return;
+		}
+	}
+
+	if (buf.length() > max_line_) {
+		send_reply(fd, "ERR Line too long\n");
+		eof = true;
+	}
+	if (eof)
+		close_client(fd);
+}
+
+
+void ControlServer::close_client(int fd)
+{
+	EventLoop::instance().remove_handler(fd);
+	clients_.erase(fd);
+	::close(fd);
+}
+
+
+bool ControlServer::send_reply(int fd, const string &reply)
+{
+	// Replies are short, so a client that doesn't read them isn't worth waiting for
+	ssize_t n = ::send(fd, reply.data(), reply.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+	return n == ssize_t(reply.length());
+}
+
+
+const Config &ControlServer::config() const
+{
+	if (!config_)
+		throw ExpectedError("Not running, try again later");
+	return *config_;
+}
+
+
+static bool parse_index(const string &id, size_t &index)
+{
+	if (id.empty() || id.find_first_not_of("0123456789") != string::npos)
+		return false;
+	try {
+		index = std::stoul(id);
+		return true;
+	} catch (std::out_of_range &) {
+		return false;
+	}
+}
+
+
+FanDriver &ControlServer::find_fan(const string &id) const
+{
+	const vector<unique_ptr<FanConfig>> &fans = config().fan_configs();
+	size_t index;
+	if (parse_index(id, index)) {
+		if (index < fans.size())
+			return *fans[index]->fan();
+	}
+	else {
+		for (const unique_ptr<FanConfig> &fan_cfg : fans)
+			if (fan_cfg->fan()->available() && fan_cfg->fan()->path() == id)
+				return *fan_cfg->fan();
+	}
+	throw ExpectedError("No such fan: " + id);
+}
+
+
+SensorDriver &ControlServer::find_sensor(const string &id) const
+{
+	const vector<unique_ptr<SensorDriver>> &sensors = config().sensors();
+	size_t index;
+	if (parse_index(id, index)) {
+		if (index < sensors.size())
+			return *sensors[index];
+	}
+	else {
+		for (const unique_ptr<SensorDriver> &sensor : sensors)
+			if (sensor->id() == id || (sensor->available() && sensor->path() == id))
+				return *sensor;
+	}
+	throw ExpectedError("No such sensor: " + id);
+}
+
+
+/// Refuse anything the fan would reject, since a failed write counts as a driver error.
+static void check_level(const FanDriver &fan, const Level &level)
+{
+	if (dynamic_cast<const HwmonFanDriver *>(&fan)) {
+		if (level.num() < 0 || level.num() > 255)
+			throw ExpectedError("PWM value must be between 0 and 255: " + level.str());
+	}
+	else if (dynamic_cast<const TpFanDriver *>(&fan)) {
+		if (level.num() != INT_MIN && (level.num() < 0 || level.num() > 7))
+			throw ExpectedError("tpacpi level must be between 0 and 7: " + level.str());
+	}
+}
+
+
+string ControlServer::execute(const string &line)
+{
+	std::istringstream in(line);
+	vector<string> args;
+	for (string arg; in >> arg; )
+		args.push_back(arg);
+	if (args.empty())
+		return "ERR Empty command\n";
+
+	log(TF_INF) << MSG_CONTROL_COMMAND(line) << flush;
+	const string &cmd = args[0];
+
+	try {
+		if (cmd == "pin" && args.size() >= 4) {
+			// The level may contain spaces, e.g. "level auto"
+			string level_str = args[2];
+			for (size_t i = 3; i + 1 < args.size(); ++i)
+				level_str += " " + args[i];
+
+			size_t invalid = 0;
+			double secs = 0;
+			try {
+				secs = std::stod(args.back(), &invalid);
+			} catch (std::logic_error &) {}
+			if (invalid < args.back().length() || !std::isfinite(secs) || secs <= 0 || secs > 86400)
+				throw ExpectedError("Duration must be between 0 and 86400 seconds: " + args.back());
+
+			FanDriver &fan = find_fan(args[1]);
+			if (!fan.available())
+				throw ExpectedError("Fan " + args[1] + " isn't available");
+			unique_ptr<const Level> level(new SimpleLevel(level_str, INT_MIN, INT_MAX));
+			check_level(fan, *level);
+			fan.pin(std::move(level), std::chrono::steady_clock::now()
+				+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(secondsf(secs)));
+		}
+		else if (cmd == "unpin" && args.size() == 2)
+			find_fan(args[1]).unpin();
+		else if (cmd == "bias" && args.size() == 2)
+			bias_level = parse_bias(args[1]);
+		else if (cmd == "sleeptime" && args.size() == 2) {
+			sleeptime = parse_sleeptime(args[1]);
+			// The scheduler brings forward the sensors that are due later than that
+			tmp_sleeptime = std::min(tmp_sleeptime, sleeptime);
+		}
+		else if (cmd == "tolerate" && args.size() == 2) {
+			size_t index;
+			if (!parse_index(args[1], index) || index > 255)
+				throw ExpectedError("Number of loops must be between 0 and 255: " + args[1]);
+			tolerate_errors = static_cast<unsigned char>(index);
+		}
+		else if (cmd == "reinit" && args.size() == 3 && args[1] == "fan") {
+			FanDriver &fan = find_fan(args[2]);
+			fan.reinit();
+			if (!fan.initialized())
+				throw ExpectedError("Could not re-initialize " + fan.name());
+		}
+		else if (cmd == "reinit" && args.size() == 3 && args[1] == "sensor") {
+			SensorDriver &sensor = find_sensor(args[2]);
+			const unsigned int num_temps = sensor.available() ? sensor.num_temps() : 0;
+			sensor.reinit();
+			if (!sensor.initialized())
+				throw ExpectedError("Could not re-initialize " + sensor.name());
+			if (sensor.num_temps() != num_temps) {
+				// The temperature state can't change its layout under the running config
+				interrupted = SIGHUP;
+				return "OK Number of temperatures has changed, reloading\n";
+			}
+		}
+		else if (cmd == "status" && args.size() == 1)
+			return status() + "OK\n";
+		else
+			throw ExpectedError("Invalid command: " + line);
+	} catch (ExpectedError &e) {
+		return string("ERR ") + e.what() + "\n";
+	}
+
+	// Let the main loop apply it right away instead of after the next sleep
+	EventLoop::instance().wake();
+	return "OK\n";
+}
+
+
+string ControlServer::status() const
+{
+	string rv;
+	char buf[64];
+
+	std::snprintf(buf, sizeof(buf), "bias %g\n", double(bias_level * 10));
+	rv += buf;
+	std::snprintf(buf, sizeof(buf), "sleeptime %g\n", secondsf(sleeptime).count());
+	rv += buf;
+	rv += "tolerate " + std::to_string(tolerate_errors) + "\n";
+
+	if (!config_)
+		return rv;
+
+	unsigned int idx = 0;
+	for (const unique_ptr<SensorDriver> &sensor : config_->sensors()) {
+		rv += "sensor " + std::to_string(idx++) + " " + sensor->name()
+			+ " errors=" + std::to_string(sensor->total_errors()) + "\n";
+	}
+
+	idx = 0;
+	auto now = std::chrono::steady_clock::now();
+	for (const unique_ptr<FanConfig> &fan_cfg : config_->fan_configs()) {
+		const FanDriver &fan = *fan_cfg->fan();
+		rv += "fan " + std::to_string(idx++) + " " + fan.name() + " speed=" + fan.current_speed();
+		if (fan.pinned()) {
+			std::snprintf(buf, sizeof(buf), "%.1f", secondsf(fan.pinned_until() - now).count());
+			rv += " pinned=\"" + fan.pinned()->str() + "\" remaining=" + buf;
+		}
+		rv += "\n";
+	}
+
+	return rv;
+}
+
+
+} // namespace thinkfan
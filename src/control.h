@@ -0,0 +1,75 @@
+#pragma once
+
+/********************************************************************
+ * control.h: Runtime control over a UNIX socket
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "thinkfan.h"
+
+#include <unordered_map>
+
+namespace thinkfan {
+
+
+/** @brief Accepts line-based commands on a UNIX socket to pin fans, change the bias or
+ *  sleeptime, re-initialize single drivers and tolerate errors, i.e. what otherwise needs
+ *  command line options or signals, but without reloading anything. Each command is
+ *  answered with any number of data lines followed by one that starts with "OK" or "ERR".
+ *  Clients are served from within @a EventLoop::wait_until(), so commands never race with
+ *  the main loop. Like the @a MetricsExporter, there is at most one instance, which must be
+ *  created after the @a EventLoop. */
+class ControlServer {
+public:
+	/// @param path Absolute path of the socket, which is made accessible only to our user.
+	ControlServer(const string &path);
+	~ControlServer();
+	ControlServer(const ControlServer &) = delete;
+
+	/// @return The running server or nullptr if there is none.
+	static ControlServer *instance();
+
+	/** @brief Commands that refer to fans or sensors are refused while @a config is nullptr,
+	 *  e.g. during a reload. */
+	void set_config(const Config *config);
+
+private:
+	void accept_client();
+	void handle_client(int fd);
+	void close_client(int fd);
+	bool send_reply(int fd, const string &reply);
+
+	string execute(const string &line);
+	string status() const;
+	const Config &config() const;
+	FanDriver &find_fan(const string &id) const;
+	SensorDriver &find_sensor(const string &id) const;
+
+	static ControlServer *instance_;
+	static constexpr size_t max_clients_ = 8;
+	static constexpr size_t max_line_ = 256;
+
+	const string path_;
+	int listen_fd_;
+	std::unordered_map<int, string> clients_; // Unprocessed input by fd
+	const Config *config_;
+};
+
+
+} // namespace thinkfan
@@ -0,0 +1,205 @@
+/********************************************************************
+ * device_file.cpp: Persistently opened sysfs/procfs files
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "device_file.h"
+#include "error.h"
+#include "message.h"
+
+#include <unistd.h>
+#include <cerrno>
+#include <limits>
+
+namespace thinkfan {
+
+
+DeviceFile::DeviceFile()
+: fd_(-1)
+, flags_(O_RDONLY)
+, seekable_(true)
+{}
+
+
+DeviceFile::~DeviceFile()
+{ close(); }
+
+
+void DeviceFile::open(const string &path, int flags)
+{
+	close();
+	path_ = path;
+	flags_ = flags;
+	seekable_ = true;
+	reopen();
+}
+
+
+void DeviceFile::reopen()
+{
+	fd_ = ::open(path_.c_str(), flags_ | O_CLOEXEC);
+	if (fd_ < 0)
+		throw IOerror(MSG_DEV_OPEN(path_), errno);
+}
+
+
+void DeviceFile::close()
+{
+	if (fd_ >= 0)
+		::close(fd_);
+	fd_ = -1;
+}
+
+
+bool DeviceFile::is_open() const
+{ return fd_ >= 0; }
+
+
+int DeviceFile::fd() const
+{ return fd_; }
+
+
+void DeviceFile::drop_stale(int err) noexcept
+{
+	// The device has been removed or rebound. Drop the stale descriptor so the
+	// next access re-opens the file (i.e. after the driver has been re-initialized).
+	if (err == ENODEV || err == ESTALE || err == EBADF)
+		close();
+}
+
+
+void DeviceFile::handle_error(int err, const string &msg)
+{
+	drop_stale(err);
+	throw IOerror(msg, err);
+}
+
+
+size_t DeviceFile::read(char *buf, size_t size)
+{
+	if (unlikely(fd_ < 0))
+		reopen();
+
+	ssize_t len;
+	do {
+		len = ::pread(fd_, buf, size - 1, 0);
+	} while (unlikely(len < 0 && errno == EINTR));
+
+	if (unlikely(len < 0))
+		handle_error(errno, MSG_DEV_READ(path_));
+
+	buf[len] = 0;
+	return static_cast<size_t>(len);
+}
+
+
+void DeviceFile::write(const string &data)
+{
+	if (unlikely(fd_ < 0))
+		reopen();
+
+	ssize_t len;
+	do {
+		len = seekable_ ?
+			::pwrite(fd_, data.data(), data.length(), 0)
+			: ::write(fd_, data.data(), data.length());
+		if (unlikely(len < 0 && errno == ESPIPE && seekable_)) {
+			// seq_file-based procfs entries like /proc/acpi/ibm/fan don't support pwrite()
+			seekable_ = false;
+			errno = EINTR;
+		}
+	} while (unlikely(len < 0 && errno == EINTR));
+
+	if (unlikely(len < 0))
+		handle_error(errno, MSG_DEV_WRITE(path_));
+	else if (unlikely(size_t(len) < data.length()))
+		throw IOerror(MSG_DEV_WRITE(path_), EIO);
+}
+
+
+int DeviceFile::read_int()
+{
+	if (unlikely(fd_ < 0))
+		reopen();
+
+	int rv;
+	if (int status = try_read_int(rv))
+		throw_read_error(status);
+	return rv;
+}
+
+
+int DeviceFile::try_read_int(int &value) noexcept
+{
+	char buf[32];
+	ssize_t len;
+	do {
+		len = ::pread(fd_, buf, sizeof(buf) - 1, 0);
+	} while (unlikely(len < 0 && errno == EINTR));
+
+	if (unlikely(len < 0)) {
+		int err = errno;
+		drop_stale(err);
+		return err;
+	}
+	if (unlikely(!parse_int(buf, buf + len, value)))
+		return -1;
+	return 0;
+}
+
+
+void DeviceFile::throw_read_error(int status) const
+{
+	if (status < 0)
+		throw SystemError(MSG_DEV_READ(path_) + "Not an integer value.");
+	throw IOerror(MSG_DEV_READ(path_), status);
+}
+
+
+const char *DeviceFile::parse_int(const char *s, const char *end, int &value)
+{
+	while (s < end && (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r'))
+		++s;
+
+	bool negative = false;
+	if (s < end && (*s == '-' || *s == '+'))
+		negative = *s++ == '-';
+
+	const char *digits = s;
+	long long rv = 0;
+	while (s < end && *s >= '0' && *s <= '9') {
+		rv = rv * 10 + (*s++ - '0');
+		if (unlikely(rv > static_cast<long long>(numeric_limits<int>::max()) + 1))
+			return nullptr;
+	}
+
+	if (s == digits)
+		return nullptr;
+
+	if (negative)
+		rv = -rv;
+	if (unlikely(rv > numeric_limits<int>::max()))
+		return nullptr;
+
+	value = static_cast<int>(rv);
+	return s;
+}
+
+
+} // namespace thinkfan
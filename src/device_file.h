@@ -0,0 +1,82 @@
+#pragma once
+
+/********************************************************************
+ * device_file.h: Persistently opened sysfs/procfs files
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "thinkfan.h"
+
+#include <fcntl.h>
+
+namespace thinkfan {
+
+
+/** @brief A file descriptor that is kept open across reads.
+ *  sysfs attributes and seq_file-based procfs entries regenerate their content on every
+ *  read from offset 0, so there is no need to re-open them on every loop. If the
+ *  underlying device vanishes (ENODEV/ESTALE), the descriptor is closed and transparently
+ *  re-opened on the next access. All errors are thrown as @a IOerror, so they end up in
+ *  the usual @a Driver::robust_op error handling. */
+class DeviceFile {
+public:
+	DeviceFile();
+	~DeviceFile();
+	DeviceFile(const DeviceFile &) = delete;
+	DeviceFile &operator = (const DeviceFile &) = delete;
+
+	void open(const string &path, int flags = O_RDONLY);
+	void close();
+	bool is_open() const;
+	int fd() const;
+
+	/// @return The number of bytes read into @a buf, which is always NUL-terminated.
+	size_t read(char *buf, size_t size);
+
+	/// Read a single (decimal) integer value like from a hwmon temp*_input file.
+	int read_int();
+
+	/** @brief Like @a read_int(), but for the main loop: Doesn't throw and doesn't reopen a
+	 *  closed file.
+	 *  @return 0 on success, the errno if the read failed or -1 if there was no number. */
+	int try_read_int(int &value) noexcept;
+
+	/// Throw the exception that @a read_int() would have thrown for @a status.
+	[[noreturn]] void throw_read_error(int status) const;
+
+	/// Write @a data at offset 0, i.e. replace the value of a sysfs attribute.
+	void write(const string &data);
+
+	/** @brief Parse a decimal integer from [@a s, @a end), skipping leading whitespace.
+	 *  @return A pointer to the first character after the number, or nullptr if there is none. */
+	static const char *parse_int(const char *s, const char *end, int &value);
+
+private:
+	void reopen();
+	void drop_stale(int err) noexcept;
+	[[noreturn]] void handle_error(int err, const string &msg);
+
+	int fd_;
+	int flags_;
+	bool seekable_;
+	string path_;
+};
+
+
+} // namespace thinkfan
@@ -27,8 +27,10 @@ namespace thinkfan {
 Driver::Driver(bool optional, unsigned int max_errors)
 : max_errors_(max_errors)
 , errors_(0)
+, total_errors_(0)
 , optional_(optional)
 , initialized_(false)
+, grace_(0)
 {}
 
 
@@ -51,31 +53,23 @@ void Driver::try_init()
 }
 
 
-void Driver::robust_op(FN<void ()> op_fn, FN<void (const ExpectedError &)> skip_fn)
+void Driver::reinit()
 {
-	try {
-		errors_++;
-		op_fn();
-		errors_ = 0;
-	} catch (DriverInitError &e) {
-		e.set_context(type_name());
-		handle_io_error_(e, skip_fn);
-	} catch (SystemError &e) {
-		handle_io_error_(e, skip_fn);
-	} catch (IOerror &e) {
-		handle_io_error_(e, skip_fn);
-	} catch (std::ios_base::failure &e) {
-		handle_io_error_(IOerror(e.what(), THINKFAN_IO_ERROR_CODE(e)), skip_fn);
-	}
+	initialized_ = false;
+	try_init();
 }
 
 
-void Driver::handle_io_error_(const ExpectedError &e, FN<void (const ExpectedError &)> skip_fn)
+bool Driver::try_lookup()
 {
-	if (optional() || tolerate_errors || errors() < max_errors() || !chk_sanity)
-		skip_fn(e);
-	else
-		throw e;
+	if (!available()) {
+		try {
+			path_.emplace(lookup());
+		} catch (ExpectedError &) {
+			return false;
+		}
+	}
+	return true;
 }
 
 
@@ -88,6 +82,18 @@ unsigned int Driver::max_errors() const
 bool Driver::optional() const
 { return optional_; }
 
+void Driver::set_grace(unsigned char errors)
+{ grace_ = errors; }
+
+bool Driver::in_grace() const
+{ return grace_ > 0; }
+
+void Driver::take_settings(const Driver &other)
+{
+	max_errors_ = other.max_errors_;
+	optional_ = other.optional_;
+}
+
 const string &Driver::path() const
 { return path_.value(); }
 
@@ -97,6 +103,15 @@ bool Driver::initialized() const
 bool Driver::available() const
 { return path_.has_value(); }
 
+unsigned int Driver::total_errors() const
+{ return total_errors_; }
+
+const Histogram &Driver::latency() const
+{ return latency_; }
+
+string Driver::name() const
+{ return type_name() + " " + path_.value_or("(not found)"); }
+
 void Driver::skip_io_error(const ExpectedError &e)
 { log(TF_ERR) << e.what() << flush; }
 
@@ -23,7 +23,8 @@
 
 #include "thinkfan.h"
 #include "error.h"
-#include <functional>
+#include "stats.h"
+#include <ios>
 #include <optional>
 
 namespace thinkfan {
@@ -33,20 +34,39 @@ class Driver {
 protected:
 	Driver(bool optional, unsigned int max_errors);
 
-	template<typename FnSignatureT>
-	using FN = std::function<FnSignatureT>;
-
 public:
 	void try_init();
+
+	/** @brief Look up the path unless that has already happened, but don't initialize.
+	 *  @return false if the driver isn't available (yet). */
+	bool try_lookup();
+
+	/** @brief Run init() again, i.e. reopen the device and reset its state, without repeating
+	 *  the lookup. Errors are handled like in @a try_init(). */
+	virtual void reinit();
+
 	unsigned int errors() const;
 	unsigned int max_errors() const;
 	virtual bool optional() const;
 
+	/** @brief Tolerate up to @a errors failed operations in a row, e.g. while a device comes back
+	 *  after a resume. Ends with the first operation that succeeds. */
+	void set_grace(unsigned char errors);
+	bool in_grace() const;
+
+	/** @brief Copy the settings that don't affect the driver's state from @a other, which
+	 *  this one replaces because it's the same device (cf. @a Config::take_over()). */
+	void take_settings(const Driver &other);
+
 	/** @return The identifier returned by @a lookup(). Calling this method before @a lookup() has completed
 	 *  will result in an exception. */
 	const string &path() const;
 
-	void robust_op(FN<void ()> op_fn, FN<void (const ExpectedError &)> skip_fn);
+	/** @brief Run @a op_fn and pass any expected errors to @a skip_fn if they're acceptable.
+	 *  Both are templates rather than std::function so this doesn't allocate when it is called
+	 *  from the main loop. */
+	template<class OpFnT, class SkipFnT>
+	void robust_op(OpFnT &&op_fn, SkipFnT &&skip_fn);
 
 	template<class DriverT, typename... ArgTs>
 	void robust_io(void (DriverT::*io_func)(ArgTs...), ArgTs &&... args);
@@ -54,13 +74,25 @@ public:
 	bool initialized() const;
 	bool available() const;
 
+	/// Errors since startup, unlike @a errors() which only counts the current streak.
+	unsigned int total_errors() const;
+
+	/// How long reads/writes on this driver take
+	const Histogram &latency() const;
+
+	/// @return @a type_name() and @a path() (if it has been found) for diagnostic output.
+	string name() const;
+
 private:
 	unsigned int max_errors_;
 	unsigned int errors_;
+	unsigned int total_errors_;
 	bool optional_;
 	bool initialized_;
+	unsigned char grace_;
 
-	void handle_io_error_(const ExpectedError &e, FN<void (const ExpectedError &)> skip_fn);
+	template<class SkipFnT>
+	void handle_io_error_(const ExpectedError &e, SkipFnT &skip_fn);
 
 protected:
 	virtual void init() = 0;
@@ -77,15 +109,56 @@ protected:
 
 	virtual void skip_io_error(const ExpectedError &);
 
+	/// For exception-free fast paths that bypass @a robust_op(): The operation has succeeded.
+	void op_succeeded()
+	{
+		errors_ = 0;
+		grace_ = 0;
+	}
+
 	opt<const string> path_;
+	Histogram latency_;
 };
 
 
+template<class OpFnT, class SkipFnT>
+void Driver::robust_op(OpFnT &&op_fn, SkipFnT &&skip_fn)
+{
+	try {
+		errors_++;
+		op_fn();
+		errors_ = 0;
+		grace_ = 0;
+	} catch (DriverInitError &e) {
+		e.set_context(type_name());
+		handle_io_error_(e, skip_fn);
+	} catch (SystemError &e) {
+		handle_io_error_(e, skip_fn);
+	} catch (IOerror &e) {
+		handle_io_error_(e, skip_fn);
+	} catch (std::ios_base::failure &e) {
+		handle_io_error_(IOerror(e.what(), THINKFAN_IO_ERROR_CODE(e)), skip_fn);
+	}
+}
+
+
+template<class SkipFnT>
+void Driver::handle_io_error_(const ExpectedError &e, SkipFnT &skip_fn)
+{
+	total_errors_++;
+	if (optional() || tolerate_errors || grace_ || errors() < max_errors() || !chk_sanity) {
+		skip_fn(e);
+		if (grace_)
+			--grace_;
+	}
+	else
+		throw e;
+}
+
+
 template<class DriverT, typename... ArgTs>
 void Driver::robust_io(void (DriverT::*io_func)(ArgTs...), ArgTs &&... args)
 {
-	using namespace std::placeholders;
-
 	if (!available() || !initialized())
 		try_init();
 
@@ -96,7 +169,9 @@ void Driver::robust_io(void (DriverT::*io_func)(ArgTs...), ArgTs &&... args)
 					std::forward<ArgTs>(args)...
 				);
 			},
-			std::bind(&Driver::skip_io_error, this, _1)
+			[this] (const ExpectedError &e) {
+				skip_io_error(e);
+			}
 		);
 }
 
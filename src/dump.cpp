@@ -0,0 +1,200 @@
+/********************************************************************
+ * dump.cpp: Convert a history file recorded with thinkfan -H to CSV
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "history_format.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#define MSG_DUMP_USAGE \
+ "Usage: thinkfan-dump [-s SINCE] FILE" \
+ "\nPrint the history FILE recorded with thinkfan -H as CSV, oldest first." \
+ "\n -s  Start at SINCE (seconds since the epoch), skipping older blocks entirely\n"
+
+using namespace thinkfan::history;
+using std::string;
+using std::vector;
+
+
+struct Block {
+	uint32_t seq;
+	const uint8_t *data;
+};
+
+
+static void print_header(size_t num_temps, size_t num_fans)
+{
+	std::printf("time");
+	for (size_t i = 0; i < num_temps; ++i)
+		std::printf(",temp%zu", i);
+	for (size_t i = 0; i < num_temps; ++i)
+		std::printf(",bias%zu", i);
+	for (size_t i = 0; i < num_fans; ++i)
+		std::printf(",fan%zu", i);
+	std::printf("\n");
+}
+
+
+static void print_sample(uint64_t time_ms, const vector<int64_t> &values, size_t num_temps)
+{
+	std::printf("%llu.%03llu", (unsigned long long)(time_ms / 1000), (unsigned long long)(time_ms % 1000));
+	for (size_t i = 0; i < values.size(); ++i) {
+		if (i >= num_temps && i < 2 * num_temps)
+			std::printf(",%.1f", double(values[i]) / 10);
+		else if (values[i] == INT_MIN)
+			std::printf(",");
+		else
+			std::printf(",%lld", (long long)values[i]);
+	}
+	std::printf("\n");
+}
+
+
+/// @return false if the block is corrupt. Whatever could be decoded until then is printed.
+static bool dump_block(const uint8_t *block, uint64_t since_ms, size_t &num_temps, size_t &num_fans)
+{
+	const uint8_t *p = block + block_keyframe_offset;
+	const uint8_t *end = block + block_size;
+	uint64_t time_ms = get_u64(block + block_time_offset);
+
+	uint64_t nt, nf, v;
+	if (!get_varint(p, end, nt) || !get_varint(p, end, nf) || 2 * nt + nf > max_values)
+		return false;
+	if (nt != num_temps || nf != num_fans) {
+		num_temps = nt;
+		num_fans = nf;
+		print_header(num_temps, num_fans);
+	}
+
+	vector<int64_t> values(2 * num_temps + num_fans);
+	for (int64_t &value : values) {
+		if (!get_varint(p, end, v))
+			return false;
+		value = unzigzag(v);
+	}
+	if (time_ms >= since_ms)
+		print_sample(time_ms, values, num_temps);
+
+	uint64_t dt, idx;
+	while (p < end && get_varint(p, end, dt) && dt) {
+		time_ms += dt - 1;
+		while (true) {
+			if (!get_varint(p, end, idx))
+				return false;
+			if (!idx)
+				break;
+			if (idx > values.size() || !get_varint(p, end, v))
+				return false;
+			values[idx - 1] += unzigzag(v);
+		}
+		if (time_ms >= since_ms)
+			print_sample(time_ms, values, num_temps);
+	}
+	return true;
+}
+
+
+static int dump(const char *path, uint64_t since_ms)
+{
+	std::ifstream f(path, std::ios_base::in | std::ios_base::binary);
+	if (!f.is_open()) {
+		std::fprintf(stderr, "%s: %s\n", path, std::strerror(errno));
+		return 1;
+	}
+	string file(std::istreambuf_iterator<char>(f), {});
+	const uint8_t *data = reinterpret_cast<const uint8_t *>(file.data());
+
+	if (file.size() < 2 * block_size || std::memcmp(data, magic, sizeof(magic))
+		|| get_u32(data + 8) != version || get_u32(data + 12) != block_size
+	) {
+		std::fprintf(stderr, "%s is not a thinkfan history file.\n", path);
+		return 1;
+	}
+	uint32_t num_blocks = std::min<uint64_t>(get_u32(data + 16), file.size() / block_size - 1);
+
+	vector<Block> blocks;
+	for (uint32_t i = 0; i < num_blocks; ++i) {
+		const uint8_t *block = data + size_t(block_size) * (i + 1);
+		if (uint32_t seq = get_u32(block))
+			blocks.push_back({ seq, block });
+	}
+	if (blocks.empty())
+		return 0;
+	std::sort(blocks.begin(), blocks.end(), [] (const Block &a, const Block &b) { return a.seq < b.seq; });
+
+	// Every block starts with a keyframe, so we can start with the last one before since_ms
+	auto first = blocks.begin();
+	while (first + 1 < blocks.end() && get_u64((first + 1)->data + block_time_offset) <= since_ms)
+		++first;
+
+	size_t num_temps = SIZE_MAX, num_fans = SIZE_MAX;
+	for (auto it = first; it != blocks.end(); ++it) {
+		if (!dump_block(it->data, since_ms, num_temps, num_fans))
+			std::fprintf(stderr, "%s: Block %u is corrupt, skipping the rest of it.\n", path, it->seq);
+	}
+
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	uint64_t since_ms = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:h")) != -1) {
+		switch (opt) {
+		case 's': {
+			char *end;
+			double since = std::strtod(optarg, &end);
+			if (*end || since < 0) {
+				std::fprintf(stderr, "Invalid time: %s\n" MSG_DUMP_USAGE, optarg);
+				return 3;
+			}
+			since_ms = uint64_t(since * 1000);
+			break;
+		}
+		case 'h':
+			std::printf(MSG_DUMP_USAGE);
+			return 0;
+		default:
+			std::fprintf(stderr, MSG_DUMP_USAGE);
+			return 3;
+		}
+	}
+
+	if (optind != argc - 1) {
+		std::fprintf(stderr, MSG_DUMP_USAGE);
+		return 3;
+	}
+
+	return dump(argv[optind], since_ms);
+}
@@ -138,6 +138,7 @@ void handle_uncaught()
 		               ;
 	}
 	// We can expect to be killed by SIGABRT after this function returns.
+	Logger::instance().stop_drain();
 	PidFileHolder::cleanup();
 }
 
@@ -0,0 +1,261 @@
+/********************************************************************
+ * event_loop.cpp: Waiting for timeouts, signals and thermal alarms
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "event_loop.h"
+#include "error.h"
+#include "message.h"
+#include "sensors.h"
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+
+namespace thinkfan {
+
+EventLoop *EventLoop::instance_ = nullptr;
+
+
+/// Grows by the time spent in suspend, and only then.
+static EventLoop::clock::duration boot_offset()
+{
+	struct timespec boot, mono;
+	::clock_gettime(CLOCK_BOOTTIME, &boot);
+	::clock_gettime(CLOCK_MONOTONIC, &mono);
+	return std::chrono::seconds(boot.tv_sec - mono.tv_sec)
+		+ std::chrono::nanoseconds(boot.tv_nsec - mono.tv_nsec);
+}
+
+
+EventLoop::EventLoop(const vector<int> &signals, void (*handler)(int))
+: epoll_fd_(-1)
+, signal_fd_(-1)
+, timer_fd_(-1)
+, handler_(handler)
+, woken_(false)
+, boot_offset_(boot_offset())
+, suspended_(clock::duration::zero())
+{
+	if (instance_)
+		throw Bug("Attempt to create a second EventLoop");
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	for (int sig : signals)
+		sigaddset(&mask, sig);
+	if (sigprocmask(SIG_BLOCK, &mask, nullptr))
+		throw IOerror("sigprocmask: ", errno);
+
+	if ((signal_fd_ = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+		throw IOerror("signalfd: ", errno);
+
+	if ((epoll_fd_ = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		int err = errno;
+		::close(signal_fd_);
+		throw IOerror("epoll_create1: ", err);
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = signal_fd_;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, signal_fd_, &ev)) {
+		int err = errno;
+		::close(epoll_fd_);
+		::close(signal_fd_);
+		throw IOerror("epoll_ctl: ", err);
+	}
+
+	// Unlike the epoll_wait() timeout, this one keeps running while the system is asleep
+	ev.data.fd = timer_fd_ = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd_ < 0 || epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &ev)) {
+		int err = errno;
+		if (timer_fd_ >= 0)
+			::close(timer_fd_);
+		::close(epoll_fd_);
+		::close(signal_fd_);
+		throw IOerror("timerfd: ", err);
+	}
+
+	alarmed_.reserve(max_events_);
+	instance_ = this;
+}
+
+
+EventLoop::~EventLoop()
+{
+	::close(timer_fd_);
+	::close(epoll_fd_);
+	::close(signal_fd_);
+	instance_ = nullptr;
+}
+
+
+EventLoop &EventLoop::instance()
+{
+	if (!instance_)
+		throw Bug("EventLoop used before it was created");
+	return *instance_;
+}
+
+
+const vector<SensorDriver *> &EventLoop::alarmed() const
+{ return alarmed_; }
+
+
+EventLoop::clock::duration EventLoop::suspended() const
+{ return suspended_; }
+
+
+bool EventLoop::check_resume()
+{
+	clock::duration offset = boot_offset();
+	if (likely(offset - boot_offset_ < min_suspend_))
+		return false;
+	suspended_ += offset - boot_offset_;
+	boot_offset_ = offset;
+	return true;
+}
+
+
+bool EventLoop::wait_until(clock::time_point until)
+{
+	alarmed_.clear();
+	suspended_ = clock::duration::zero();
+
+	// Also catches a suspend while the main loop was busy
+	while (likely(!interrupted && alarmed_.empty() && !woken_ && !check_resume())) {
+		clock::time_point now = clock::now();
+		if (now >= until)
+			break;
+
+		// Round up so we don't spin on a sub-millisecond remainder
+		int timeout = int(std::chrono::ceil<std::chrono::milliseconds>(until - now).count());
+
+		struct itimerspec its {};
+		its.it_value.tv_sec = timeout / 1000;
+		its.it_value.tv_nsec = (timeout % 1000) * 1000000L;
+		if (timerfd_settime(timer_fd_, 0, &its, nullptr))
+			throw IOerror("timerfd_settime: ", errno);
+
+		struct epoll_event events[max_events_];
+		int n = epoll_wait(epoll_fd_, events, max_events_, timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			throw IOerror("epoll_wait: ", errno);
+		}
+
+		for (int i = 0; i < n; ++i) {
+			if (events[i].data.fd == signal_fd_)
+				handle_signals();
+			else if (events[i].data.fd == timer_fd_) {
+				uint64_t expirations;
+				while (::read(timer_fd_, &expirations, sizeof(expirations)) > 0);
+			}
+			else {
+				auto it = handlers_.find(events[i].data.fd);
+				if (it != handlers_.end()) {
+					// Copy it, since the handler may remove itself
+					std::function<void()> handler = it->second;
+					handler();
+				}
+				else
+					handle_alarm(events[i].data.fd);
+			}
+		}
+	}
+
+	woken_ = false;
+	return !alarmed_.empty();
+}
+
+
+void EventLoop::handle_signals()
+{
+	struct signalfd_siginfo info;
+	while (::read(signal_fd_, &info, sizeof(info)) == sizeof(info))
+		handler_(int(info.ssi_signo));
+}
+
+
+void EventLoop::handle_alarm(int fd)
+{
+	auto it = watches_.find(fd);
+	if (it == watches_.end())
+		return;
+
+	// Reading the attribute re-arms sysfs_notify()
+	char buf[16];
+	ssize_t len = ::pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len > 0 && buf[0] != '0')
+		log(TF_NFY) << it->second->path() << ": Thermal alarm raised." << flush;
+	else
+		log(TF_INF) << it->second->path() << ": Thermal alarm cleared." << flush;
+
+	alarmed_.push_back(it->second);
+}
+
+
+void EventLoop::watch(int fd, SensorDriver *sensor)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLPRI;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev))
+		throw IOerror("epoll_ctl: ", errno);
+	watches_[fd] = sensor;
+}
+
+
+void EventLoop::unwatch(int fd)
+{
+	if (watches_.erase(fd))
+		epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+
+void EventLoop::add_handler(int fd, std::function<void()> handler)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev))
+		throw IOerror("epoll_ctl: ", errno);
+	handlers_[fd] = std::move(handler);
+}
+
+
+void EventLoop::remove_handler(int fd)
+{
+	if (handlers_.erase(fd))
+		epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+
+void EventLoop::wake()
+{ woken_ = true; }
+
+
+} // namespace thinkfan
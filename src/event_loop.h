@@ -0,0 +1,96 @@
+#pragma once
+
+/********************************************************************
+ * event_loop.h: Waiting for timeouts, signals and thermal alarms
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "thinkfan.h"
+
+#include <functional>
+#include <unordered_map>
+
+namespace thinkfan {
+
+
+/** @brief Replaces a plain timed sleep in the main loop. Signals are received via a
+ *  signalfd (so their handlers run in normal program context), and hwmon alarm
+ *  attributes (temp*_max_alarm, temp*_crit_alarm) are watched with EPOLLPRI, since the
+ *  kernel calls sysfs_notify() on them when they change. A resume from suspend is noticed
+ *  by comparing CLOCK_BOOTTIME with CLOCK_MONOTONIC, which doesn't advance while the system
+ *  is asleep, and a CLOCK_BOOTTIME timer ends the wait right after the resume. Like the
+ *  @a PidFileHolder, there is exactly one instance, which is created at the start of main(). */
+class EventLoop {
+public:
+	using clock = std::chrono::steady_clock;
+
+	/** @brief Block @a signals and deliver them to @a handler from within @a wait_until().
+	 *  Must be constructed before any threads are started so they inherit the signal mask. */
+	EventLoop(const vector<int> &signals, void (*handler)(int));
+	~EventLoop();
+	EventLoop(const EventLoop &) = delete;
+
+	static EventLoop &instance();
+
+	/** @brief Wait until @a until, a signal has set @a interrupted, an alarm has fired,
+	 *  a handler has called @a wake() or the system has resumed from suspend.
+	 *  @return true if woken up by an alarm, cf. @a alarmed(). */
+	bool wait_until(clock::time_point until);
+
+	/// The sensors whose alarm has fired during the last @a wait_until().
+	const vector<SensorDriver *> &alarmed() const;
+
+	/// How long the system was suspended before or during the last @a wait_until(), usually zero.
+	clock::duration suspended() const;
+
+	/// Wake up whenever the sysfs attribute @a fd (which must have been read once) is notified.
+	void watch(int fd, SensorDriver *sensor);
+	void unwatch(int fd);
+
+	/// Call @a handler from within @a wait_until() whenever @a fd becomes readable.
+	void add_handler(int fd, std::function<void()> handler);
+	void remove_handler(int fd);
+
+	/// Make the current (or next) @a wait_until() return early, e.g. so a new setting takes effect.
+	void wake();
+
+private:
+	void handle_signals();
+	void handle_alarm(int fd);
+	bool check_resume();
+
+	static EventLoop *instance_;
+	static constexpr int max_events_ = 16;
+	// Both clocks are read one after the other, so they never differ by nearly as much
+	static constexpr std::chrono::milliseconds min_suspend_ { 100 };
+
+	int epoll_fd_;
+	int signal_fd_;
+	int timer_fd_;
+	void (*handler_)(int);
+	std::unordered_map<int, SensorDriver *> watches_;
+	std::unordered_map<int, std::function<void()>> handlers_;
+	vector<SensorDriver *> alarmed_;
+	bool woken_;
+	clock::duration boot_offset_;
+	clock::duration suspended_;
+};
+
+
+} // namespace thinkfan
@@ -25,6 +25,7 @@
 #include "config.h"
 
 #include <fstream>
+#include <climits>
 #include <cstring>
 #include <thread>
 #include <typeinfo>
@@ -41,9 +42,15 @@ namespace thinkfan {
 | provided by its subclasses.                                                |
 ----------------------------------------------------------------------------*/
 
+static const string no_speed("_");
+static const string level_disengaged("level disengaged");
+
+
 FanDriver::FanDriver(bool optional, unsigned int watchdog_timeout, opt<unsigned int> max_errors)
 : Driver(optional, max_errors.value_or(0)),
-  current_speed_("_"),
+  current_speed_(&no_speed),
+  target_(this),
+  requested_(nullptr),
   watchdog_(watchdog_timeout),
   depulse_(0)
 {}
@@ -60,15 +67,18 @@ void FanDriver::skip_io_error(const ExpectedError &)
 
 void FanDriver::set_speed_(const string &level)
 {
-	std::ofstream f_out(path());
-	if(!(f_out << level << std::flush)) {
-		int err = errno;
-		if (err == EPERM)
+	ScopedTimer timer(latency_);
+	try {
+		if (unlikely(!output_.is_open()))
+			output_.open(path(), O_WRONLY);
+		output_.write(level);
+	} catch (IOerror &e) {
+		if (e.code() == EPERM)
 			throw SystemError(MSG_FAN_EPERM(path()));
 		else
-			throw IOerror(MSG_FAN_CTRL(level, path()), err);
+			throw IOerror(MSG_FAN_CTRL(level, path()), e.code());
 	}
-	current_speed_ = level;
+	current_speed_ = &level;
 }
 
 
@@ -81,7 +91,146 @@ bool FanDriver::operator == (const FanDriver &other) const
 }
 
 const string &FanDriver::current_speed() const
-{ return current_speed_; }
+{ return *target_->current_speed_; }
+
+
+int FanDriver::current_speed_num() const
+{
+	// hwmon fans have a plain PWM value, tpacpi fans "level N" or some symbolic level
+	const string &speed = current_speed();
+	size_t pos = speed.find_first_of("-0123456789");
+	int rv;
+	if (pos == string::npos
+		|| !DeviceFile::parse_int(speed.data() + pos, speed.data() + speed.length(), rv)
+	)
+		return INT_MIN;
+	return rv;
+}
+
+
+void FanDriver::reset_speed()
+{ current_speed_ = &no_speed; }
+
+
+static int level_rank(const Level &level)
+{
+	// The symbolic tpacpi levels all have num() == INT_MIN. Only "level auto" leaves
+	// the fan to the firmware, the other two run it at full speed.
+	if (level.num() == std::numeric_limits<int>::min() && level.str() != "level auto")
+		return std::numeric_limits<int>::max();
+	return level.num();
+}
+
+
+void FanDriver::request_speed(const Level &level)
+{
+	FanDriver &out = *target_;
+	if (!out.requested_ || level_rank(level) > level_rank(*out.requested_))
+		out.requested_ = &level;
+}
+
+
+void FanDriver::commit()
+{
+	if (unlikely(pinned_ != nullptr)) {
+		if (std::chrono::steady_clock::now() < pinned_until_)
+			requested_ = pinned_.get();
+		else
+			unpin();
+	}
+
+	if (!requested_)
+		return;
+
+	const Level &level = *requested_;
+	requested_ = nullptr;
+
+	// Every write to a pwm file or /proc/acpi/ibm/fan ends up as an ACPI call into the EC,
+	// so don't repeat what's already set. The watchdog and depulsing still get their turn.
+	if (speed_str(level) != *current_speed_)
+		set_speed(level);
+	else
+		ping_watchdog_and_depulse(level);
+}
+
+
+void FanDriver::alias(FanDriver *other)
+{
+	target_ = other ? other : this;
+	requested_ = nullptr;
+	if (other) {
+		// Our own init() has run after other's, so we only saw the state it has set up.
+		initial_state_ = other->initial_state_;
+		log(TF_DBG) << path() << ": Shared by multiple fan configs, merging requests." << flush;
+	}
+}
+
+
+bool FanDriver::is_alias() const
+{ return target_ != this; }
+
+
+void FanDriver::forget_levels()
+{
+	target_ = this;
+	requested_ = nullptr;
+	reset_speed();
+}
+
+
+void FanDriver::pin(unique_ptr<const Level> level, std::chrono::steady_clock::time_point until)
+{
+	FanDriver &out = *target_;
+	out.drop_pin();
+	out.pinned_ = std::move(level);
+	out.pinned_until_ = until;
+	log(TF_NFY) << MSG_FAN_PINNED(out.path(), out.pinned_->str()) << flush;
+}
+
+
+void FanDriver::unpin()
+{
+	FanDriver &out = *target_;
+	if (!out.pinned_)
+		return;
+	out.drop_pin();
+	log(TF_NFY) << MSG_FAN_UNPINNED(out.path()) << flush;
+}
+
+
+void FanDriver::drop_pin()
+{
+	if (!pinned_)
+		return;
+	// Both may still point into the level we're about to destroy
+	if (current_speed_ == &pinned_->str() || current_speed_ == &pinned_->num_str())
+		reset_speed();
+	if (requested_ == pinned_.get())
+		requested_ = nullptr;
+	pinned_.reset();
+}
+
+
+const Level *FanDriver::pinned() const
+{ return target_->pinned_.get(); }
+
+std::chrono::steady_clock::time_point FanDriver::pinned_until() const
+{ return target_->pinned_until_; }
+
+
+void FanDriver::reinit()
+{
+	Driver::reinit();
+	target_->reset_speed();
+}
+
+
+bool FanDriver::same_fan(const FanDriver &other) const
+{
+	return typeid(*this) == typeid(other)
+		&& !this->path().empty()
+		&& this->path() == other.path();
+}
 
 
 /*----------------------------------------------------------------------------
@@ -126,18 +275,18 @@ void TpFanDriver::set_depulse(float duration)
 void TpFanDriver::set_speed(const Level &level)
 {
 	FanDriver::set_speed(level.str());
-	last_watchdog_ping_ = std::chrono::system_clock::now();
+	last_watchdog_ping_ = std::chrono::steady_clock::now();
 }
 
 
 void TpFanDriver::ping_watchdog_and_depulse(const Level &level)
 {
 	if (depulse_ > std::chrono::milliseconds(0)) {
-		FanDriver::set_speed("level disengaged");
+		FanDriver::set_speed(level_disengaged);
 		std::this_thread::sleep_for(depulse_);
 		set_speed(level);
 	}
-	else if (last_watchdog_ping_ + watchdog_ - sleeptime <= std::chrono::system_clock::now()) {
+	else if (last_watchdog_ping_ + watchdog_ - sleeptime <= std::chrono::steady_clock::now()) {
 		log(TF_DBG) << "Watchdog ping" << flush;
 		set_speed(level);
 	}
@@ -180,6 +329,8 @@ void TpFanDriver::init()
 
 	if (!(f << "watchdog " << watchdog_.count() << std::flush))
 		throw IOerror(MSG_FAN_INIT(path()), errno);
+
+	reset_speed();
 }
 
 
@@ -194,6 +345,117 @@ string TpFanDriver::lookup()
 string TpFanDriver::type_name() const
 { return "tpacpi fan driver"; }
 
+const string &TpFanDriver::speed_str(const Level &level) const
+{ return level.str(); }
+
+
+/*----------------------------------------------------------------------------
+| HwmonFanGroup: The pwmN_enable handshake for all channels of one hwmon fan |
+| entry, so it's done back to back instead of once per channel.              |
+----------------------------------------------------------------------------*/
+
+HwmonFanGroup::~HwmonFanGroup()
+{
+	// Reverse order, in case the chip cares that all channels are back before the first
+	for (auto it = channels_.rbegin(); it != channels_.rend(); ++it) {
+		Channel &c = **it;
+		if (!c.enable_file.is_open() || c.initial_state.empty())
+			continue;
+		try {
+			log(TF_DBG) << c.path << ": Restoring initial state: " << c.initial_state << "." << flush;
+			c.enable_file.write(c.initial_state);
+		} catch (IOerror &e) {
+			log(TF_ERR) << MSG_FAN_RESET(c.path) << e.what() << flush;
+		}
+	}
+}
+
+
+size_t HwmonFanGroup::add(HwmonFanDriver *fan)
+{
+	channels_.push_back(std::make_unique<Channel>());
+	channels_.back()->fan = fan;
+	return channels_.size() - 1;
+}
+
+
+void HwmonFanGroup::remove(size_t channel)
+{
+	Channel &c = *channels_[channel];
+	// FanDriver::alias() may have corrected what we've read
+	if (!c.fan->initial_state_.empty())
+		c.initial_state = c.fan->initial_state_;
+	c.fan = nullptr;
+}
+
+
+void HwmonFanGroup::enable(size_t channel)
+{
+	if (channel == 0 || !enabled_)
+		enable_all(channel);
+	else
+		enable_channel(*channels_[channel]);
+}
+
+
+void HwmonFanGroup::reenable(size_t channel)
+{ enable_all(channel); }
+
+
+void HwmonFanGroup::enable_all(size_t channel)
+{
+	enable_channel(*channels_[channel]);
+	enabled_ = true;
+
+	for (size_t i = 0; i < channels_.size(); ++i) {
+		Channel &c = *channels_[i];
+		// Lookups have to happen in channel order to get the right paths from the HwmonInterface
+		if (i == channel || !c.fan || !c.fan->try_lookup())
+			continue;
+		try {
+			enable_channel(c);
+		} catch (IOerror &) {
+			// It's that channel's business
+		}
+	}
+}
+
+
+void HwmonFanGroup::enable_channel(Channel &c)
+{
+	HwmonFanDriver &fan = *c.fan;
+	if (c.path != fan.path()) {
+		c.path = fan.path();
+		c.enable_file.close();
+		c.initial_state.clear();
+	}
+
+	try {
+		if (!c.enable_file.is_open())
+			c.enable_file.open(c.path + "_enable", O_RDWR);
+
+		char buf[16];
+		c.enable_file.read(buf, sizeof(buf));
+		string state(buf, std::strcspn(buf, " \t\n"));
+		if (c.initial_state.empty()) {
+			c.initial_state = state;
+			log(TF_DBG) << c.path << ": Saved initial state: " << c.initial_state << "." << flush;
+		}
+		if (fan.initial_state_.empty())
+			fan.initial_state_ = c.initial_state;
+
+		// Some chips reprogram their fan controller on every write, even if nothing changes
+		if (state != "1") {
+			c.enable_file.write("1");
+			// Switching to manual control may have changed the PWM value
+			fan.reset_speed();
+		}
+	} catch (IOerror &e) {
+		throw IOerror(MSG_FAN_INIT(c.path), e.code());
+	}
+}
+
+
 
 /*----------------------------------------------------------------------------
 | HwmonFanDriver: Driver for PWM fans, typically somewhere in sysfs.         |
@@ -202,6 +464,7 @@ string TpFanDriver::type_name() const
 HwmonFanDriver::HwmonFanDriver(const string &path)
 : HwmonFanDriver(
 	std::make_shared<HwmonInterface<FanDriver>>(path, nullopt, nullopt, nullopt),
+	std::make_shared<HwmonFanGroup>(),
 	false,
 	0
 )
@@ -209,50 +472,36 @@ HwmonFanDriver::HwmonFanDriver(const string &path)
 
 HwmonFanDriver::HwmonFanDriver(
 	shared_ptr<HwmonInterface<FanDriver>> hwmon_interface,
+	shared_ptr<HwmonFanGroup> group,
 	bool optional,
 	opt<unsigned int> max_errors
 )
 : FanDriver(optional, 0, max_errors)
 , hwmon_interface_(hwmon_interface)
+, group_(group)
+, channel_(group->add(this))
 {}
 
 
 HwmonFanDriver::~HwmonFanDriver() noexcept(false)
 {
-	if (!initialized())
-		return;
-
-	std::ofstream f(path() + "_enable");
-	if (!(f.is_open() && f.good())) {
-		log(TF_ERR) << MSG_FAN_RESET(path()) << strerror(errno) << flush;
-		return;
-	}
-
-	if (!initial_state_.empty()) {
-		log(TF_DBG) << path() << ": Restoring initial state: " << initial_state_ << "." << flush;
-		if (!(f << initial_state_ << std::flush))
-			log(TF_ERR) << MSG_FAN_RESET(path()) << strerror(errno) << flush;
-	}
+	// The group restores the initial state once all of its channels are gone
+	group_->remove(channel_);
 }
 
 
 void HwmonFanDriver::init()
 {
-	std::fstream f(path() + "_enable");
-	if (!(f.is_open() && f.good()))
-		throw IOerror(MSG_FAN_INIT(path()), errno);
+	group_->enable(channel_);
 
-	if (initial_state_.empty()) {
-		std::string line;
-		line.resize(64);
-		if (!f.getline(&*line.begin(), 63))
-			throw IOerror(MSG_FAN_INIT(path()), errno);
-		initial_state_ = line;
-		log(TF_DBG) << path() << ": Saved initial state: " << initial_state_ << "." << flush;
+	// Open it now rather than on the first write, which should be as quick as possible
+	try {
+		output_.open(path(), O_WRONLY);
+	} catch (IOerror &e) {
+		if (e.code() == EPERM)
+			throw SystemError(MSG_FAN_EPERM(path()));
+		throw IOerror(MSG_FAN_INIT(path()), e.code());
 	}
-
-	if (!(f << "1" << std::flush))
-		throw IOerror(MSG_FAN_INIT(path()), errno);
 }
 
 string HwmonFanDriver::lookup()
@@ -261,18 +510,21 @@ string HwmonFanDriver::lookup()
 string HwmonFanDriver::type_name() const
 { return "hwmon fan driver"; }
 
+const string &HwmonFanDriver::speed_str(const Level &level) const
+{ return level.num_str(); }
+
 
 void HwmonFanDriver::set_speed(const Level &level)
 {
 	try {
-		FanDriver::set_speed(std::to_string(level.num()));
+		FanDriver::set_speed(level.num_str());
 	} catch (IOerror &e) {
 		if (e.code() == EINVAL) {
 			// This happens when the hwmon kernel driver is reset to automatic control
 			// e.g. after the system has woken up from suspend.
-			// In that case, we need to re-initialize and try once more.
-			init();
-			FanDriver::set_speed(std::to_string(level.num()));
+			// In that case, all channels need to be re-initialized before we try once more.
+			group_->reenable(channel_);
+			FanDriver::set_speed(level.num_str());
 			log(TF_WRN) << path() << ": WARNING: Userspace fan control had to be automatically re-initialized." << flush;
 #if defined(HAVE_SYSTEMD)
 			log(TF_WRN) << "This should have been taken care of when enabling the thinkfan systemd service." << flush
@@ -26,6 +26,7 @@
 #include "thinkfan.h"
 #include "driver.h"
 #include "hwmon.h"
+#include "device_file.h"
 
 namespace thinkfan {
 
@@ -40,21 +41,70 @@ public:
 	virtual ~FanDriver() noexcept(false);
 	virtual void set_speed(const Level &level) = 0;
 	const string &current_speed() const;
+
+	/// @return The number in @a current_speed(), e.g. 3 for "level 3", or INT_MIN if there is none.
+	int current_speed_num() const;
 	virtual void ping_watchdog_and_depulse(const Level &) {}
 	bool operator == (const FanDriver &other) const;
 
+	/** @brief Request @a level for the current loop. The requests of all drivers that
+	 *  control the same fan are merged, the highest level wins.
+	 *  @param level Must stay valid until @a commit() has been called. */
+	void request_speed(const Level &level);
+
+	/// Write the merged request to the fan, unless it's already at that speed.
+	void commit();
+
+	/** @brief Forward all requests to @a other, which controls the same fan.
+	 *  Pass nullptr to make this driver write on its own again. */
+	void alias(FanDriver *other);
+	bool is_alias() const;
+
+	/// Whether @a other writes to the same fan, i.e. the two must be aliased.
+	bool same_fan(const FanDriver &other) const;
+
+	/** @brief Drop all references to @a Level objects and aliased drivers, i.e. before the
+	 *  config that owns them is destroyed. The next @a commit() will always write. */
+	void forget_levels();
+
+	/** @brief Write @a level instead of the merged requests until @a until has passed. If this
+	 *  driver is an alias, the pin goes to the driver that does the writing. Unlike the
+	 *  requests, the pin survives @a forget_levels() since we own the level. */
+	void pin(unique_ptr<const Level> level, std::chrono::steady_clock::time_point until);
+	void unpin();
+
+	/// @return The level pinned by @a pin() or nullptr.
+	const Level *pinned() const;
+	std::chrono::steady_clock::time_point pinned_until() const;
+
+	/// Also forget the current speed, since init() may have reset the fan.
+	virtual void reinit() override;
+
 protected:
+	/// @param level Must outlive this driver (or the next call), since it's not copied.
 	void set_speed(const string &level);
 
+	/// The string that @a set_speed(const Level &) writes to the fan.
+	virtual const string &speed_str(const Level &level) const = 0;
+
+	/// Forget what has been written so the next @a commit() always writes.
+	void reset_speed();
+
 	string initial_state_;
-	string current_speed_;
+	const string *current_speed_;
+	FanDriver *target_;
+	const Level *requested_;
+	unique_ptr<const Level> pinned_;
+	std::chrono::steady_clock::time_point pinned_until_;
+	DeviceFile output_;
 	seconds watchdog_;
 	secondsf depulse_;
-	std::chrono::system_clock::time_point last_watchdog_ping_;
+	std::chrono::steady_clock::time_point last_watchdog_ping_;
 
 private:
 	virtual void skip_io_error(const ExpectedError &e) override;
 	void set_speed_(const string &level);
+	void drop_pin();
 };
 
 
@@ -72,18 +122,62 @@ protected:
 	virtual void init() override;
 	virtual string lookup() override;
 	virtual string type_name() const override;
+	virtual const string &speed_str(const Level &level) const override;
 
 private:
 	const string path_;
 };
 
 
+class HwmonFanDriver;
+
+
+/** @brief The PWM channels of one hwmon fan entry, e.g. all pwmN of an nct6775 or it87 chip
+ *  listed under one "indices:". They already share their lookup through the
+ *  @a HwmonInterface, and this shares the pwmN_enable handshake: The first channel to be
+ *  initialized switches all of them to manual control in one pass over pre-opened files,
+ *  and the initial states are restored in one pass when the last channel has been destroyed. */
+class HwmonFanGroup {
+public:
+	HwmonFanGroup() = default;
+	~HwmonFanGroup();
+	HwmonFanGroup(const HwmonFanGroup &) = delete;
+
+	/// @return The channel number of @a fan, i.e. the order in which the channels are enabled.
+	size_t add(HwmonFanDriver *fan);
+	void remove(size_t channel);
+
+	/** @brief Switch @a channel to manual control. The first channel (or whichever comes first)
+	 *  does that for all of them, and the others only check that it's still in effect.
+	 *  Errors are only thrown for @a channel. The others will report theirs in their own init(). */
+	void enable(size_t channel);
+
+	/// Switch all channels to manual control again, e.g. after the driver has reset them.
+	void reenable(size_t channel);
+
+private:
+	struct Channel {
+		HwmonFanDriver *fan;
+		string path;
+		DeviceFile enable_file;
+		string initial_state;
+	};
+
+	void enable_all(size_t channel);
+	void enable_channel(Channel &c);
+
+	vector<unique_ptr<Channel>> channels_;
+	bool enabled_ = false;
+};
+
+
 class HwmonFanDriver : public FanDriver {
 public:
 	HwmonFanDriver(const string &path);
 
 	HwmonFanDriver(
 		shared_ptr<HwmonInterface<FanDriver>> hwmon_interface,
+		shared_ptr<HwmonFanGroup> group,
 		bool optional,
 		opt<unsigned int> max_errors = nullopt
 	);
@@ -95,9 +189,14 @@ protected:
 	virtual void init() override;
 	virtual string lookup() override;
 	virtual string type_name() const override;
+	virtual const string &speed_str(const Level &level) const override;
 
 private:
+	friend class HwmonFanGroup;
+
 	shared_ptr<HwmonInterface<FanDriver>> hwmon_interface_;
+	shared_ptr<HwmonFanGroup> group_;
+	const size_t channel_;
 };
 
 
@@ -0,0 +1,205 @@
+/********************************************************************
+ * history.cpp: Compact long-term recording of temperatures and fan levels
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "history.h"
+#include "history_format.h"
+#include "config.h"
+#include "fans.h"
+#include "error.h"
+#include "message.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+
+namespace thinkfan {
+
+using namespace history;
+
+
+HistoryWriter *HistoryWriter::instance_ = nullptr;
+
+// Keep keyframes within max_values
+static constexpr size_t max_temps = 160;
+static constexpr size_t max_fans = max_values - 2 * max_temps;
+
+
+HistoryWriter::HistoryWriter(const string &path)
+: path_(path)
+, map_(nullptr)
+, map_size_(0)
+, num_blocks_(0)
+, seq_(0)
+, pos_(0)
+, num_temps_(0)
+, num_fans_(0)
+{
+	if (instance_)
+		throw Bug("Attempt to create a second HistoryWriter");
+
+	open_file();
+	// Frames can't get larger than this, so record() never allocates
+	frame_.resize(max_values * 15 + 11);
+	log(TF_NFY) << MSG_HISTORY_RECORDING(path, map_size_ / 1024) << flush;
+	instance_ = this;
+}
+
+
+HistoryWriter::~HistoryWriter()
+{
+	if (::msync(map_, map_size_, MS_SYNC))
+		log(TF_ERR) << MSG_HISTORY_OPEN(path_) << strerror(errno) << flush;
+	::munmap(map_, map_size_);
+	instance_ = nullptr;
+}
+
+
+HistoryWriter *HistoryWriter::instance()
+{ return instance_; }
+
+
+void HistoryWriter::open_file()
+{
+	int fd = ::open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw IOerror(MSG_HISTORY_OPEN(path_), errno);
+
+	struct stat st;
+	if (::fstat(fd, &st) || (st.st_size == 0 && ::ftruncate(fd, default_file_size))) {
+		int err = errno;
+		::close(fd);
+		throw IOerror(MSG_HISTORY_OPEN(path_), err);
+	}
+	size_t size = st.st_size ? size_t(st.st_size) : default_file_size;
+	if (size < 2 * block_size) {
+		::close(fd);
+		throw ExpectedError(MSG_HISTORY_SIZE(path_));
+	}
+
+	map_size_ = size / block_size * block_size;
+	void *p = ::mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	int err = errno;
+	::close(fd);
+	if (p == MAP_FAILED)
+		throw IOerror(MSG_HISTORY_OPEN(path_), err);
+	map_ = static_cast<uint8_t *>(p);
+	num_blocks_ = uint32_t(map_size_ / block_size - 1);
+
+	// A new file, or one that has been preallocated with a different size
+	if (std::all_of(map_, map_ + sizeof(magic), [] (uint8_t b) { return b == 0; })) {
+		std::memcpy(map_, magic, sizeof(magic));
+		put_u32(map_ + 8, version);
+		put_u32(map_ + 12, block_size);
+		put_u32(map_ + 16, num_blocks_);
+		return;
+	}
+
+	if (std::memcmp(map_, magic, sizeof(magic)) || get_u32(map_ + 8) != version
+		|| get_u32(map_ + 12) != block_size || get_u32(map_ + 16) != num_blocks_
+	) {
+		::munmap(map_, map_size_);
+		throw ExpectedError(MSG_HISTORY_INVALID(path_));
+	}
+
+	// Continue after the newest block
+	for (uint32_t i = 0; i < num_blocks_; ++i)
+		seq_ = std::max(seq_, get_u32(map_ + block_size * (i + 1)));
+}
+
+
+void HistoryWriter::start_block()
+{
+	uint8_t *block = map_ + size_t(block_size) * (1 + seq_ % num_blocks_);
+	++seq_;
+
+	// The seq goes in last, so a block that's only half written is never mistaken for a valid one
+	std::memset(block, 0, block_size);
+	int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()
+	).count();
+	put_u64(block + block_time_offset, uint64_t(now_ms));
+
+	uint8_t *p = block + block_keyframe_offset;
+	p += put_varint(p, num_temps_);
+	p += put_varint(p, num_fans_);
+	for (int64_t v : values_)
+		p += put_varint(p, zigzag(v));
+	pos_ = size_t(p - block);
+
+	put_u32(block, seq_);
+}
+
+
+void HistoryWriter::record(const Config &config, const TemperatureState &ts)
+{
+	const size_t num_temps = std::min(ts.temps().size(), max_temps);
+	const size_t num_fans = std::min(config.fan_configs().size(), max_fans);
+	values_.resize(2 * num_temps + num_fans);
+
+	for (size_t i = 0; i < num_temps; ++i) {
+		values_[i] = ts.temps()[i];
+		values_[num_temps + i] = std::lround(ts.biases()[i] * 10);
+	}
+	for (size_t i = 0; i < num_fans; ++i)
+		values_[2 * num_temps + i] = config.fan_configs()[i]->fan()->current_speed_num();
+
+	auto now = std::chrono::steady_clock::now();
+
+	if (unlikely(!pos_ || num_temps != num_temps_ || num_fans != num_fans_)) {
+		if (num_temps < ts.temps().size() || num_fans < config.fan_configs().size())
+			log(TF_WRN) << MSG_HISTORY_TRUNCATED(path_) << flush;
+		num_temps_ = num_temps;
+		num_fans_ = num_fans;
+		start_block();
+	}
+	else {
+		int64_t dt = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_).count();
+		uint8_t *p = frame_.data();
+		p += put_varint(p, uint64_t(std::max<int64_t>(dt, 0)) + 1);
+		for (size_t i = 0; i < values_.size(); ++i) {
+			if (values_[i] != last_values_[i]) {
+				p += put_varint(p, i + 1);
+				p += put_varint(p, zigzag(values_[i] - last_values_[i]));
+			}
+		}
+		*p++ = 0;
+
+		size_t len = size_t(p - frame_.data());
+		if (pos_ + len > block_size)
+			start_block();
+		else {
+			std::memcpy(map_ + size_t(block_size) * (1 + (seq_ - 1) % num_blocks_) + pos_, frame_.data(), len);
+			pos_ += len;
+		}
+	}
+
+	last_values_.assign(values_.begin(), values_.end());
+	last_ = now;
+}
+
+
+} // namespace thinkfan
@@ -0,0 +1,72 @@
+#pragma once
+
+/********************************************************************
+ * history.h: Compact long-term recording of temperatures and fan levels
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "thinkfan.h"
+#include "temperature_state.h"
+
+#include <cstdint>
+
+namespace thinkfan {
+
+
+/** @brief Records the temperatures, biases and fan levels of every main loop iteration into
+ *  a fixed-size ring file as described in history_format.h, so the oldest data is
+ *  overwritten once it's full. Unlike the @a TraceWriter, this is meant to run all the
+ *  time: An unchanged sample takes two bytes. The file is mmap'd, so recording never makes
+ *  a syscall and the kernel writes back in the background. A new file is created with a
+ *  default size of 4 MiB, an existing one keeps its size and is appended to. Like the
+ *  @a MetricsExporter, there is at most one instance. */
+class HistoryWriter {
+public:
+	HistoryWriter(const string &path);
+	~HistoryWriter();
+	HistoryWriter(const HistoryWriter &) = delete;
+
+	/// @return The running recorder or nullptr if there is none.
+	static HistoryWriter *instance();
+
+	void record(const Config &config, const TemperatureState &ts);
+
+private:
+	void open_file();
+	void start_block();
+
+	static HistoryWriter *instance_;
+
+	const string path_;
+	uint8_t *map_;
+	size_t map_size_;
+	uint32_t num_blocks_;
+	uint32_t seq_;
+	size_t pos_;  // In the current block, 0 if there is none
+
+	size_t num_temps_;
+	size_t num_fans_;
+	vector<int64_t> values_;
+	vector<int64_t> last_values_;
+	vector<uint8_t> frame_;
+	std::chrono::steady_clock::time_point last_;
+};
+
+
+} // namespace thinkfan
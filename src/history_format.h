@@ -0,0 +1,122 @@
+#pragma once
+
+/********************************************************************
+ * history_format.h: Layout of the history file that thinkfan -H writes
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include <cstddef>
+#include <cstdint>
+
+/* A history file is a header block followed by a ring of data blocks, all of them
+ * block_size bytes. All integers are little-endian.
+ *
+ * The header block starts with the magic "TFHIST01", then u32 version, u32 block_size and
+ * u32 number of data blocks.
+ *
+ * A data block starts with u32 seq (0 if unused), which increases by one with every block
+ * written, so the oldest block is the one with the lowest seq. Then comes u64 wall-clock
+ * time in milliseconds since the epoch and a keyframe: varint number of temperatures,
+ * varint number of fans, and then one zigzag varint for each temperature (°C), bias (in
+ * 0.1 °C) and fan level (INT_MIN if it's not a number, e.g. "level auto"), in that order.
+ * Every sample after that is a delta frame: varint milliseconds since the previous sample
+ * plus one, then for each value that changed a varint index plus one and a zigzag varint
+ * difference, then a 0 byte. The rest of the block is filled with zeros, which end it.
+ *
+ * Since every block starts with a keyframe, any block can be decoded on its own. */
+
+namespace thinkfan {
+namespace history {
+
+
+constexpr char magic[8] = { 'T', 'F', 'H', 'I', 'S', 'T', '0', '1' };
+constexpr uint32_t version = 1;
+constexpr uint32_t block_size = 4096;
+constexpr size_t default_file_size = 4 << 20;
+
+constexpr size_t block_time_offset = 4;
+constexpr size_t block_keyframe_offset = 12;
+
+/// Enough that a keyframe always fits in a block
+constexpr unsigned int max_values = 384;
+
+
+inline void put_u32(uint8_t *p, uint32_t v)
+{
+	for (unsigned int i = 0; i < 4; ++i)
+		p[i] = uint8_t(v >> (8 * i));
+}
+
+inline void put_u64(uint8_t *p, uint64_t v)
+{
+	for (unsigned int i = 0; i < 8; ++i)
+		p[i] = uint8_t(v >> (8 * i));
+}
+
+inline uint32_t get_u32(const uint8_t *p)
+{
+	uint32_t v = 0;
+	for (unsigned int i = 0; i < 4; ++i)
+		v |= uint32_t(p[i]) << (8 * i);
+	return v;
+}
+
+inline uint64_t get_u64(const uint8_t *p)
+{
+	uint64_t v = 0;
+	for (unsigned int i = 0; i < 8; ++i)
+		v |= uint64_t(p[i]) << (8 * i);
+	return v;
+}
+
+
+/// @return The number of bytes written to @a p, at most 10.
+inline size_t put_varint(uint8_t *p, uint64_t v)
+{
+	size_t len = 0;
+	while (v >= 0x80) {
+		p[len++] = uint8_t(v | 0x80);
+		v >>= 7;
+	}
+	p[len++] = uint8_t(v);
+	return len;
+}
+
+/// @return false if the varint doesn't end before @a end.
+inline bool get_varint(const uint8_t *&p, const uint8_t *end, uint64_t &v)
+{
+	v = 0;
+	for (unsigned int shift = 0; p < end && shift < 64; shift += 7) {
+		uint8_t b = *p++;
+		v |= uint64_t(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+inline uint64_t zigzag(int64_t v)
+{ return (uint64_t(v) << 1) ^ uint64_t(v >> 63); }
+
+inline int64_t unzigzag(uint64_t v)
+{ return int64_t(v >> 1) ^ -int64_t(v & 1); }
+
+
+} // namespace history
+} // namespace thinkfan
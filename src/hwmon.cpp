@@ -31,36 +31,162 @@
 #include <sys/stat.h>
 #include <algorithm>
 #include <functional>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 
 namespace thinkfan {
 
 
-static int filter_hwmon_dirs(const struct dirent *entry)
+/*----------------------------------------------------------------------------
+| HwmonIndex: Cached view of the sysfs directory tree                        |
+----------------------------------------------------------------------------*/
+
+unique_ptr<HwmonIndex> HwmonIndex::instance_(nullptr);
+
+
+HwmonIndex::HwmonIndex()
+: uevent_fd_(::socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT))
+{
+	if (uevent_fd_ >= 0) {
+		struct sockaddr_nl addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.nl_family = AF_NETLINK;
+		addr.nl_groups = 1; // kernel uevents
+		if (::bind(uevent_fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr))) {
+			::close(uevent_fd_);
+			uevent_fd_ = -1;
+		}
+	}
+	if (uevent_fd_ < 0)
+		log(TF_DBG) << "Can't receive uevents, hwmon lookups won't be cached across reloads: "
+			<< strerror(errno) << flush;
+}
+
+
+HwmonIndex::~HwmonIndex()
 {
-	return (entry->d_type == DT_DIR || entry->d_type == DT_LNK)
-		&& (!strncmp("hwmon", entry->d_name, 5) || !strcmp("device", entry->d_name));
+	if (uevent_fd_ >= 0)
+		::close(uevent_fd_);
+}
+
+
+HwmonIndex &HwmonIndex::instance()
+{
+	if (!instance_)
+		instance_ = unique_ptr<HwmonIndex>(new HwmonIndex());
+	return *instance_;
+}
+
+
+void HwmonIndex::invalidate()
+{ dirs_.clear(); }
+
+
+bool HwmonIndex::check_uevents()
+{
+	if (uevent_fd_ < 0) {
+		invalidate();
+		return true;
+	}
+
+	bool changed = false;
+	char buf[4096];
+	ssize_t len;
+	while ((len = ::recv(uevent_fd_, buf, sizeof(buf) - 1, 0)) > 0) {
+		// A uevent is a series of NUL-terminated strings: "action@devpath", then KEY=value pairs
+		buf[len] = 0;
+		for (const char *s = buf; s < buf + len; s += strlen(s) + 1) {
+			if (!strcmp(s, "SUBSYSTEM=hwmon")) {
+				changed = true;
+				break;
+			}
+		}
+	}
+
+	if (len < 0 && errno == ENOBUFS)
+		changed = true; // Lost some events, so we can't know
+
+	if (changed) {
+		log(TF_DBG) << "Hwmon devices have changed, dropping cached lookups." << flush;
+		invalidate();
+	}
+	return changed;
 }
 
 
-static int filter_subdirs(const struct dirent *entry)
+const HwmonIndex::Dir &HwmonIndex::dir(const string &path)
 {
-	return (entry->d_type & DT_DIR || entry->d_type == DT_LNK)
-		&& string(entry->d_name) != "." && string(entry->d_name) != ".."
-		&& string(entry->d_name) != "subsystem";
+	auto it = dirs_.find(path);
+	if (it == dirs_.end())
+		it = dirs_.emplace(path, scan(path)).first;
+	return it->second;
 }
 
 
+HwmonIndex::Dir HwmonIndex::scan(const string &path)
+{
+	Dir rv;
+
+	struct dirent **entries;
+	int nentries = ::scandir(path.c_str(), &entries, nullptr, nullptr);
+	if (nentries < 0)
+		return rv;
+
+	for (int i = 0; i < nentries; i++) {
+		const struct dirent *entry = entries[i];
+		const string name(entry->d_name);
+		if (name != "." && name != "..") {
+			rv.files.insert(name);
+			if (entry->d_type == DT_DIR || entry->d_type == DT_LNK) {
+				const string subdir(path + "/" + name);
+				if (!name.compare(0, 5, "hwmon") || name == "device")
+					rv.hwmon_dirs.push_back(subdir);
+
+				struct stat statbuf;
+				if (name != "subsystem" && !stat(subdir.c_str(), &statbuf) && S_ISDIR(statbuf.st_mode))
+					rv.subdirs.push_back(subdir);
+			}
+		}
+		free(entries[i]);
+	}
+	free(entries);
+
+	std::sort(rv.hwmon_dirs.begin(), rv.hwmon_dirs.end());
+
+	if (rv.files.count("name")) {
+		ifstream f(path + "/name");
+		string tmp;
+		if (f >> tmp)
+			rv.name = tmp;
+	}
+	if (rv.files.count("model")) {
+		ifstream f(path + "/model");
+		string tmp;
+		if (getline(f, tmp))
+			rv.model = tmp.erase(tmp.find_last_not_of(" \t\n\r\f\v") + 1);
+	}
+
+	return rv;
+}
+
+
+
+/*----------------------------------------------------------------------------
+| HwmonInterface: Finds hwmon files by name, model and/or index              |
+----------------------------------------------------------------------------*/
+
 template<class HwmonT>
 vector<string> HwmonInterface<HwmonT>::find_files(const string &path, const vector<unsigned int> &indices)
 {
+	const HwmonIndex::Dir &dir = HwmonIndex::instance().dir(path);
 	vector<string> rv;
 	for (unsigned int idx : indices) {
-		const string fpath(path + "/" + filename(idx));
-		std::ifstream f(fpath);
-		if (f.is_open() && f.good())
-			rv.push_back(fpath);
+		const string fname(filename(idx));
+		if (dir.files.count(fname))
+			rv.push_back(path + "/" + fname);
 		else
-			throw IOerror("Can't find hwmon file: " + fpath, errno);
+			throw IOerror("Can't find hwmon file: " + path + "/" + fname, ENOENT);
 	}
 	return rv;
 }
@@ -96,36 +222,19 @@ vector<string> HwmonInterface<HwmonT>::find_hwmons_by_name(
 	const unsigned char max_depth = 5;
 	vector<string> result;
 
-	ifstream f(path + "/name");
-	if (f.is_open() && f.good()) {
-		string tmp;
-		if ((f >> tmp) && tmp == name) {
-			result.push_back(path);
-			return result;
-		}
+	const HwmonIndex::Dir &dir = HwmonIndex::instance().dir(path);
+	if (dir.name == name) {
+		result.push_back(path);
+		return result;
 	}
 	if (depth >= max_depth) {
 		return result;  // don't recurse to subdirs
 	}
 
-	struct dirent **entries;
-	int nentries = ::scandir(path.c_str(), &entries, filter_subdirs, nullptr);
-	if (nentries == -1) {
-		return result;
-	}
-	for (int i = 0; i < nentries; i++) {
-		auto subdir = path + "/" + entries[i]->d_name;
-		free(entries[i]);
-
-		struct stat statbuf;
-		int err = stat(path.c_str(), &statbuf);
-		if (err || (statbuf.st_mode & S_IFMT) != S_IFDIR)
-			continue;
-
+	for (const string &subdir : dir.subdirs) {
 		auto found = find_hwmons_by_name(subdir, name, depth + 1);
 		result.insert(result.end(), found.begin(), found.end());
 	}
-	free(entries);
 
 	return result;
 }
@@ -139,39 +248,19 @@ vector<string> HwmonInterface<HwmonT>::find_hwmons_by_model(
 	const unsigned char max_depth = 5;
 	vector<string> result;
 
-	ifstream f(path + "/model");
-	if (f.is_open() && f.good()) {
-		string tmp;
-		if (getline(f, tmp)) {
-			tmp = tmp.erase(tmp.find_last_not_of(" \t\n\r\f\v") + 1);
-			if (tmp == model) {
-				result.push_back(path);
-				return result;
-			}
-		}
+	const HwmonIndex::Dir &dir = HwmonIndex::instance().dir(path);
+	if (dir.model == model) {
+		result.push_back(path);
+		return result;
 	}
 	if (depth >= max_depth) {
 		return result; // don't recurse to subdirs
 	}
 
-	struct dirent **entries;
-	int nentries = ::scandir(path.c_str(), &entries, filter_subdirs, nullptr);
-	if (nentries == -1) {
-		return result;
-	}
-	for (int i = 0; i < nentries; i++) {
-		auto subdir = path + "/" + entries[i]->d_name;
-		free(entries[i]);
-
-		struct stat statbuf;
-		int err = stat(path.c_str(), &statbuf);
-		if (err || (statbuf.st_mode & S_IFMT) != S_IFDIR)
-			continue;
-
+	for (const string &subdir : dir.subdirs) {
 		auto found = find_hwmons_by_model(subdir, model, depth + 1);
 		result.insert(result.end(), found.begin(), found.end());
 	}
-	free(entries);
 
 	return result;
 }
@@ -189,25 +278,12 @@ vector<string> HwmonInterface<HwmonT>::find_hwmons_by_indices(
 	}
 	catch (IOerror &) {
 		if (depth <= max_depth) {
-			struct dirent **entries;
-			int nentries = ::scandir(path.c_str(), &entries, filter_hwmon_dirs, alphasort);
-			if (nentries < 0)
-				throw IOerror("Error scanning " + path + ": ", errno);
-
 			vector<string> rv;
-			for (int i = 0; i < nentries; i++) {
-				rv = HwmonInterface<HwmonT>::find_hwmons_by_indices(
-					path + "/" + entries[i]->d_name,
-					indices,
-					depth + 1
-				);
+			for (const string &subdir : HwmonIndex::instance().dir(path).hwmon_dirs) {
+				rv = HwmonInterface<HwmonT>::find_hwmons_by_indices(subdir, indices, depth + 1);
 				if (rv.size())
 					break;
 			}
-			for (int i = 0; i < nentries; i++)
-				free(entries[i]);
-			free(entries);
-
 			return rv;
 		}
 		else
@@ -218,52 +294,120 @@ vector<string> HwmonInterface<HwmonT>::find_hwmons_by_indices(
 
 
 template<class HwmonT>
-string HwmonInterface<HwmonT>::lookup()
+void HwmonInterface<HwmonT>::find_paths()
 {
-	if (!paths_it_) {
-		if (!base_path_)
-			throw Bug("Can't lookup sensor because it has no base path");
-
-		string path = *base_path_;
-
-		if (name_) {
-			vector<string> paths = find_hwmons_by_name(path, name_.value(), 1);
-			if (paths.size() != 1) {
-				string msg(path + ": ");
-				if (paths.size() == 0) {
-					msg += "Could not find a hwmon with this name: " + name_.value();
-				} else {
-					msg += MSG_MULTIPLE_HWMONS_FOUND;
-					for (string hwmon_path : paths)
-						msg += " " + hwmon_path;
-				}
-				throw DriverInitError(msg);
+	if (!base_path_)
+		throw Bug("Can't lookup sensor because it has no base path");
+
+	const string key = cache_key();
+	ConfigCache &cache = ConfigCache::instance();
+	if (const ConfigCache::Entry *cached = cache.find(key)) {
+		if (cache_valid(*cached)) {
+			found_paths_ = cached->paths;
+			return;
+		}
+		cache.drop(key);
+	}
+
+	string path = *base_path_;
+
+	if (name_) {
+		vector<string> paths = find_hwmons_by_name(path, name_.value(), 1);
+		if (paths.size() != 1) {
+			string msg(path + ": ");
+			if (paths.size() == 0) {
+				msg += "Could not find a hwmon with this name: " + name_.value();
+			} else {
+				msg += MSG_MULTIPLE_HWMONS_FOUND;
+				for (string hwmon_path : paths)
+					msg += " " + hwmon_path;
 			}
-			path = paths[0];
+			throw DriverInitError(msg);
 		}
-		if (model_) {
-			vector<string> paths = find_hwmons_by_model(path, model_.value(), 1);
-			if (paths.size() != 1) {
-				string msg(path + ": ");
-				if (paths.size() == 0) {
-					msg += "Could not find a hwmon with this model: " + model_.value();
-				} else {
-					msg += MSG_MULTIPLE_HWMONS_FOUND;
-					for (string hwmon_path : paths)
-						msg += " " + hwmon_path;
-				}
-				throw DriverInitError(msg);
+		path = paths[0];
+	}
+	if (model_) {
+		vector<string> paths = find_hwmons_by_model(path, model_.value(), 1);
+		if (paths.size() != 1) {
+			string msg(path + ": ");
+			if (paths.size() == 0) {
+				msg += "Could not find a hwmon with this model: " + model_.value();
+			} else {
+				msg += MSG_MULTIPLE_HWMONS_FOUND;
+				for (string hwmon_path : paths)
+					msg += " " + hwmon_path;
 			}
-			path = paths[0];
+			throw DriverInitError(msg);
 		}
-		if (indices_) {
-			found_paths_ = find_hwmons_by_indices(path, indices_.value(), 0);
-			if (found_paths_.size() == 0)
-				throw DriverInitError(path + ": " + "Could not find any hwmons in " + path);
+		path = paths[0];
+	}
+	if (indices_) {
+		found_paths_ = find_hwmons_by_indices(path, indices_.value(), 0);
+		if (found_paths_.size() == 0)
+			throw DriverInitError(path + ": " + "Could not find any hwmons in " + path);
+	}
+	else
+		found_paths_.push_back(path);
+
+	cache.store(key, { path, found_paths_ });
+}
+
+
+template<class HwmonT>
+string HwmonInterface<HwmonT>::cache_key() const
+{
+	// Sensors and fans look for different files with the same indices
+	string rv(filename(0));
+	rv += '\0' + base_path_.value_or("");
+	rv += '\0' + name_.value_or("");
+	rv += '\0' + model_.value_or("");
+	rv += '\0';
+	if (indices_)
+		for (unsigned int i : *indices_)
+			rv += std::to_string(i) + ",";
+	return rv;
+}
+
+
+template<class HwmonT>
+bool HwmonInterface<HwmonT>::cache_valid(const ConfigCache::Entry &entry) const
+{
+	// The hwmon may have been renumbered, so make sure it's still the one we're looking for
+	if (model_ && HwmonIndex::instance().dir(entry.hwmon_dir).model != model_)
+		return false;
+	if (name_) {
+		// With a model, find_paths() has looked for it below the dir with the name
+		string path = entry.hwmon_dir;
+		while (HwmonIndex::instance().dir(path).name != name_) {
+			string::size_type pos = path.rfind('/');
+			if (!model_ || pos == string::npos || path.length() <= base_path_->length())
+				return false;
+			path.erase(pos);
 		}
-		else
-			found_paths_.push_back(path);
+	}
+
+	if (entry.paths.empty())
+		return false;
+	for (const string &path : entry.paths)
+		if (::access(path.c_str(), F_OK))
+			return false;
+
+	return true;
+}
 
+
+template<class HwmonT>
+string HwmonInterface<HwmonT>::lookup()
+{
+	if (!paths_it_) {
+		try {
+			find_paths();
+		} catch (ExpectedError &) {
+			// The hwmon may have appeared after we cached the directory it's in
+			HwmonIndex::instance().invalidate();
+			found_paths_.clear();
+			find_paths();
+		}
 		paths_it_.emplace(found_paths_.begin());
 	}
 
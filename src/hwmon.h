@@ -22,8 +22,11 @@
  * ******************************************************************/
 
 #include "thinkfan.h"
+#include "config_cache.h"
 
 #include <dirent.h>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace thinkfan {
 
@@ -32,6 +35,44 @@ class HwmonSensorDriver;
 class HwmonFanDriver;
 
 
+/** @brief A cache of the sysfs directories visited while looking up hwmons, shared by all
+ *  @a HwmonInterface instances. Each directory is listed only once, and its name/model files
+ *  are read only once. The cache is kept across config reloads as long as the kernel doesn't
+ *  report any hwmon devices coming or going (via a NETLINK_KOBJECT_UEVENT socket). */
+class HwmonIndex {
+public:
+	struct Dir {
+		opt<string> name;
+		opt<string> model;
+		vector<string> subdirs;    // full paths, without "subsystem"
+		vector<string> hwmon_dirs; // full paths of hwmon* and device, sorted
+		std::unordered_set<string> files;
+	};
+
+	~HwmonIndex();
+	HwmonIndex(const HwmonIndex &) = delete;
+
+	static HwmonIndex &instance();
+
+	const Dir &dir(const string &path);
+
+	/** @brief Drop the cache if any hwmon device has changed since the last call.
+	 *  @return true if the cache was dropped, i.e. also if changes can't be detected. */
+	bool check_uevents();
+
+	void invalidate();
+
+private:
+	HwmonIndex();
+	Dir scan(const string &path);
+
+	static unique_ptr<HwmonIndex> instance_;
+
+	std::unordered_map<string, Dir> dirs_;
+	int uevent_fd_;
+};
+
+
 template<class HwmonT>
 class HwmonInterface {
 public:
@@ -41,6 +82,10 @@ public:
 	string lookup();
 
 private:
+	void find_paths();
+	string cache_key() const;
+	bool cache_valid(const ConfigCache::Entry &entry) const;
+
 	static vector<string> find_files(const string &path, const vector<unsigned int> &indices);
 	static string filename(int index);
 
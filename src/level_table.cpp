@@ -0,0 +1,125 @@
+/********************************************************************
+ * level_table.cpp: Compiled fan level limits
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "level_table.h"
+#include "config.h"
+#include "error.h"
+#include "message.h"
+#include "simd.h"
+
+#include <algorithm>
+
+namespace thinkfan {
+
+
+// Limits outside of the range of temperatures are saturated. INT16_MAX as an upper limit and
+// INT16_MIN as a lower limit mean "never", which is why temperatures are clamped to a slightly
+// smaller range.
+static constexpr int16_t never_up = numeric_limits<int16_t>::max();
+static constexpr int16_t never_down = numeric_limits<int16_t>::min();
+
+
+LevelTable::LevelTable()
+: num_levels_(0)
+, stride_(0)
+, simple_(true)
+{}
+
+
+int16_t LevelTable::clamp_limit(int limit)
+{ return int16_t(std::clamp<int>(limit, never_down, never_up)); }
+
+
+int16_t LevelTable::clamp_temp(int temp)
+{ return int16_t(std::clamp<int>(temp, never_down + 1, never_up - 1)); }
+
+
+void LevelTable::compile(const vector<unique_ptr<Level>> &levels, const TemperatureZone &zone)
+{
+	if (levels.empty())
+		throw Bug("Attempt to compile an empty level table");
+
+	simple_ = dynamic_cast<const SimpleLevel *>(levels.front().get());
+	zone_ = zone;
+	size_t width = simple_ ? 1 : zone.size();
+
+	num_levels_ = levels.size();
+	stride_ = (width + lane_width - 1) / lane_width * lane_width;
+
+	// Padding: No temperature is ever >= never_up, and any temperature is < never_up
+	upper_.assign(num_levels_ * stride_, never_up);
+	lower_.assign(num_levels_ * stride_, never_up);
+	temps_.assign(stride_, never_down);
+
+	for (size_t l = 0; l < num_levels_; ++l) {
+		const Level &level = *levels[l];
+		if (level.lower_limit().size() != width || level.upper_limit().size() != width)
+			throw Bug("Level limits don't match the number of temperatures");
+		std::transform(level.upper_limit().begin(), level.upper_limit().end(), upper_.begin() + long(l * stride_), clamp_limit);
+		std::transform(level.lower_limit().begin(), level.lower_limit().end(), lower_.begin() + long(l * stride_), clamp_limit);
+	}
+
+	log(TF_DBG) << "Compiled " << static_cast<unsigned int>(num_levels_) << " levels for "
+		<< static_cast<unsigned int>(width) << " temperature(s), using "
+		<< simd::isa() << " comparisons." << flush;
+}
+
+
+size_t LevelTable::size() const
+{ return num_levels_; }
+
+
+void LevelTable::load_temps(const TemperatureState &ts)
+{
+	if (simple_)
+		temps_[0] = clamp_temp(zone_.tmax(ts));
+	else
+		zone_.transform(ts, temps_.begin(), clamp_temp);
+}
+
+
+bool LevelTable::up(size_t lvl) const
+{ return !simd::all_less(temps_.data(), &upper_[lvl * stride_], stride_); }
+
+
+bool LevelTable::down(size_t lvl) const
+{ return simd::all_less(temps_.data(), &lower_[lvl * stride_], stride_); }
+
+
+size_t LevelTable::evaluate(size_t cur, const TemperatureState &ts)
+{
+	load_temps(ts);
+
+	const size_t last = num_levels_ - 1;
+	if (cur < last && up(cur)) {
+		while (cur < last && up(cur))
+			++cur;
+	}
+	else {
+		while (cur > 0 && down(cur))
+			--cur;
+	}
+
+	return cur;
+}
+
+
+} // namespace thinkfan
@@ -0,0 +1,75 @@
+#pragma once
+
+/********************************************************************
+ * level_table.h: Compiled fan level limits
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "thinkfan.h"
+#include "temperature_state.h"
+
+#include <cstdint>
+
+namespace thinkfan {
+
+
+/** @brief The limits of all levels of a @a StepwiseMapping, compiled into one contiguous
+ *  level-major matrix of int16 values so that finding the next fan level doesn't involve
+ *  any virtual calls or pointer chasing.
+ *  Each row is padded to a multiple of @a lane_width entries with values that can
+ *  never trigger a level change, so the @a simd kernels need no remainder handling. */
+class LevelTable {
+public:
+	/// Row padding in entries. 16 * int16 is 32 bytes, i.e. one AVX2 register.
+	static constexpr size_t lane_width = 16;
+
+	LevelTable();
+
+	/** @brief Compile the limits of @a levels.
+	 *  @param zone The temperatures that the limits refer to. @a SimpleLevel s only compare
+	 *  against the highest of them. */
+	void compile(const vector<unique_ptr<Level>> &levels, const TemperatureZone &zone);
+
+	/** @brief Find the level we should be in, given we're currently in level @a cur.
+	 *  Goes up as long as any temperature reaches the next upper limit. Otherwise goes down as
+	 *  long as all temperatures are below the current lower limit.
+	 *  @return The index of the new level. */
+	size_t evaluate(size_t cur, const TemperatureState &ts);
+
+	size_t size() const;
+
+private:
+	void load_temps(const TemperatureState &ts);
+	bool up(size_t lvl) const;
+	bool down(size_t lvl) const;
+
+	static int16_t clamp_limit(int limit);
+	static int16_t clamp_temp(int temp);
+
+	size_t num_levels_;
+	size_t stride_;
+	bool simple_;
+	TemperatureZone zone_;
+	vector<int16_t> lower_;
+	vector<int16_t> upper_;
+	vector<int16_t> temps_;
+};
+
+
+} // namespace thinkfan
@@ -28,6 +28,7 @@
 namespace thinkfan {
 
 std::weak_ptr<LibsensorsInterface> LibsensorsInterface::instance_;
+constexpr std::chrono::milliseconds LibsensorsInterface::max_age_;
 
 
 LibsensorsInterface::LibsensorsInterface()
@@ -62,12 +63,13 @@ LibsensorsInterface::InitGuard::InitGuard(LMSensorsDriver *client)
 
 LibsensorsInterface::InitGuard::~InitGuard()
 {
-	if (iface_->libsensors_initialized_ && iface_->clients_[client_].features.empty()) {
+	if (iface_->libsensors_initialized_ && iface_->clients_.find(client_) == iface_->clients_.end()) {
 
 		// Make all clients unavailable (they have to lookup again!)
-		for (auto drv_entry : iface_->clients_)
+		for (auto &drv_entry : iface_->clients_)
 			drv_entry.first->set_unavailable();
 		iface_->clients_.clear();
+		iface_->slots_.clear();
 
 		::sensors_cleanup();
 		iface_->libsensors_initialized_ = false;
@@ -89,62 +91,95 @@ shared_ptr<LibsensorsInterface> LibsensorsInterface::instance()
 }
 
 
-string LibsensorsInterface::lookup_client_features(LMSensorsDriver *client)
+string LibsensorsInterface::lookup_client_features(LMSensorsDriver *client, vector<size_t> &slots)
 {
-	chip_features cf;
+	std::unique_lock<std::mutex> lock(mutex_);
+	clients_.erase(client);
+	slots.clear();
 	InitGuard ig(client);
 
-	cf.chip = find_chip_by_name(client->chip_name());
+	const ::sensors_chip_name *chip = find_chip_by_name(client->chip_name());
 
 	for (const string& feature_name : client->feature_names()) {
-		auto feature = find_feature_by_name(*cf.chip, feature_name);
+		auto feature = find_feature_by_name(*chip, feature_name);
 		if (!feature)
 			throw SystemError("LM sensors chip '" + client->chip_name()
 				+ "' does not have the feature '" + feature_name + "'");
 
-		auto sub_feature = ::sensors_get_subfeature(cf.chip, feature, ::SENSORS_SUBFEATURE_TEMP_INPUT);
+		auto sub_feature = ::sensors_get_subfeature(chip, feature, ::SENSORS_SUBFEATURE_TEMP_INPUT);
 		if (!sub_feature)
 			throw SystemError("LM sensors feature ID '" + feature_name
 				+ "' of the chip '" + client->chip_name()
 				+ "' does not have a temperature input sensor");
-		cf.features.push_back({feature, sub_feature});
+		slots.push_back(get_slot(chip, feature, sub_feature));
 
 		log(TF_DBG) << "Initialized LM sensors temperature input of feature '"
 			+ feature_name + "' of chip '" + client->chip_name() + "'." << flush;
 	}
 
-	clients_.insert({client, cf});
-	return cf.chip->path;
+	clients_[client] = slots;
+	return chip->path;
 }
 
 
-vector<double> LibsensorsInterface::get_temps(LMSensorsDriver *client)
+size_t LibsensorsInterface::get_slot(
+	const ::sensors_chip_name *chip,
+	const ::sensors_feature *feature,
+	const ::sensors_subfeature *subfeature
+) {
+	for (size_t i = 0; i < slots_.size(); ++i) {
+		if (slots_[i].chip == chip && slots_[i].subfeature->number == subfeature->number)
+			return i;
+	}
+
+	slots_.push_back({ chip, feature, subfeature, MIN_CELSIUS_TEMP, 0, {} });
+	return slots_.size() - 1;
+}
+
+
+void LibsensorsInterface::remove_client(LMSensorsDriver *client)
 {
-	chip_features &cf = clients_.at(client);
-	vector<double> rv;
+	std::unique_lock<std::mutex> lock(mutex_);
+	clients_.erase(client);
+}
 
-	for (auto chip_feature : cf.features) {
-		auto sub_feature = chip_feature.second;
-		double real_value = MIN_CELSIUS_TEMP;
 
-		int err = ::sensors_get_value(cf.chip, sub_feature->number, &real_value);
-		if (err)
+void LibsensorsInterface::get_temps(LMSensorsDriver *client, const vector<size_t> &slots, vector<double> &temps)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	auto now = std::chrono::steady_clock::now();
+	temps.clear();
+
+	// Another client's failed lookup may have reset the slot table since this fetch was submitted
+	if (unlikely(clients_.find(client) == clients_.end()))
+		throw SystemError("LM sensors chip '" + client->chip_name() + "' has to be looked up again");
+
+	for (size_t idx : slots) {
+		if (unlikely(idx >= slots_.size()))
+			throw Bug("LM sensors slot index out of range for chip '" + client->chip_name() + "'");
+		Slot &slot = slots_[idx];
+
+		if (now - slot.read_at >= max_age_) {
+			slot.value = MIN_CELSIUS_TEMP;
+			slot.err = ::sensors_get_value(slot.chip, slot.subfeature->number, &slot.value);
+			slot.read_at = now;
+		}
+
+		if (slot.err)
 			throw SystemError(
-				string("temperature input value of feature '") + chip_feature.first->name
+				string("temperature input value of feature '") + slot.feature->name
 				+ "' of chip '" + client->chip_name()
-				+ "' is unavailable: " + ::sensors_strerror(err)
+				+ "' is unavailable: " + ::sensors_strerror(slot.err)
 			);
-		else if (real_value < MIN_CELSIUS_TEMP) // Make sure the reported value is physically valid.
+		else if (slot.value < MIN_CELSIUS_TEMP) // Make sure the reported value is physically valid.
 			throw SystemError(
-				string("Invalid temperature on feature '") + chip_feature.first->name
+				string("Invalid temperature on feature '") + slot.feature->name
 				+ "' of chip '" + client->chip_name()
-				+ "': " + std::to_string(real_value)
+				+ "': " + std::to_string(slot.value)
 			);
 
-		rv.push_back(real_value);
+		temps.push_back(slot.value);
 	}
-
-	return rv;
 }
 
 
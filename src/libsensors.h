@@ -45,13 +45,29 @@ public:
 
 	static shared_ptr<LibsensorsInterface> instance();
 
-	string lookup_client_features(LMSensorsDriver *client);
-	vector<double> get_temps(LMSensorsDriver *client);
+	/** @brief Look up all features of @a client and add them to the shared slot table.
+	 *  @param slots Receives the indices of @a client's features in the slot table.
+	 *  @return The sysfs path of @a client's chip */
+	string lookup_client_features(LMSensorsDriver *client, vector<size_t> &slots);
+
+	/// Forget about @a client, which is about to be destroyed.
+	void remove_client(LMSensorsDriver *client);
+
+	/** @brief Fill @a temps with the current values of the given @a slots, reusing its storage.
+	 *  Values that have been read less than @a max_age_ ago, i.e. in the same loop by
+	 *  another client of the same chip, are not read again. Thread-safe.
+	 *  Throws a @a SystemError if @a client has been made unavailable in the meantime. */
+	void get_temps(LMSensorsDriver *client, const vector<size_t> &slots, vector<double> &temps);
 
 private:
-	struct chip_features {
-		const ::sensors_chip_name *chip = nullptr;
-		vector<pair<const ::sensors_feature *, const ::sensors_subfeature *>> features;
+	/// One temperature input, no matter how many clients use it
+	struct Slot {
+		const ::sensors_chip_name *chip;
+		const ::sensors_feature *feature;
+		const ::sensors_subfeature *subfeature;
+		double value;
+		int err;
+		std::chrono::steady_clock::time_point read_at;
 	};
 
 	/** @brief A scope guard to un-initialize libsensors when a requested feature/subfeature
@@ -86,9 +102,19 @@ private:
 		const string &feature_name
 	);
 
+	size_t get_slot(
+		const ::sensors_chip_name *chip,
+		const ::sensors_feature *feature,
+		const ::sensors_subfeature *subfeature
+	);
+
+	static constexpr std::chrono::milliseconds max_age_ { 50 };
 	static std::weak_ptr<LibsensorsInterface> instance_;
 
-	std::map<LMSensorsDriver *, chip_features> clients_;
+	// Guards everything below, since get_temps() is called from the WorkerPool
+	std::mutex mutex_;
+	vector<Slot> slots_;
+	std::map<LMSensorsDriver *, vector<size_t>> clients_;
 	bool libsensors_initialized_;
 };
 
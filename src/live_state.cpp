@@ -0,0 +1,189 @@
+/********************************************************************
+ * live_state.cpp: Publishing the current state in shared memory
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "live_state.h"
+#include "config.h"
+#include "sensors.h"
+#include "fans.h"
+#include "error.h"
+#include "message.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+
+namespace thinkfan {
+
+
+LiveState *LiveState::instance_ = nullptr;
+
+
+/// Copy as much of @a src as fits, always NUL-terminated
+template<size_t N>
+static void copy_str(char (&dst)[N], const string &src)
+{
+	size_t len = std::min(src.length(), N - 1);
+	std::memcpy(dst, src.data(), len);
+	dst[len] = 0;
+}
+
+
+LiveState::LiveState(const string &name)
+: name_(name.length() && name[0] == '/' ? name : "/" + name)
+, shm_(nullptr)
+, seq_(0)
+, updates_(0)
+{
+	if (instance_)
+		throw Bug("Attempt to create a second LiveState");
+
+	if (name_.length() < 2 || name_.find('/', 1) != string::npos)
+		throw InvocationError(MSG_SHM_NAME(name));
+
+	int fd = ::shm_open(name_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw IOerror(MSG_SHM_OPEN(name_), errno);
+	// Readers may not share our umask
+	if (::fchmod(fd, 0644) || ::ftruncate(fd, sizeof(struct thinkfan_shm))) {
+		int err = errno;
+		::close(fd);
+		throw IOerror(MSG_SHM_OPEN(name_), err);
+	}
+	void *p = ::mmap(nullptr, sizeof(struct thinkfan_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	int err = errno;
+	::close(fd);
+	if (p == MAP_FAILED)
+		throw IOerror(MSG_SHM_OPEN(name_), err);
+	shm_ = static_cast<struct thinkfan_shm *>(p);
+
+	// A killed instance may have left the segment behind, maybe even in mid-update
+	seq_ = __atomic_load_n(&shm_->seq, __ATOMIC_RELAXED) & ~uint32_t(1);
+	begin_update();
+	const size_t after_seq = offsetof(struct thinkfan_shm, seq) + sizeof(shm_->seq);
+	std::memset(reinterpret_cast<char *>(shm_) + after_seq, 0, sizeof(struct thinkfan_shm) - after_seq);
+	shm_->magic = THINKFAN_SHM_MAGIC;
+	shm_->version = THINKFAN_SHM_VERSION;
+	shm_->size = sizeof(struct thinkfan_shm);
+	shm_->pid = int32_t(::getpid());
+	end_update();
+
+	log(TF_NFY) << MSG_SHM_PUBLISHING(name_) << flush;
+	instance_ = this;
+}
+
+
+LiveState::~LiveState()
+{
+	::munmap(shm_, sizeof(struct thinkfan_shm));
+	if (::shm_unlink(name_.c_str()))
+		log(TF_ERR) << "shm_unlink(" << name_ << "): " << strerror(errno) << flush;
+	instance_ = nullptr;
+}
+
+
+LiveState *LiveState::instance()
+{ return instance_; }
+
+
+void LiveState::begin_update()
+{
+	__atomic_store_n(&shm_->seq, ++seq_, __ATOMIC_RELAXED);
+	// The odd sequence number must be visible before any of the data changes
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+void LiveState::end_update()
+{ __atomic_store_n(&shm_->seq, ++seq_, __ATOMIC_RELEASE); }
+
+
+void LiveState::set_config(const Config &config)
+{
+	begin_update();
+
+	uint32_t flags = 0;
+	uint32_t n = 0, first_temp = 0;
+	for (const unique_ptr<SensorDriver> &sensor : config.sensors()) {
+		if (n == THINKFAN_SHM_MAX_SENSORS || first_temp + sensor->num_temps() > THINKFAN_SHM_MAX_TEMPS) {
+			flags |= THINKFAN_SHM_TRUNCATED;
+			break;
+		}
+		struct thinkfan_shm_sensor &s = shm_->sensors[n++];
+		copy_str(s.name, sensor->name());
+		s.first_temp = first_temp;
+		s.num_temps = sensor->num_temps();
+		first_temp += sensor->num_temps();
+	}
+	shm_->num_sensors = n;
+	shm_->num_temps = first_temp;
+
+	n = 0;
+	for (const unique_ptr<FanConfig> &fan_cfg : config.fan_configs()) {
+		if (n == THINKFAN_SHM_MAX_FANS) {
+			flags |= THINKFAN_SHM_TRUNCATED;
+			break;
+		}
+		struct thinkfan_shm_fan &f = shm_->fans[n++];
+		copy_str(f.name, fan_cfg->fan()->name());
+		f.speed[0] = 0;
+	}
+	shm_->num_fans = n;
+	shm_->flags = flags;
+
+	end_update();
+
+	if (flags & THINKFAN_SHM_TRUNCATED)
+		log(TF_WRN) << MSG_SHM_TRUNCATED(name_) << flush;
+}
+
+
+void LiveState::publish(const Config &config, const TemperatureState &ts)
+{
+	struct timespec now;
+	::clock_gettime(CLOCK_MONOTONIC, &now);
+
+	begin_update();
+
+	shm_->update_ns = uint64_t(now.tv_sec) * 1000000000u + uint64_t(now.tv_nsec);
+	shm_->updates = ++updates_;
+
+	const size_t num_temps = std::min<size_t>(shm_->num_temps, ts.temps().size());
+	for (size_t i = 0; i < num_temps; ++i) {
+		shm_->temps[i].temp = ts.temps()[i];
+		shm_->temps[i].biased_temp = ts.biased_temps()[i];
+	}
+
+	const size_t num_fans = std::min<size_t>(shm_->num_fans, config.fan_configs().size());
+	for (size_t i = 0; i < num_fans; ++i)
+		copy_str(shm_->fans[i].speed, config.fan_configs()[i]->fan()->current_speed());
+
+	end_update();
+}
+
+
+} // namespace thinkfan
@@ -0,0 +1,64 @@
+#pragma once
+
+/********************************************************************
+ * live_state.h: Publishing the current state in shared memory
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "thinkfan.h"
+#include "temperature_state.h"
+#include "thinkfan_shm.h"
+
+namespace thinkfan {
+
+
+/** @brief Publishes the sensor layout, temperatures and fan speeds in a POSIX shared
+ *  memory segment as described in thinkfan_shm.h, so local tools don't have to read the
+ *  sensors again. Writes are seqlock-protected and never wait for readers. Like the
+ *  @a MetricsExporter, there is at most one instance. The segment is removed on exit. */
+class LiveState {
+public:
+	/// @param name The shm_open() name, with or without the leading slash.
+	LiveState(const string &name);
+	~LiveState();
+	LiveState(const LiveState &) = delete;
+
+	/// @return The running publisher or nullptr if there is none.
+	static LiveState *instance();
+
+	/// Publish the names and layout of the sensors and fans in @a config.
+	void set_config(const Config &config);
+
+	/// Publish the current temperatures and fan speeds. Doesn't allocate.
+	void publish(const Config &config, const TemperatureState &ts);
+
+private:
+	void begin_update();
+	void end_update();
+
+	static LiveState *instance_;
+
+	string name_;
+	struct thinkfan_shm *shm_;
+	uint32_t seq_;
+	uint64_t updates_;
+};
+
+
+} // namespace thinkfan
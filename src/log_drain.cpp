@@ -0,0 +1,176 @@
+/********************************************************************
+ * log_drain.cpp: Asynchronous log output
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "log_drain.h"
+#include "error.h"
+#include "message.h"
+
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#ifdef USE_JOURNAL
+#include <systemd/sd-journal.h>
+#endif
+
+namespace thinkfan {
+
+
+LogDrain::LogDrain(bool syslog)
+: syslog_(syslog),
+  head_(0),
+  tail_(0),
+  dropped_(0),
+  stopping_(false)
+{
+	wake_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wake_fd_ < 0)
+		throw IOerror("eventfd(): ", errno);
+
+	thread_ = std::thread(&LogDrain::drain, this);
+}
+
+
+LogDrain::~LogDrain()
+{
+	stopping_.store(true, std::memory_order_release);
+	uint64_t one = 1;
+	if (::write(wake_fd_, &one, sizeof(one)) >= 0)
+		thread_.join();
+	else
+		thread_.detach();
+	::close(wake_fd_);
+}
+
+
+void LogDrain::push(int lvl, const string &msg, bool fields)
+{
+	const size_t num_records = std::max<size_t>(1, (msg.length() + Record::text_size - 1) / Record::text_size);
+	const size_t head = head_.load(std::memory_order_relaxed);
+
+	// All or nothing, so the drain never sees half a message
+	if (capacity_ - (head - tail_.load(std::memory_order_acquire)) < num_records) {
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	const char *src = msg.data();
+	size_t remaining = msg.length();
+	for (size_t i = 0; i < num_records; ++i) {
+		Record &r = ring_[(head + i) & (capacity_ - 1)];
+		r.lvl = lvl;
+		r.len = static_cast<unsigned short>(std::min(remaining, Record::text_size));
+		r.more = i + 1 < num_records;
+		r.fields = fields;
+		std::memcpy(r.text, src, r.len);
+		src += r.len;
+		remaining -= r.len;
+	}
+	head_.store(head + num_records, std::memory_order_release);
+
+	// Doesn't block since the eventfd is non-blocking and its counter will never overflow.
+	// If it fails anyway, the message will go out with the next one.
+	uint64_t one = 1;
+	ssize_t rv = ::write(wake_fd_, &one, sizeof(one));
+	(void)rv;
+}
+
+
+void LogDrain::drain()
+{
+	struct pollfd pfd = { wake_fd_, POLLIN, 0 };
+	string msg;
+
+	while (true) {
+		if (::poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return;
+		uint64_t count;
+		ssize_t rv = ::read(wake_fd_, &count, sizeof(count));
+		(void)rv;
+
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		const size_t head = head_.load(std::memory_order_acquire);
+		while (tail != head) {
+			const Record &r = ring_[tail & (capacity_ - 1)];
+			const int lvl = r.lvl;
+			const bool more = r.more;
+			const bool fields = r.fields;
+			msg.append(r.text, r.len);
+			++tail;
+			if (!more) {
+				// Free the records before the possibly slow output
+				tail_.store(tail, std::memory_order_release);
+				output(lvl, msg, fields);
+				msg.clear();
+			}
+		}
+
+		unsigned int dropped = dropped_.exchange(0, std::memory_order_relaxed);
+		if (dropped)
+			output(TF_WRN, "WARNING: " + std::to_string(dropped) + " log messages were dropped.", false);
+
+		if (stopping_.load(std::memory_order_acquire) && tail_.load(std::memory_order_relaxed) == head_.load(std::memory_order_acquire))
+			return;
+	}
+}
+
+
+void LogDrain::output(int lvl, const string &msg, bool fields)
+{
+	if (fields)
+		send_fields(lvl, msg);
+	else if (syslog_)
+		::syslog(lvl, "%s", msg.c_str());
+	else
+		std::cerr << msg << std::endl;
+}
+
+
+void LogDrain::send_fields(int lvl, const string &fields)
+{
+#ifdef USE_JOURNAL
+	const string priority = "PRIORITY=" + std::to_string(lvl);
+	vector<struct iovec> iov {
+		{ const_cast<char *>(priority.data()), priority.length() },
+		{ const_cast<char *>("SYSLOG_IDENTIFIER=thinkfan"), sizeof("SYSLOG_IDENTIFIER=thinkfan") - 1 },
+	};
+	for (size_t pos = 0, end; pos < fields.length(); pos = end + 1) {
+		end = fields.find('\0', pos);
+		if (end == string::npos)
+			end = fields.length();
+		iov.push_back({ const_cast<char *>(fields.data() + pos), end - pos });
+	}
+	::sd_journal_sendv(iov.data(), int(iov.size()));
+#else
+	(void)lvl;
+	(void)fields;
+#endif // USE_JOURNAL
+}
+
+
+} // namespace thinkfan
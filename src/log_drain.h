@@ -0,0 +1,83 @@
+#pragma once
+
+/********************************************************************
+ * log_drain.h: Asynchronous log output
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "thinkfan.h"
+
+#include <atomic>
+#include <thread>
+
+namespace thinkfan {
+
+
+/** @brief Writes log messages to syslog or stderr on a background thread, so a stalled
+ *  journald can't hold up the main loop.
+ *  Messages are copied into a ring of fixed-size records, long ones spanning several
+ *  records. There must be only one thread that @a push()es (the main thread). If the ring
+ *  is full, messages are dropped and the number of lost messages is logged once there's
+ *  room again. Must be created after the @a EventLoop so its thread doesn't receive any
+ *  signals, and after forking since the thread wouldn't survive it. */
+class LogDrain {
+public:
+	LogDrain(bool syslog);
+
+	/// Write all pending messages, then stop the thread.
+	~LogDrain();
+
+	LogDrain(const LogDrain &) = delete;
+
+	/** @brief Queue @a msg at @a lvl. Never blocks.
+	 *  @param fields Whether @a msg is a list of NUL-terminated FIELD=value pairs for
+	 *  @a send_fields() rather than text. */
+	void push(int lvl, const string &msg, bool fields = false);
+
+	/// Send the NUL-terminated FIELD=value pairs in @a fields to the journal at @a lvl.
+	static void send_fields(int lvl, const string &fields);
+
+private:
+	struct Record {
+		static constexpr size_t text_size = 248;
+
+		int lvl;
+		unsigned short len;
+		bool more; ///< The message continues in the next record
+		bool fields;
+		char text[text_size];
+	};
+
+	void drain();
+	void output(int lvl, const string &msg, bool fields);
+
+	static constexpr size_t capacity_ = 512; // must be a power of 2
+
+	const bool syslog_;
+	Record ring_[capacity_];
+	std::atomic<size_t> head_; ///< Written only by push()
+	std::atomic<size_t> tail_; ///< Written only by drain()
+	std::atomic<unsigned int> dropped_;
+	std::atomic<bool> stopping_;
+	int wake_fd_;
+	std::thread thread_;
+};
+
+
+} // namespace thinkfan
@@ -23,7 +23,9 @@
 #include "message.h"
 #include "config.h"
 #include "fans.h"
+#include "log_drain.h"
 #include <syslog.h>
+#include <unistd.h>
 #include <iostream>
 
 
@@ -79,6 +81,7 @@ Logger &log()
 
 Logger::Logger()
 : syslog_(false),
+  journal_(false),
   log_lvl_(DEFAULT_LOG_LVL),
   msg_lvl_(DEFAULT_LOG_LVL)
 {}
@@ -98,6 +101,7 @@ LogLevel &Logger::log_lvl()
 Logger::~Logger()
 {
 	flush();
+	stop_drain();
 	if (syslog_) closelog();
 }
 
@@ -107,16 +111,52 @@ void Logger::enable_syslog()
 #ifndef DISABLE_SYSLOG
 	openlog("thinkfan", LOG_CONS, LOG_USER);
 	syslog_ = true;
+#ifdef USE_JOURNAL
+	// Under systemd, syslog goes to the journal anyway
+	journal_ = ::access("/run/systemd/journal/socket", W_OK) == 0;
+#endif
 #endif //DISABLE_SYSLOG
 }
 
 
+bool Logger::journal(LogLevel lvl) const
+{ return journal_ && lvl <= log_lvl_; }
+
+
+void Logger::send_fields(LogLevel lvl, const string &fields)
+{
+	flush();
+	if (lvl > log_lvl_)
+		return;
+	if (drain_)
+		drain_->push(lvl, fields, true);
+	else
+		LogDrain::send_fields(lvl, fields);
+}
+
+
+void Logger::start_drain()
+{
+	flush();
+	drain_.reset(new LogDrain(syslog_));
+}
+
+
+void Logger::stop_drain()
+{
+	flush();
+	drain_.reset();
+}
+
+
 Logger &Logger::flush()
 {
 	if (msg_pfx_.length() == 0)
 		return *this;
 	if (msg_lvl_ <= log_lvl_) {
-		if (syslog_)
+		if (drain_)
+			drain_->push(msg_lvl_, msg_pfx_);
+		else if (syslog_)
 			syslog(msg_lvl_, "%s", msg_pfx_.c_str());
 		else
 			std::cerr << msg_pfx_ << std::endl;
@@ -145,23 +185,51 @@ Logger &Logger::level(const LogLevel &lvl)
 }
 
 
+bool Logger::enabled() const
+{ return msg_lvl_ <= log_lvl_; }
+
+
 Logger &Logger::operator<<( const std::string &msg)
-{ msg_pfx_ += msg; return *this; }
+{
+	if (enabled())
+		msg_pfx_ += msg;
+	return *this;
+}
 
 Logger &Logger::operator<< (const int i)
-{ msg_pfx_ += std::to_string(i); return *this; }
+{
+	if (enabled())
+		msg_pfx_ += std::to_string(i);
+	return *this;
+}
 
 Logger &Logger::operator<< (const unsigned int i)
-{ msg_pfx_ += std::to_string(i); return *this; }
+{
+	if (enabled())
+		msg_pfx_ += std::to_string(i);
+	return *this;
+}
 
 Logger &Logger::operator<< (const float &i)
-{ msg_pfx_ += std::to_string(i); return *this; }
+{
+	if (enabled())
+		msg_pfx_ += std::to_string(i);
+	return *this;
+}
 
 Logger &Logger::operator<< (const char *msg)
-{ msg_pfx_ += msg; return *this; }
+{
+	if (enabled())
+		msg_pfx_ += msg;
+	return *this;
+}
 
 Logger &Logger::operator<< (char *msg)
-{ msg_pfx_ += msg; return *this; }
+{
+	if (enabled())
+		msg_pfx_ += msg;
+	return *this;
+}
 
 
 Logger &Logger::operator<< (Logger & (*pf_flush)(Logger &))
@@ -170,6 +238,9 @@ Logger &Logger::operator<< (Logger & (*pf_flush)(Logger &))
 
 Logger &Logger::operator<< (const TemperatureState &ts)
 {
+	if (!enabled())
+		return *this;
+
 	msg_pfx_ += "Temperatures(bias): ";
 
 	vector<float>::const_iterator bias_it;
@@ -178,18 +249,41 @@ Logger &Logger::operator<< (const TemperatureState &ts)
 	for (temp_it = ts.temps().cbegin(), bias_it = ts.biases().cbegin();
 			temp_it != ts.temps().cend() && bias_it != ts.biases().cend();
 			++temp_it, ++bias_it)
-		msg_pfx_ += std::to_string(*temp_it) + "(" + std::to_string(int(*bias_it)) + "), ";
+	{
+		msg_pfx_ += std::to_string(*temp_it);
+		msg_pfx_ += '(';
+		msg_pfx_ += std::to_string(int(*bias_it));
+		msg_pfx_ += "), ";
+	}
 
 	msg_pfx_.pop_back(); msg_pfx_.pop_back();
 	return *this;
 }
 
 
+Logger &Logger::operator<< (const Histogram &hist)
+{
+	if (!enabled())
+		return *this;
+
+	msg_pfx_ += "n=" + std::to_string(hist.count())
+		+ " p50=" + std::to_string(hist.percentile(0.5).count())
+		+ "us p99=" + std::to_string(hist.percentile(0.99).count())
+		+ "us max=" + std::to_string(hist.max().count()) + "us";
+	return *this;
+}
+
+
 Logger &Logger::operator<< (const vector<unique_ptr<FanConfig>> &fan_configs)
 {
+	if (!enabled())
+		return *this;
+
 	msg_pfx_ += "Fans: ";
-	for (const unique_ptr<FanConfig> &fan_cf : fan_configs)
-		msg_pfx_ += fan_cf->fan()->current_speed() + ", ";
+	for (const unique_ptr<FanConfig> &fan_cf : fan_configs) {
+		msg_pfx_ += fan_cf->fan()->current_speed();
+		msg_pfx_ += ", ";
+	}
 
 	msg_pfx_.pop_back(); msg_pfx_.pop_back();
 	return *this;
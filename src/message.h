@@ -51,6 +51,8 @@ LogLevel &operator++(LogLevel &l);
 
 class ExpectedError;
 class FanConfig;
+class Histogram;
+class LogDrain;
 
 class Logger {
 private:
@@ -59,6 +61,21 @@ private:
 public:
 	~Logger();
 	void enable_syslog();
+
+	/** @brief Hand all further messages to a @a LogDrain instead of writing them directly.
+	 *  Only the main thread may log after this. */
+	void start_drain();
+
+	/// Write all queued messages and go back to writing them directly.
+	void stop_drain();
+
+	/// Whether structured entries at @a lvl will be sent to the systemd journal.
+	bool journal(LogLevel lvl) const;
+
+	/** @brief Send a structured entry to the journal if @a lvl is enabled.
+	 *  @param fields NUL-terminated FIELD=value pairs. */
+	void send_fields(LogLevel lvl, const string &fields);
+
 	Logger &level(const LogLevel &lvl);
 	Logger &flush();
 	static Logger &instance();
@@ -74,9 +91,12 @@ public:
 
 	Logger &operator<< (const TemperatureState &);
 	Logger &operator<< (const vector<unique_ptr<FanConfig>> &);
+	Logger &operator<< (const Histogram &);
 
 	template<class ListT>
 	Logger &operator<< (const ListT &l) {
+		if (!enabled())
+			return *this;
 		msg_pfx_ += "(";
 		for (auto elem : l) {
 			msg_pfx_ += std::to_string(elem) + ", ";
@@ -87,7 +107,12 @@ public:
 	}
 
 private:
+	/// Whether the current message will be output at all. Skip formatting if not.
+	bool enabled() const;
+
 	bool syslog_;
+	bool journal_;
+	unique_ptr<LogDrain> drain_;
 	LogLevel log_lvl_;
 	LogLevel msg_lvl_;
 	std::string msg_pfx_;
@@ -120,9 +145,9 @@ template<class ErrT, class... ArgTs> void error(const ArgTs &... args) {
 #define MSG_TITLE "thinkfan " VERSION ": A minimalist fan control program"
 
 #define MSG_USAGE \
- "Usage: thinkfan [-hnqDd [-b BIAS] [-c CONFIG] [-s SECONDS] [-p [SECONDS]]]" \
+ "Usage: thinkfan [-hnqDd [-b BIAS] [-c CONFIG] [-s SECONDS] [-p [SECONDS]] [-m ADDRESS] [-r FILE] [-l NAME] [-H FILE] [-S PATH]]" \
  "\n -h  This help message" \
- "\n -s  Maximum cycle time in seconds (Integer. Default: 5)" \
+ "\n -s  Maximum cycle time in seconds (0.1 to 15. Default: 5)" \
  "\n -b  Floating point number (-10 to 30) to control rising temperature" \
  "\n     exaggeration (see thinkfan(5)). Default: 0.0" \
  "\n -c  Load different configuration file (default: /etc/thinkfan.conf)" \
@@ -132,6 +157,15 @@ template<class ErrT, class... ArgTs> void error(const ArgTs &... args) {
  "\n -v  Enable verbose logging (e.g. log temperatures continuously)." \
  "\n -p  Use the pulsing-fan workaround (for worn out fans). Takes an optional" \
  "\n     floating-point argument (0 ~ 10s) as depulsing duration. Default 0.5s." \
+ "\n -m  Serve OpenMetrics on ADDRESS, which is either the absolute path of a UNIX" \
+ "\n     socket or HOST:PORT for TCP (e.g. localhost:9258)." \
+ "\n -r  Record all temperatures to the binary trace FILE for thinkfan-bench." \
+ "\n -l  Publish temperatures and fan speeds in the POSIX shared memory segment" \
+ "\n     NAME (e.g. /thinkfan). See thinkfan_shm.h for the layout." \
+ "\n -H  Keep a compact history of all temperatures and fan levels in the ring" \
+ "\n     FILE (4 MiB by default), which thinkfan-dump converts to CSV." \
+ "\n -S  Accept commands to pin fans, change the bias or sleeptime etc. on the UNIX" \
+ "\n     socket PATH (see thinkfan(1))." \
  DND_DISK_HELP \
  "\n -D  DANGEROUS mode: Disable all sanity checks. May result in undefined" \
  "\n     behaviour!\n"
@@ -161,6 +195,40 @@ template<class ErrT, class... ArgTs> void error(const ArgTs &... args) {
 #define MSG_T_GET(file) string(__func__) + ": Failed to read temperature(s) from " + file + ": "
 #define MSG_T_INVALID(s, d) s + ": Invalid temperature: " + std::to_string(d)
 #define MSG_SENSOR_INIT(file) string(__func__) + ": Initializing sensor in " + file + ": "
+#define MSG_CACHE_STALE(file) string(file) + " belongs to a different config, ignoring it."
+#define MSG_CACHE_DEVICES(file) string(file) + " was written with different hwmon devices, ignoring it."
+#define MSG_CACHE_CORRUPT(file) string(file) + " is truncated or corrupt, ignoring it."
+#define MSG_CACHE_LOADED(file, n) "Loaded " << n << " hwmon lookups from " << file
+#define MSG_CACHE_WRITE(file) string("Can't write ") + file + ": "
+#define MSG_ID_FAN_LEVEL "7cb40d140a444346bf9a64eab762c08e"
+#define MSG_FAN_LEVEL_CHANGED "Fan level changed"
+#define MSG_RESUMED(secs) "Resumed after " << secs << " s of sleep: Re-initializing all fans and sensors."
+#define MSG_CONF_UNCHANGED "Config is unchanged, keeping it."
+#define MSG_METRICS_ADDR(addr) "Invalid metrics address: " + addr \
+	+ ". Must be an absolute path or HOST:PORT."
+#define MSG_METRICS_SOCKET(addr) "Opening metrics socket " + addr + ": "
+#define MSG_TRACE_OPEN(file) "Opening trace " + file + ": "
+#define MSG_TRACE_WRITE(file) "Writing trace " + file + ": "
+#define MSG_TRACE_RECORDING(file) "Recording temperatures to " + file + "."
+#define MSG_TRACE_INVALID(file) file + " is not a thinkfan trace."
+#define MSG_SHM_NAME(name) "Invalid shared memory name: " + name \
+	+ ". Must be a single path component like /thinkfan."
+#define MSG_SHM_OPEN(name) "Opening shared memory " + name + ": "
+#define MSG_SHM_PUBLISHING(name) "Publishing live state in shared memory " + name + "."
+#define MSG_SHM_TRUNCATED(name) name + ": Too many sensors or fans, publishing only the first ones."
+#define MSG_HISTORY_OPEN(file) "Opening history " + file + ": "
+#define MSG_HISTORY_SIZE(file) file + ": A history file must be at least 8 KiB."
+#define MSG_HISTORY_INVALID(file) file + " is not a thinkfan history file of this size. " \
+	"Delete it to start over."
+#define MSG_HISTORY_RECORDING(file, kib) "Recording history to " + file + " (" + std::to_string(kib) + " KiB)."
+#define MSG_HISTORY_TRUNCATED(file) file + ": Too many temperatures or fans, recording only the first ones."
+#define MSG_CONTROL_PATH(path) "Invalid control socket: " + path + ". Must be an absolute path."
+#define MSG_CONTROL_SOCKET(path) "Opening control socket " + path + ": "
+#define MSG_CONTROL_LISTENING(path) "Accepting commands on " + path + "."
+#define MSG_CONTROL_COMMAND(cmd) "Control command: " + cmd
+#define MSG_DEV_OPEN(file) string("Opening ") + file + ": "
+#define MSG_DEV_READ(file) string("Reading ") + file + ": "
+#define MSG_DEV_WRITE(file) string("Writing to ") + file + ": "
 #define MSG_MULTIPLE_HWMONS_FOUND "Found multiple hwmons with this name: "
 
 
@@ -172,15 +240,17 @@ template<class ErrT, class... ArgTs> void error(const ArgTs &... args) {
 #define MSG_FAN_CTRL(str, fan) string(__func__) + ": Writing \"" + str + "\" to " + fan + ": "
 #define MSG_FAN_INIT(fan) string(__func__) + ": Initializing fan control in " + fan + ": "
 #define MSG_FAN_RESET(fan) string(__func__) + ": Resetting fan control in " + fan + ": "
+#define MSG_FAN_PINNED(fan, level) fan + ": Pinned to " + level + "."
+#define MSG_FAN_UNPINNED(fan) fan + ": Pin released, back to automatic control."
 #define MSG_FAN_EPERM(fan) string(__func__) + ": No permission to write to " + fan \
 	+ ". Thinkfan needs to be run as root!"
 
 
-#define MSG_OPT_S_15(t) std::to_string(t) + " seconds of not realizing "\
+#define MSG_OPT_S_15(t) t + " seconds of not realizing "\
 	"rising temperatures may be dangerous!"
-#define MSG_OPT_S_1(t) "A sleeptime of " + std::to_string(t) + " seconds doesn't make much " \
+#define MSG_OPT_S_1(t) "A sleeptime of " + t + " seconds doesn't make much " \
  "sense."
-#define MSG_OPT_S "option -s requires an int argument!"
+#define MSG_OPT_S "option -s requires an argument!"
 #define MSG_OPT_S_INVAL(x) string("invalid argument to option -s: ") + x
 #define MSG_OPT_B "bias must be between -10 and 30!"
 #define MSG_OPT_B_NOARG "option -b requires an argument!"
@@ -231,6 +301,12 @@ template<class ErrT, class... ArgTs> void error(const ArgTs &... args) {
 
 #define MSG_CONF_MISSING_LOWER_LIMIT "You must specify a lower limit on all but the first fan level"
 #define MSG_CONF_MISSING_UPPER_LIMIT "You must specify an upper limit on all but the last fan level"
+#define MSG_CONF_CURVE_EMPTY "A fan curve needs at least one point"
+#define MSG_CONF_CURVE_ORDER "The temperatures of a fan curve must be strictly increasing"
+#define MSG_CONF_CURVE_PWM(n) "Invalid PWM value " + std::to_string(n) + " in fan curve. Must be between 0 and 255"
+#define MSG_CONF_CURVE_FAN "A fan curve can only be used with a hwmon (PWM) fan"
+#define MSG_CONF_ZONE_ID(id) "No sensor has the id \"" + id + "\""
+#define MSG_CONF_ZONE_EMPTY "None of the sensors this fan depends on are available"
 
 
 #endif
@@ -0,0 +1,406 @@
+/********************************************************************
+ * metrics.cpp: OpenMetrics exporter
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "metrics.h"
+#include "config.h"
+#include "sensors.h"
+#include "fans.h"
+#include "error.h"
+#include "message.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+
+namespace thinkfan {
+
+
+/** The label sets are fixed for the lifetime of a config, so they're rendered once in
+ *  @a set_config(). Only the values are double-buffered: The main loop writes into
+ *  buffers[(seq + 1) & 1] and then increments @a seq, a scrape copies buffers[seq & 1] and
+ *  retries if @a seq has moved on in the meantime. A retry is practically never needed
+ *  since the main loop publishes at most a few times per second. */
+struct MetricsExporter::Snapshot {
+	struct Buffer {
+		Buffer(size_t num_temps, size_t num_fans, size_t num_drivers)
+		: temps(num_temps)
+		, biases(num_temps)
+		, fan_levels(num_fans)
+		, errors(num_drivers)
+		{}
+
+		vector<std::atomic<int>> temps;
+		vector<std::atomic<float>> biases;
+		vector<std::atomic<int>> fan_levels; // INT_MIN if it's not a number, e.g. "level auto"
+		vector<std::atomic<unsigned int>> errors;
+	};
+
+	Snapshot(vector<string> &&temp_labels, vector<string> &&fan_labels, vector<string> &&driver_labels)
+	: temp_labels(std::move(temp_labels))
+	, fan_labels(std::move(fan_labels))
+	, driver_labels(std::move(driver_labels))
+	, buffers {
+		{ this->temp_labels.size(), this->fan_labels.size(), this->driver_labels.size() },
+		{ this->temp_labels.size(), this->fan_labels.size(), this->driver_labels.size() }
+	}
+	, seq(0)
+	{}
+
+	const vector<string> temp_labels;
+	const vector<string> fan_labels;
+	const vector<string> driver_labels;
+	Buffer buffers[2];
+	std::atomic<unsigned int> seq;
+};
+
+
+MetricsExporter *MetricsExporter::instance_ = nullptr;
+
+
+static string escape_label(const string &value)
+{
+	string rv;
+	for (char c : value) {
+		if (c == '\\' || c == '"')
+			rv += '\\';
+		if (c == '\n')
+			rv += "\\n";
+		else
+			rv += c;
+	}
+	return rv;
+}
+
+
+MetricsExporter::MetricsExporter(const string &address)
+: listen_fd_(-1)
+, stop_fd_(-1)
+{
+	if (instance_)
+		throw Bug("Attempt to create a second MetricsExporter");
+
+	if (address.length() && address[0] == '/') {
+		struct sockaddr_un addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (address.length() >= sizeof(addr.sun_path))
+			throw InvocationError(MSG_METRICS_ADDR(address));
+		std::strcpy(addr.sun_path, address.c_str());
+
+		// Remove a stale socket left behind by a killed instance
+		struct stat st;
+		if (::lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+			::unlink(addr.sun_path);
+
+		listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listen_fd_ < 0)
+			throw IOerror(MSG_METRICS_SOCKET(address), errno);
+		if (::bind(listen_fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr))) {
+			int err = errno;
+			::close(listen_fd_);
+			throw IOerror(MSG_METRICS_SOCKET(address), err);
+		}
+		unix_path_ = address;
+	}
+	else {
+		size_t colon = address.rfind(':');
+		if (colon == string::npos || colon + 1 >= address.length())
+			throw InvocationError(MSG_METRICS_ADDR(address));
+		string host = address.substr(0, colon);
+		string port = address.substr(colon + 1);
+		if (host.length() >= 2 && host.front() == '[' && host.back() == ']')
+			host = host.substr(1, host.length() - 2);
+
+		struct addrinfo hints, *res;
+		std::memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		int gai_err = ::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res);
+		if (gai_err)
+			throw SystemError(MSG_METRICS_SOCKET(address) + ::gai_strerror(gai_err));
+
+		int err = 0;
+		for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+			listen_fd_ = ::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+			if (listen_fd_ < 0) {
+				err = errno;
+				continue;
+			}
+			int one = 1;
+			::setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (::bind(listen_fd_, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			err = errno;
+			::close(listen_fd_);
+			listen_fd_ = -1;
+		}
+		::freeaddrinfo(res);
+		if (listen_fd_ < 0)
+			throw IOerror(MSG_METRICS_SOCKET(address), err);
+	}
+
+	if (::listen(listen_fd_, 4)) {
+		int err = errno;
+		::close(listen_fd_);
+		throw IOerror(MSG_METRICS_SOCKET(address), err);
+	}
+
+	stop_fd_ = ::eventfd(0, EFD_CLOEXEC);
+	if (stop_fd_ < 0) {
+		int err = errno;
+		::close(listen_fd_);
+		throw IOerror("eventfd(): ", err);
+	}
+
+	thread_ = std::thread(&MetricsExporter::serve, this);
+	instance_ = this;
+}
+
+
+MetricsExporter::~MetricsExporter()
+{
+	uint64_t one = 1;
+	if (::write(stop_fd_, &one, sizeof(one)) < 0)
+		log(TF_ERR) << "Cannot stop metrics exporter: " << strerror(errno) << flush;
+	else
+		thread_.join();
+
+	::close(stop_fd_);
+	::close(listen_fd_);
+	if (!unix_path_.empty())
+		::unlink(unix_path_.c_str());
+	instance_ = nullptr;
+}
+
+
+MetricsExporter *MetricsExporter::instance()
+{ return instance_; }
+
+
+void MetricsExporter::set_config(const Config &config)
+{
+	vector<string> temp_labels, fan_labels, driver_labels;
+
+	unsigned int sensor_idx = 0;
+	for (const unique_ptr<SensorDriver> &sensor : config.sensors()) {
+		string driver = escape_label(sensor->name());
+		for (unsigned int i = 0; i < sensor->num_temps(); ++i)
+			temp_labels.push_back("sensor=\"" + driver + "\",index=\"" + std::to_string(temp_labels.size()) + "\"");
+		driver_labels.push_back("driver=\"" + driver + "\",index=\"sensor" + std::to_string(sensor_idx++) + "\"");
+	}
+
+	unsigned int fan_idx = 0;
+	for (const unique_ptr<FanConfig> &fan_cfg : config.fan_configs()) {
+		string driver = escape_label(fan_cfg->fan()->name());
+		fan_labels.push_back("fan=\"" + driver + "\",index=\"" + std::to_string(fan_idx) + "\"");
+		driver_labels.push_back("driver=\"" + driver + "\",index=\"fan" + std::to_string(fan_idx++) + "\"");
+	}
+
+	// Only becomes visible to the server thread with the first publish()
+	current_ = std::make_shared<Snapshot>(std::move(temp_labels), std::move(fan_labels), std::move(driver_labels));
+}
+
+
+void MetricsExporter::publish(const Config &config, const TemperatureState &ts)
+{
+	Snapshot &snap = *current_;
+	unsigned int seq = snap.seq.load(std::memory_order_relaxed);
+
+	// The back buffer may be the one a scrape started to copy before the previous publish().
+	// Order our writes after that publish so the scrape is guaranteed to notice and retry.
+	std::atomic_thread_fence(std::memory_order_release);
+	Snapshot::Buffer &buf = snap.buffers[(seq + 1) & 1];
+
+	size_t num_temps = std::min(ts.temps().size(), buf.temps.size());
+	for (size_t i = 0; i < num_temps; ++i) {
+		buf.temps[i].store(ts.temps()[i], std::memory_order_relaxed);
+		buf.biases[i].store(ts.biases()[i], std::memory_order_relaxed);
+	}
+
+	size_t drv = 0;
+	for (const unique_ptr<SensorDriver> &sensor : config.sensors())
+		buf.errors[drv++].store(sensor->total_errors(), std::memory_order_relaxed);
+
+	size_t fan = 0;
+	for (const unique_ptr<FanConfig> &fan_cfg : config.fan_configs()) {
+		buf.fan_levels[fan++].store(fan_cfg->fan()->current_speed_num(), std::memory_order_relaxed);
+		buf.errors[drv++].store(fan_cfg->fan()->total_errors(), std::memory_order_relaxed);
+	}
+
+	snap.seq.store(seq + 1, std::memory_order_release);
+
+	if (seq == 0)
+		std::atomic_store(&published_, current_);
+}
+
+
+string MetricsExporter::render()
+{
+	shared_ptr<Snapshot> snap = std::atomic_load(&published_);
+	if (!snap)
+		return "# EOF\n";
+
+	vector<int> temps(snap->temp_labels.size());
+	vector<float> biases(snap->temp_labels.size());
+	vector<int> fan_levels(snap->fan_labels.size());
+	vector<unsigned int> errors(snap->driver_labels.size());
+
+	unsigned int seq;
+	do {
+		seq = snap->seq.load(std::memory_order_acquire);
+		const Snapshot::Buffer &buf = snap->buffers[seq & 1];
+		for (size_t i = 0; i < temps.size(); ++i) {
+			temps[i] = buf.temps[i].load(std::memory_order_relaxed);
+			biases[i] = buf.biases[i].load(std::memory_order_relaxed);
+		}
+		for (size_t i = 0; i < fan_levels.size(); ++i)
+			fan_levels[i] = buf.fan_levels[i].load(std::memory_order_relaxed);
+		for (size_t i = 0; i < errors.size(); ++i)
+			errors[i] = buf.errors[i].load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while (snap->seq.load(std::memory_order_relaxed) != seq);
+
+	string rv;
+	char value[32];
+
+	rv += "# TYPE thinkfan_temperature_celsius gauge\n"
+		"# UNIT thinkfan_temperature_celsius celsius\n"
+		"# HELP thinkfan_temperature_celsius Sensor temperature after correction.\n";
+	for (size_t i = 0; i < temps.size(); ++i) {
+		std::snprintf(value, sizeof(value), "%d", temps[i]);
+		rv += "thinkfan_temperature_celsius{" + snap->temp_labels[i] + "} " + value + "\n";
+	}
+
+	rv += "# TYPE thinkfan_temperature_bias_celsius gauge\n"
+		"# UNIT thinkfan_temperature_bias_celsius celsius\n"
+		"# HELP thinkfan_temperature_bias_celsius Bias added to the temperature due to a recent rise.\n";
+	for (size_t i = 0; i < biases.size(); ++i) {
+		std::snprintf(value, sizeof(value), "%g", double(biases[i]));
+		rv += "thinkfan_temperature_bias_celsius{" + snap->temp_labels[i] + "} " + value + "\n";
+	}
+
+	rv += "# TYPE thinkfan_fan_level gauge\n"
+		"# HELP thinkfan_fan_level Fan level as last written, NaN if symbolic (e.g. level auto).\n";
+	for (size_t i = 0; i < fan_levels.size(); ++i) {
+		if (fan_levels[i] == INT_MIN)
+			std::strcpy(value, "NaN");
+		else
+			std::snprintf(value, sizeof(value), "%d", fan_levels[i]);
+		rv += "thinkfan_fan_level{" + snap->fan_labels[i] + "} " + value + "\n";
+	}
+
+	rv += "# TYPE thinkfan_driver_errors counter\n"
+		"# HELP thinkfan_driver_errors I/O errors encountered by a sensor or fan driver.\n";
+	for (size_t i = 0; i < errors.size(); ++i) {
+		std::snprintf(value, sizeof(value), "%u", errors[i]);
+		rv += "thinkfan_driver_errors_total{" + snap->driver_labels[i] + "} " + value + "\n";
+	}
+
+	rv += "# EOF\n";
+	return rv;
+}
+
+
+void MetricsExporter::serve()
+{
+	struct pollfd fds[2] = {
+		{ listen_fd_, POLLIN, 0 },
+		{ stop_fd_, POLLIN, 0 },
+	};
+
+	while (true) {
+		if (::poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		if (fds[1].revents)
+			return;
+		if (fds[0].revents & POLLIN) {
+			int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+			if (fd >= 0) {
+				handle_client(fd);
+				::close(fd);
+			}
+		}
+	}
+}
+
+
+void MetricsExporter::handle_client(int fd)
+{
+	// Don't let a stuck client hold up the next scrape for long
+	struct timeval timeout = { 1, 0 };
+	::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	// We only care about the request line, but read the whole header so the client
+	// doesn't see a connection reset.
+	char req[2048];
+	size_t len = 0;
+	while (len < sizeof(req) - 1) {
+		ssize_t n = ::recv(fd, req + len, sizeof(req) - 1 - len, 0);
+		if (n <= 0)
+			break;
+		len += size_t(n);
+		req[len] = 0;
+		if (std::strstr(req, "\r\n\r\n") || std::strstr(req, "\n\n"))
+			break;
+	}
+	req[len] = 0;
+
+	bool head = !std::strncmp(req, "HEAD ", 5);
+	string response;
+	if (!head && std::strncmp(req, "GET ", 4))
+		response = "HTTP/1.0 405 Method Not Allowed\r\nAllow: GET, HEAD\r\nContent-Length: 0\r\n"
+			"Connection: close\r\n\r\n";
+	else {
+		string body = render();
+		response = "HTTP/1.0 200 OK\r\n"
+			"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+			"Content-Length: " + std::to_string(body.length()) + "\r\n"
+			"Connection: close\r\n\r\n";
+		if (!head)
+			response += body;
+	}
+
+	size_t sent = 0;
+	while (sent < response.length()) {
+		ssize_t n = ::send(fd, response.data() + sent, response.length() - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+		sent += size_t(n);
+	}
+}
+
+
+} // namespace thinkfan
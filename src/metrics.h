@@ -0,0 +1,74 @@
+#pragma once
+
+/********************************************************************
+ * metrics.h: OpenMetrics exporter
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "thinkfan.h"
+#include "temperature_state.h"
+
+#include <thread>
+#include <memory>
+
+namespace thinkfan {
+
+
+/** @brief Serves the current temperatures, biases, fan levels and driver error counts in
+ *  OpenMetrics text format over HTTP on a UNIX or TCP socket.
+ *  The main loop @a publish()es into one of two buffers while a scrape reads the other,
+ *  so neither side ever waits for the other. Like the @a EventLoop, there is at most one
+ *  instance, which must be created after the @a EventLoop so its thread doesn't receive
+ *  any signals. The server thread must not log. */
+class MetricsExporter {
+public:
+	/// @param address Either an absolute path for a UNIX socket or HOST:PORT for TCP.
+	MetricsExporter(const string &address);
+	~MetricsExporter();
+	MetricsExporter(const MetricsExporter &) = delete;
+
+	/// @return The running exporter or nullptr if there is none.
+	static MetricsExporter *instance();
+
+	/// Set up the metric labels for @a config. Must be called before it starts running.
+	void set_config(const Config &config);
+
+	/// Copy the current values into the back buffer and make it visible. Doesn't allocate.
+	void publish(const Config &config, const TemperatureState &ts);
+
+private:
+	struct Snapshot;
+
+	void serve();
+	void handle_client(int fd);
+	string render();
+
+	static MetricsExporter *instance_;
+
+	string unix_path_;
+	int listen_fd_;
+	int stop_fd_;
+
+	shared_ptr<Snapshot> current_;    // Only used by the main thread
+	shared_ptr<Snapshot> published_;  // Use std::atomic_load/store only
+	std::thread thread_;
+};
+
+
+} // namespace thinkfan
@@ -0,0 +1,204 @@
+/********************************************************************
+ * nvml.cpp: Shared state for the dynamically loaded NVML library
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "nvml.h"
+
+#ifdef USE_NVML
+#include "error.h"
+#include "message.h"
+
+#include <dlfcn.h>
+#include <cstring>
+
+namespace thinkfan {
+
+std::weak_ptr<NvmlInterface> NvmlInterface::instance_;
+constexpr std::chrono::milliseconds NvmlInterface::max_age_;
+
+
+NvmlInterface::NvmlInterface()
+: dl_nvmlInit_v2(nullptr),
+  dl_nvmlDeviceGetHandleByPciBusId_v2(nullptr),
+  dl_nvmlDeviceGetName(nullptr),
+  dl_nvmlDeviceGetTemperature(nullptr),
+  dl_nvmlDeviceGetFieldValues(nullptr),
+  dl_nvmlShutdown(nullptr)
+{
+	if (!(so_handle_ = dlopen("libnvidia-ml.so.1", RTLD_LAZY))) {
+		string msg = strerror(errno);
+		throw SystemError("Failed to load libnvidia-ml.so.1: " + msg);
+	}
+
+	/* Apparently GCC doesn't want to cast to function pointers, so we have to do
+	 * this kind of weird stuff.
+	 * See http://stackoverflow.com/questions/1096341/function-pointers-casting-in-c
+	 */
+	*reinterpret_cast<void **>(&dl_nvmlInit_v2) = dlsym(so_handle_, "nvmlInit_v2");
+	*reinterpret_cast<void **>(&dl_nvmlDeviceGetHandleByPciBusId_v2) = dlsym(
+			so_handle_, "nvmlDeviceGetHandleByPciBusId_v2");
+	*reinterpret_cast<void **>(&dl_nvmlDeviceGetName) = dlsym(so_handle_, "nvmlDeviceGetName");
+	*reinterpret_cast<void **>(&dl_nvmlDeviceGetTemperature) = dlsym(so_handle_, "nvmlDeviceGetTemperature");
+	*reinterpret_cast<void **>(&dl_nvmlShutdown) = dlsym(so_handle_, "nvmlShutdown");
+
+	// Optional: Only needed for the memory temperature, and missing in old drivers
+	*reinterpret_cast<void **>(&dl_nvmlDeviceGetFieldValues) = dlsym(so_handle_, "nvmlDeviceGetFieldValues");
+
+	if (!(dl_nvmlDeviceGetHandleByPciBusId_v2 && dl_nvmlDeviceGetName &&
+			dl_nvmlDeviceGetTemperature && dl_nvmlInit_v2 && dl_nvmlShutdown)) {
+		dlclose(so_handle_);
+		throw SystemError("Incompatible NVML driver.");
+	}
+
+	nvmlReturn_t ret;
+	if ((ret = dl_nvmlInit_v2())) {
+		dlclose(so_handle_);
+		throw SystemError("Failed to initialize NVML driver. Error code (cf. nvml.h): " + std::to_string(ret));
+	}
+
+	log(TF_DBG) << "Initialized NVML." << flush;
+}
+
+
+NvmlInterface::~NvmlInterface()
+{
+	nvmlReturn_t ret;
+	if ((ret = dl_nvmlShutdown()))
+		log(TF_ERR) << "Failed to shutdown NVML driver. Error code (cf. nvml.h): " << std::to_string(ret) << flush;
+	dlclose(so_handle_);
+}
+
+
+shared_ptr<NvmlInterface> NvmlInterface::instance()
+{
+	shared_ptr<NvmlInterface> rv;
+	if (instance_.expired()) {
+		rv.reset(new NvmlInterface());
+		instance_ = rv;
+	}
+	else
+		rv = instance_.lock();
+
+	return rv;
+}
+
+
+size_t NvmlInterface::open_device(const string &bus_id, bool memory_temp)
+{
+	nvmlDevice_t handle;
+	nvmlReturn_t ret;
+	if ((ret = dl_nvmlDeviceGetHandleByPciBusId_v2(bus_id.c_str(), &handle)))
+		throw SystemError("Failed to open PCI device " + bus_id + ". Error code (cf. nvml.h): " + std::to_string(ret));
+
+	if (memory_temp && !dl_nvmlDeviceGetFieldValues)
+		throw SystemError("PCI device " + bus_id + ": This NVML version can't read the memory temperature.");
+
+	string name;
+	name.resize(256);
+	dl_nvmlDeviceGetName(handle, &*name.begin(), 255);
+	log(TF_DBG) << "Initialized NVML sensor on " << name.c_str() << " at PCI " << bus_id << "." << flush;
+
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	size_t idx;
+	for (idx = 0; idx < devices_.size(); ++idx)
+		if (devices_[idx].bus_id == bus_id)
+			break;
+
+	if (idx == devices_.size())
+		devices_.push_back({ bus_id, handle, 0, false, 0, NVML_SUCCESS, 0, NVML_SUCCESS });
+
+	Device &dev = devices_[idx];
+	dev.handle = handle;
+	dev.users++;
+	dev.memory_temp |= memory_temp;
+
+	// Make sure the next get_temps() doesn't return a value from the old handle
+	refreshed_ = {};
+
+	return idx;
+}
+
+
+void NvmlInterface::close_device(size_t device)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	if (devices_[device].users > 0)
+		devices_[device].users--;
+}
+
+
+void NvmlInterface::refresh()
+{
+	auto now = std::chrono::steady_clock::now();
+	if (now - refreshed_ < max_age_)
+		return;
+
+	for (Device &dev : devices_) {
+		if (!dev.users)
+			continue;
+
+		dev.err = dl_nvmlDeviceGetTemperature(dev.handle, NVML_TEMPERATURE_GPU, &dev.temp);
+
+		if (dev.memory_temp) {
+			FieldValue fv;
+			std::memset(&fv, 0, sizeof(fv));
+			fv.field_id = field_memory_temp_;
+			dev.mem_err = dl_nvmlDeviceGetFieldValues(dev.handle, 1, &fv);
+			if (!dev.mem_err)
+				dev.mem_err = fv.ret;
+			if (!dev.mem_err) {
+				switch (fv.value_type) {
+				case 0: dev.mem_temp = int(fv.value.d); break;
+				case 1: dev.mem_temp = int(fv.value.ui); break;
+				case 2: dev.mem_temp = int(fv.value.ul); break;
+				case 3: dev.mem_temp = int(fv.value.ull); break;
+				case 4: dev.mem_temp = int(fv.value.sll); break;
+				default: dev.mem_err = NVML_ERROR_UNKNOWN;
+				}
+			}
+		}
+	}
+
+	refreshed_ = now;
+}
+
+
+void NvmlInterface::get_temps(size_t device, bool memory_temp, vector<int> &temps)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	refresh();
+
+	const Device &dev = devices_[device];
+	if (dev.err)
+		throw SystemError(MSG_T_GET(dev.bus_id) + "Error code (cf. nvml.h): " + std::to_string(dev.err));
+	temps[0] = int(dev.temp);
+
+	if (memory_temp) {
+		if (dev.mem_err)
+			throw SystemError(MSG_T_GET(dev.bus_id) + "Memory temperature: Error code (cf. nvml.h): " + std::to_string(dev.mem_err));
+		temps[1] = dev.mem_temp;
+	}
+}
+
+
+} // namespace thinkfan
+
+#endif /* USE_NVML */
@@ -0,0 +1,117 @@
+/********************************************************************
+ * nvml.h: Shared state for the dynamically loaded NVML library
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#pragma once
+
+#include "thinkfan.h"
+
+#ifdef USE_NVML
+#include <nvidia/gdk/nvml.h>
+#include <mutex>
+
+namespace thinkfan {
+
+
+/** @brief One NVML session for all @a NvmlSensorDriver instances.
+ *  Loading libnvidia-ml.so and initializing it is slow, so it's done once and shared like
+ *  the @a LibsensorsInterface. The session lives as long as some driver holds a reference,
+ *  which includes a config reload since the new config is read before the old one is
+ *  dropped. */
+class NvmlInterface {
+public:
+	~NvmlInterface();
+	NvmlInterface(const NvmlInterface &) = delete;
+	NvmlInterface(NvmlInterface &&) = delete;
+
+	static shared_ptr<NvmlInterface> instance();
+
+	/** @brief (Re-)acquire the handle of the GPU at PCI address @a bus_id.
+	 *  @param memory_temp Also read the memory temperature of this GPU.
+	 *  @return An index to be used with @a get_temps() and @a close_device() */
+	size_t open_device(const string &bus_id, bool memory_temp);
+
+	void close_device(size_t device);
+
+	/** @brief Fill @a temps with the GPU temperature, followed by the memory temperature
+	 *  if @a memory_temp is set. The first call in a loop reads all open GPUs in one pass,
+	 *  so the others just pick up their values. Thread-safe. */
+	void get_temps(size_t device, bool memory_temp, vector<int> &temps);
+
+private:
+	struct Device {
+		string bus_id;
+		nvmlDevice_t handle;
+		unsigned int users;
+		bool memory_temp;
+		unsigned int temp;
+		nvmlReturn_t err;
+		int mem_temp;
+		nvmlReturn_t mem_err;
+	};
+
+	// nvmlFieldValue_t, which our copy of nvml.h predates. This layout hasn't changed since
+	// nvmlDeviceGetFieldValues() was introduced.
+	struct FieldValue {
+		unsigned int field_id;
+		unsigned int scope_id;
+		long long timestamp;
+		long long latency_usec;
+		int value_type;
+		nvmlReturn_t ret;
+		union {
+			double d;
+			unsigned int ui;
+			unsigned long ul;
+			unsigned long long ull;
+			long long sll;
+		} value;
+	};
+
+	static constexpr unsigned int field_memory_temp_ = 82; // NVML_FI_DEV_MEMORY_TEMP
+
+	NvmlInterface();
+
+	/// Read all GPUs unless that has just been done. Must be called with @a mutex_ held.
+	void refresh();
+
+	static constexpr std::chrono::milliseconds max_age_ { 50 };
+	static std::weak_ptr<NvmlInterface> instance_;
+
+	void *so_handle_;
+
+	// Pointers to dynamically loaded functions from libnvidia-ml.so
+	nvmlReturn_t (*dl_nvmlInit_v2)();
+	nvmlReturn_t (*dl_nvmlDeviceGetHandleByPciBusId_v2)(const char *, nvmlDevice_t *);
+	nvmlReturn_t (*dl_nvmlDeviceGetName)(nvmlDevice_t, char *, unsigned int);
+	nvmlReturn_t (*dl_nvmlDeviceGetTemperature)(nvmlDevice_t, nvmlTemperatureSensors_t, unsigned int *);
+	nvmlReturn_t (*dl_nvmlDeviceGetFieldValues)(nvmlDevice_t, int, FieldValue *);
+	nvmlReturn_t (*dl_nvmlShutdown)();
+
+	// Guards everything below, since get_temps() is called from the WorkerPool
+	std::mutex mutex_;
+	vector<Device> devices_;
+	std::chrono::steady_clock::time_point refreshed_;
+};
+
+
+} // namespace thinkfan
+
+#endif /* USE_NVML */
@@ -22,381 +22,341 @@
 #include "error.h"
 #include "parser.h"
 #include "config.h"
+#include "sensors.h"
+#include "fans.h"
 #include "message.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
 
 namespace thinkfan {
 
-using namespace std;
 
+static inline bool is_space(char c)
+{ return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v'; }
 
-const char *ErrorTracker::max_addr_ = nullptr;
+static inline bool is_blank(char c)
+{ return c == ' ' || c == '\t'; }
 
-static RegexParser separator_parser("^([[:space:]]*,)|^([[:space:]]+)", 0);
-static CommentParser comment_parser;
-static RegexParser space_parser("^[[:space:]]+", 0, true);
-static RegexParser blank_parser("^[[:blank:]]+", 0, false);
+static inline bool is_word(char c)
+{ return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'; }
 
 
-RegexParser::RegexParser(const string expr, const unsigned int data_idx, bool match_nl)
-: data_idx_(data_idx),
-  re_str(expr)
+/// @return The bracket that closes @a c, or 0 if @a c doesn't open a tuple.
+static inline char closing_bracket(char c)
 {
-	this->expr_ = new regex_t;
-	if (regcomp(this->expr_, re_str.c_str(), REG_EXTENDED | (match_nl ? 0 : REG_NEWLINE))) {
-		throw Bug("RegexParser: Invalid regular expression");
+	switch (c) {
+	case '(':
+		return ')';
+	case '{':
+		return '}';
+	default:
+		return 0;
 	}
 }
 
 
-RegexParser::~RegexParser()
+/// Skip whitespace (including newlines) and comments.
+static void skip_space(const char *&p)
 {
-	regfree(expr_);
-	delete expr_;
+	while (true) {
+		while (is_space(*p))
+			++p;
+		if (*p != '#')
+			return;
+		while (*p && *p != '\n')
+			++p;
+	}
 }
 
 
-string *RegexParser::_parse(const char *&input)
+/// Skip whitespace and comments with at most one comma in between.
+/// @return Whether anything was skipped.
+static bool skip_separator(const char *&p)
 {
-	regmatch_t matches[data_idx_ + 1];
-	string *rv = nullptr;
-
-	int err;
-	if (!(err = regexec(this->expr_, input, this->data_idx_ + 1, matches, 0))) {
-		int so = matches[data_idx_].rm_so;
-		int eo = matches[data_idx_].rm_eo;
-		if (so != -1 && matches[0].rm_so == 0) {
-			rv = new string(input, so, eo - so);
-			input += matches->rm_eo;
-		}
-	}
-	else if (err == REG_ESPACE) {
-		delete rv;
-		throw ParserOOM();
+	const char *start = p;
+	skip_space(p);
+	if (*p == ',') {
+		++p;
+		skip_space(p);
 	}
-	return rv;
+	return p != start;
 }
 
 
-int *IntParser::_parse(const char *&input)
+static bool parse_int(const char *&p, int &value)
 {
+	// Like the old parser, accept anything strtol() accepts, e.g. hex or octal.
 	char *end;
-	long l = strtol(input, &end, 0);
-	if (end == input || l < numeric_limits<int>::min() || l > numeric_limits<int>::max())
-		return nullptr;
-
-	input = end;
-	return new int(static_cast<int>(l));
+	long l = std::strtol(p, &end, 0);
+	if (end == p || l < INT_MIN || l > INT_MAX)
+		return false;
+	p = end;
+	value = static_cast<int>(l);
+	return true;
 }
 
 
-CommentParser::CommentParser()
-: comment_parser_("^[[:space:]]*#(.*)$", 1)
-{}
-
-
-string *CommentParser::_parse(const char *&input)
+/// A list of integers separated by whitespace and/or commas. If @a allow_dot, a single dot
+/// means "no limit", i.e. INT_MAX.
+static bool parse_int_list(const char *&p, vector<int> &rv, bool allow_dot)
 {
-	space_parser.match(input);
-	string *rv = nullptr;
-	string *tmp;
-	while ((tmp = comment_parser_.parse(input))) {
-		if (!rv)
-			rv = tmp;
-		else {
-			*rv += *tmp;
-			delete tmp;
+	rv.clear();
+	while (true) {
+		int i;
+		skip_space(p);
+		if (parse_int(p, i))
+			rv.push_back(i);
+		else if (allow_dot && *p == '.') {
+			++p;
+			rv.push_back(numeric_limits<int>::max());
 		}
-		space_parser.match(input);
+		else
+			break;
+
+		if (!skip_separator(p))
+			break;
 	}
-	return rv;
+	return !rv.empty();
 }
 
 
-KeywordParser::KeywordParser(const string keyword)
-: RegexParser("^[[:space:]]*" + keyword + "[[:space:]]+([^[:space:]]+|\"[^\"]+\")", 1)
-{}
-
-
-FanDriver *FanParser::_parse(const char *&input)
+/// A bracketed integer list. The opening bracket must be on the current line.
+static bool parse_tuple(const char *&p, vector<int> &rv, bool allow_dot)
 {
-	FanDriver *fan = nullptr;
-	unique_ptr<string> path;
-
-	if ((path = unique_ptr<string>(KeywordParser("fan").parse(input))))
-		throw ConfigError(MSG_CONF_FAN_DEPRECATED);
-	else if ((path = unique_ptr<string>(KeywordParser("tp_fan").parse(input))))
-		fan = new TpFanDriver(*path);
-	else if ((path = unique_ptr<string>(KeywordParser("pwm_fan").parse(input))))
-		fan = new HwmonFanDriver(*path);
-
-	return fan;
+	while (is_blank(*p))
+		++p;
+	char close = closing_bracket(*p);
+	if (!close)
+		return false;
+	++p;
+
+	if (!parse_int_list(p, rv, allow_dot))
+		return false;
+	skip_space(p);
+	if (*p != close)
+		return false;
+	++p;
+	return true;
 }
 
 
-SensorDriver *SensorParser::_parse(const char *&input)
+/// A path: Either "anything in quotes" or anything up to the next whitespace,
+/// whichever is longer. Quotes are kept as part of the path.
+static bool parse_path(const char *&p, string &rv)
 {
-	SensorDriver *sensor = nullptr;
-	unique_ptr<string> path;
-
-	if ((path = unique_ptr<string>(KeywordParser("sensor").parse(input))))
-		throw ConfigError(MSG_CONF_SENSOR_DEPRECATED);
-	else if ((path = unique_ptr<string>(KeywordParser("tp_thermal").parse(input))))
-		sensor = new TpSensorDriver(*path, false);
-	else if ((path = unique_ptr<string>(KeywordParser("hwmon").parse(input))))
-		sensor = new HwmonSensorDriver(*path, false);
-	else if ((path = unique_ptr<string>(KeywordParser("atasmart").parse(input)))) {
-#ifdef USE_ATASMART
-		sensor = new AtasmartSensorDriver(*path, false);
-#else
-		error<SystemError>(MSG_CONF_ATASMART_UNSUPP);
-#endif /* USE_ATASMART */
-	}
-	else if ((path = unique_ptr<string>(KeywordParser("nv_thermal").parse(input)))) {
-#ifdef USE_NVML
-		sensor = new NvmlSensorDriver(*path, false);
-#else
-		error<SystemError>(MSG_CONF_NVML_UNSUPP);
-#endif /* USE_NVML */
+	const char *start = p;
+	const char *end = p;
+	while (*end && !is_space(*end))
+		++end;
+
+	if (*start == '"') {
+		const char *q = start + 1;
+		while (*q && *q != '"' && *q != '\n')
+			++q;
+		if (*q == '"' && q > start + 1 && q + 1 > end)
+			end = q + 1;
 	}
 
-	if (sensor) {
-		blank_parser.match(input);
-		unique_ptr<vector<int>> correction(TupleParser().parse(input));
-		if (correction)
-			sensor->set_correction(*correction);
-	}
+	if (end == start)
+		return false;
 
-	return sensor;
+	rv.assign(start, end);
+	p = end;
+	return true;
 }
 
 
-IntListParser::IntListParser(bool allow_dot)
-: dot_parser_("^\\."),
-  allow_dot_(allow_dot)
-{}
+/// @return A pointer to after @a keyword and the whitespace that must follow it, or nullptr.
+static const char *match_keyword(const char *word, const char *word_end, const char *keyword)
+{
+	size_t len = size_t(word_end - word);
+	if (len != std::strlen(keyword) || std::strncmp(word, keyword, len) || !is_space(*word_end))
+		return nullptr;
 
+	const char *p = word_end;
+	while (is_space(*p))
+		++p;
+	return p;
+}
 
-vector<int> *IntListParser::_parse(const char *&input)
-{
-	unique_ptr<vector<int>> rv(new vector<int>());
-	unique_ptr<string> dot;
-	unique_ptr<int> i;
 
-	do {
-		dot.reset(nullptr);
 
-		if ( (void)i.reset(int_parser_.parse(input)), i)
-			rv->push_back(*i);
-		else if (allow_dot_ && ( (void)dot.reset(dot_parser_.parse(input)), dot))
-			rv->push_back(numeric_limits<int>::max());
-		else
-			break;
-		if (!(separator_parser.match(input) || comment_parser.match(input)))
-			break;
+ConfigParser::ConfigParser()
+: max_addr_(nullptr)
+{}
 
-		comment_parser.match(input);
-	} while(i || dot);
 
-	if (rv->size() > 0)
-		return rv.release();
-	return nullptr;
-}
+const char *ConfigParser::get_max_addr() const
+{ return max_addr_; }
 
 
-EnclosureParser::EnclosureParser(initializer_list<string> bracket_pairs, bool nl)
-: brackets_(bracket_pairs),
-  nl_(nl)
+bool ConfigParser::fail(const char *p)
 {
-	if (bracket_pairs.size() < 2 || bracket_pairs.size() % 2 != 0)
-		throw Bug("EnclosureParser: Unbalanced bracket definition");
+	max_addr_ = std::max(max_addr_, p);
+	return false;
 }
 
 
-string *EnclosureParser::_parse(const char *&input)
+bool ConfigParser::parse_statement(const char *&p, Config &config, StepwiseMapping &fan_cfg)
 {
-	blank_parser.match(input);
-	vector<string>::const_iterator it = brackets_.begin();
-	unique_ptr<string> rv;
-	do {
-		string re_pfx("^");
-		if (*it == "(" || *it == "{")
-			re_pfx += "\\";
-		RegexParser re_o(re_pfx + *it++);
-		rv.reset(re_o.parse(input));
-		if (rv) {
-			closing_ = re_pfx + *it;
-			content_ = "^[^" + *it + "]*";
+	const char *word_end = p;
+	while (is_word(*word_end))
+		++word_end;
+
+	static const char *const keywords[] = {
+		"fan", "tp_fan", "pwm_fan",
+		"sensor", "tp_thermal", "hwmon", "atasmart", "nv_thermal"
+	};
+
+	const char *kw = nullptr;
+	const char *value = nullptr;
+	for (const char *keyword : keywords) {
+		if ((value = match_keyword(p, word_end, keyword))) {
+			kw = keyword;
+			break;
 		}
-		++it;
-	} while (!rv && it != brackets_.end());
-
-	return rv.release();
-}
-
-
-bool EnclosureParser::open(const char *&input)
-{ return match(input); }
-
-
-bool EnclosureParser::close(const char *&input)
-{ return RegexParser(closing_).match(input); }
-
-
-string *EnclosureParser::content(const char *&input)
-{ return RegexParser(content_, 0, nl_).parse(input); }
-
+	}
 
-BracketParser::BracketParser()
-: EnclosureParser({"(", ")", "{", "}"})
-{}
+	string path;
+	if (!kw || !parse_path(value, path))
+		return fail(value ? value : p);
 
+	if (!std::strcmp(kw, "fan"))
+		throw ConfigError(MSG_CONF_FAN_DEPRECATED);
+	else if (!std::strcmp(kw, "tp_fan"))
+		fan_cfg.set_fan(unique_ptr<FanDriver>(new TpFanDriver(path)));
+	else if (!std::strcmp(kw, "pwm_fan"))
+		fan_cfg.set_fan(unique_ptr<FanDriver>(new HwmonFanDriver(path)));
+	else {
+		unique_ptr<SensorDriver> sensor;
+		if (!std::strcmp(kw, "sensor"))
+			throw ConfigError(MSG_CONF_SENSOR_DEPRECATED);
+		else if (!std::strcmp(kw, "tp_thermal"))
+			sensor.reset(new TpSensorDriver(path, false));
+		else if (!std::strcmp(kw, "hwmon"))
+			sensor.reset(new HwmonSensorDriver(path, false));
+		else if (!std::strcmp(kw, "atasmart")) {
+#ifdef USE_ATASMART
+			sensor.reset(new AtasmartSensorDriver(path, false));
+#else
+			error<SystemError>(MSG_CONF_ATASMART_UNSUPP);
+#endif /* USE_ATASMART */
+		}
+		else if (!std::strcmp(kw, "nv_thermal")) {
+#ifdef USE_NVML
+			sensor.reset(new NvmlSensorDriver(path, false));
+#else
+			error<SystemError>(MSG_CONF_NVML_UNSUPP);
+#endif /* USE_NVML */
+		}
 
-vector<int> *TupleParser::_parse(const char *&input)
-{
-	if (!bracket_parser_.open(input))
-		return nullptr;
+		if (sensor) {
+			// A correction has to be on the same line. Anything else that doesn't parse as one
+			// is left for the next statement (e.g. a fan level).
+			const char *q = value;
+			vector<int> correction;
+			if (parse_tuple(q, correction, false)) {
+				sensor->set_correction(correction);
+				value = q;
+			}
+			config.add_sensor(std::move(sensor));
+		}
+	}
 
-	unique_ptr<vector<int>> rv(int_list_parser_.parse(input));
-	if (bracket_parser_.close(input))
-		return rv.release();
-	else
-		return nullptr;
+	p = value;
+	return true;
 }
 
 
-SimpleLevel *SimpleLevelParser::_parse(const char *&input)
+bool ConfigParser::parse_level(const char *&p, StepwiseMapping &fan_cfg)
 {
-	if (!bracket_parser_.open(input))
-		return nullptr;
-
-	unique_ptr<vector<int>> ints;
-
-	comment_parser.match(input);
-
-	EnclosureParser quot({"\"", "\""});
-	if (quot.open(input)) {
-		unique_ptr<string> lvl_str(quot.content(input));
-		if (quot.close(input) && lvl_str &&
-				(comment_parser.match(input)
-						|| separator_parser.match(input))
-		) {
-			comment_parser.match(input);
-			ints.reset(IntListParser().parse(input));
-			if (ints && ints->size() == 2 && bracket_parser_.close(input))
-				return new SimpleLevel(*lvl_str, (*ints)[0], (*ints)[1]);
-		}
+	const char close = closing_bracket(*p++);
+
+	skip_space(p);
+
+	opt<string> lvl_str;
+	int lvl_int = 0;
+	if (*p == '"') {
+		const char *start = ++p;
+		while (*p && *p != '"')
+			++p;
+		if (!*p)
+			return fail(start - 1);
+		lvl_str.emplace(start, p++);
+	}
+	else if (!parse_int(p, lvl_int))
+		return fail(p);
+
+	// The level must be followed by a separator unless the limits are tuples.
+	bool separated = skip_separator(p);
+
+	if (closing_bracket(*p)) {
+		// Complex level: (LEVEL (LOWER...) (UPPER...))
+		vector<int> lower, upper;
+		if (!parse_tuple(p, lower, true))
+			return fail(p);
+		skip_separator(p);
+		if (!parse_tuple(p, upper, true))
+			return fail(p);
+		skip_space(p);
+		if (*p != close)
+			return fail(p);
+		++p;
+
+		if (lvl_str)
+			fan_cfg.add_level(unique_ptr<Level>(new ComplexLevel(*lvl_str, lower, upper)));
+		else
+			fan_cfg.add_level(unique_ptr<Level>(new ComplexLevel(lvl_int, lower, upper)));
 	}
 	else {
-		ints.reset(IntListParser().parse(input));
-		if (ints && ints->size() == 3 && bracket_parser_.close(input))
-			return new SimpleLevel((*ints)[0], (*ints)[1], (*ints)[2]);
+		// Simple level: (LEVEL, LOWER, UPPER)
+		vector<int> limits;
+		if (!separated || !parse_int_list(p, limits, false) || limits.size() != 2)
+			return fail(p);
+		skip_space(p);
+		if (*p != close)
+			return fail(p);
+		++p;
+
+		if (lvl_str)
+			fan_cfg.add_level(unique_ptr<Level>(new SimpleLevel(*lvl_str, limits[0], limits[1])));
+		else
+			fan_cfg.add_level(unique_ptr<Level>(new SimpleLevel(lvl_int, limits[0], limits[1])));
 	}
 
-	return nullptr;
+	return true;
 }
 
 
-ComplexLevel *ComplexLevelParser::_parse(const char *&input)
+Config *ConfigParser::parse_config(const char *&input)
 {
-	unique_ptr<string> lvl_str;
-	unique_ptr<vector<int>> lower_lim, upper_lim;
-	unique_ptr<int> lvl_int;
-
-	if (!bracket_parser_.open(input))
-		return nullptr;
-
-	comment_parser.match(input);
-	space_parser.match(input);
-
-	EnclosureParser quot({"\"", "\""});
-	if (quot.open(input)) {
-		lvl_str.reset(quot.content(input));
-		if (!quot.close(input))
-			return nullptr;
-	}
-	else if (!(lvl_int = unique_ptr<int>(IntParser().parse(input))))
-		return nullptr;
-
-	TupleParser tp(true);
-	RegexParser sep_parser("^[[:space:]]+|^[[:space:]]*,?[[:space:]]*", 0, true);
-
-	comment_parser.match(input);
-	sep_parser.match(input);
-	comment_parser.match(input);
-
-	lower_lim = unique_ptr<vector<int>>(tp.parse(input));
-	comment_parser.match(input);
-	sep_parser.match(input);
-	comment_parser.match(input);
-
-	upper_lim = unique_ptr<vector<int>>(tp.parse(input));
-	space_parser.match(input);
-	comment_parser.match(input);
-
-	if (!(lower_lim && upper_lim))
-		return nullptr;
-
-	if (!bracket_parser_.close(input))
-		return nullptr;
-
-	if (lvl_str)
-		return new ComplexLevel(*lvl_str, *lower_lim, *upper_lim);
-	else if (lvl_int)
-		return new ComplexLevel(*lvl_int, *lower_lim, *upper_lim);
-	else
-		return nullptr;
-}
-
+	max_addr_ = input;
+	const char *p = input;
 
-ConfigParser::ConfigParser()
-: parser_fan(),
-  parser_sensor()
-{}
-
-
-Config *ConfigParser::_parse(const char *&input)
-{
 	// Use smart pointers here since we may cause an exception (rv->add_*()...)
 	unique_ptr<Config> rv(new Config());
 	unique_ptr<StepwiseMapping> fan_cfg(new StepwiseMapping());
 
-	bool some_match = false;
-	do {
-		some_match = comment_parser.match(input)
-		             || space_parser.match(input);
-		unique_ptr<FanDriver> fan { parser_fan.parse(input) };
-		if (fan) {
-			fan_cfg->set_fan(std::move(fan));
-			some_match = true;
-		}
-		unique_ptr<SensorDriver> sensor { parser_sensor.parse(input) };
-		if (sensor) {
-			rv->add_sensor(std::move(sensor));
-			some_match = true;
-		}
-		unique_ptr<SimpleLevel> simple_lvl { parser_simple_lvl.parse(input) };
-		if (simple_lvl) {
-			fan_cfg->add_level(std::move(simple_lvl));
-			some_match = true;
-		}
-		unique_ptr<ComplexLevel> complex_lvl { parser_complex_lvl.parse(input) };
-		if (complex_lvl) {
-			fan_cfg->add_level(std::move(complex_lvl));
-			some_match = true;
-		}
-	} while(*input != 0 && some_match);
-
-	rv->add_fan_config(std::move(fan_cfg));
+	while (true) {
+		skip_space(p);
+		if (!*p)
+			break;
 
-	if (*input != 0 && !some_match) return nullptr;
+		bool ok = closing_bracket(*p) ?
+			parse_level(p, *fan_cfg)
+			: parse_statement(p, *rv, *fan_cfg);
+		if (!ok)
+			return nullptr;
+	}
 
+	rv->add_fan_config(std::move(fan_cfg));
+	input = p;
 	return rv.release();
 }
 
-}
-
-
-
-
 
+} /* namespace thinkfan */
@@ -22,192 +22,41 @@
 #ifndef THINKFAN_PARSER_H_
 #define THINKFAN_PARSER_H_
 
-#include <regex.h>
-#include <vector>
-#include <string>
-#include <initializer_list>
-
-#include "sensors.h"
-#include "fans.h"
+#include "thinkfan.h"
 
 namespace thinkfan {
 
-class SimpleLevel;
-class ComplexLevel;
 class Config;
-static const string tpacpi_path = "/proc/acpi/ibm";
-
-class ErrorTracker {
-protected:
-	static const char *max_addr_;
-};
-
-template<typename ResultT>
-class Parser : ErrorTracker {
-public:
-	Parser() {}
-
-	virtual ~Parser() = default;
-
-	const char *get_max_addr() const
-	{ return max_addr_; }
-
-	ResultT *parse(const char *&input) {
-		const char *start = input;
-		ResultT *rv = _parse(input);
-		if (input > max_addr_) max_addr_ = input;
-		if (!rv) input = start;
-		return rv;
-	}
-
-	bool match(const char *&input) {
-		ResultT *result = parse(input);
-		if (result) {
-			delete result;
-			return true;
-		}
-		return false;
-	}
-
-protected:
-	virtual ResultT *_parse(const char *&input) = 0;
-};
-
-
-class RegexParser : public Parser<string> {
-private:
-	regex_t *expr_;
-	unsigned int data_idx_;
-	string re_str;
-public:
-	RegexParser(const string expr, const unsigned int data_idx = 0, bool match_nl = false);
-	virtual ~RegexParser();
-	virtual string *_parse(const char *&input) override;
-};
-
-
-class IntParser : public Parser<int> {
-public:
-	virtual int *_parse(const char *&input) override;
-};
-
-
-class CommentParser : public Parser<string> {
-private:
-	RegexParser comment_parser_;
-public:
-	CommentParser();
-	virtual string *_parse(const char *&input) override;
-};
-
-
-class KeywordParser : public RegexParser {
-public:
-	KeywordParser(const std::string keyword);
-};
-
-
-class FanParser : public Parser<FanDriver> {
-public:
-	virtual FanDriver *_parse(const char *&input) override;
-};
-
-
-class IntListParser : public Parser<vector<int>> {
-private:
-	IntParser int_parser_;
-	RegexParser dot_parser_;
-	bool allow_dot_;
-public:
-	IntListParser(bool allow_dot = false);
-	virtual vector<int> *_parse(const char *&input) override;
-};
+class StepwiseMapping;
 
 
-class EnclosureParser : public Parser<string> {
+/** @brief Parser for the legacy config format, cf. thinkfan.conf.legacy(5).
+ *  The NUL-terminated input is scanned once from left to right. What comes next is always
+ *  decided by the next character or keyword, so nothing has to be re-parsed, and nothing
+ *  is copied except the resulting paths and level strings. The only lookahead that may be
+ *  dropped is the optional correction tuple after a sensor path. */
+class ConfigParser {
 public:
-	EnclosureParser(std::initializer_list<string> bracket_pairs, bool nl = true);
-	virtual string *_parse(const char *&input) override;
-
-	bool open(const char *&input);
-	bool close(const char *&input);
-	string *content(const char *&input);
-private:
-	string closing_;
-	string content_;
-	vector<string> brackets_;
-	bool nl_;
-};
-
-
-class BracketParser : public EnclosureParser {
-public:
-	BracketParser();
-};
-
-
-class SensorParser : public Parser<SensorDriver> {
-public:
-	virtual SensorDriver *_parse(const char *&input) override;
-private:
-	BracketParser bracket_parser_;
-};
-
-
-class TupleParser : public Parser<vector<int>> {
-public:
-	TupleParser(bool allow_dot = false) : int_list_parser_(allow_dot) {}
-	virtual vector<int> *_parse(const char *&input) override;
-private:
-	BracketParser bracket_parser_;
-	IntListParser int_list_parser_;
-};
-
-
-class SimpleLevelParser : public Parser<SimpleLevel> {
-public:
-	SimpleLevelParser() {}
-	virtual SimpleLevel *_parse(const char *&input) override;
-private:
-	BracketParser bracket_parser_;
-};
+	ConfigParser();
 
+	/** @return A new config, or nullptr on a syntax error. In that case @a input is left
+	 *  unchanged and @a get_max_addr() points to where parsing failed. */
+	Config *parse_config(const char *&input);
 
-class ComplexLevelParser : public Parser<ComplexLevel> {
-public:
-	ComplexLevelParser() {}
-	virtual ComplexLevel *_parse(const char *&input) override;
-private:
-	BracketParser bracket_parser_;
-};
+	const char *get_max_addr() const;
 
-
-class ConfigParser : public Parser<Config> {
 private:
-	FanParser parser_fan;
-	SensorParser parser_sensor;
-	SimpleLevelParser parser_simple_lvl;
-	ComplexLevelParser parser_complex_lvl;
-public:
-	ConfigParser();
+	bool parse_statement(const char *&p, Config &config, StepwiseMapping &fan_cfg);
+	bool parse_level(const char *&p, StepwiseMapping &fan_cfg);
 
-	Config *parse_config(const char *&input)
-	{ return parse(input); }
+	/// Remember @a p as the error position. @return false
+	bool fail(const char *p);
 
-protected:
-	virtual Config *_parse(const char *&input) override;
+	const char *max_addr_;
 };
 
 
 } /* namespace thinkfan */
 
 
-
-
-
-
 #endif /* THINKFAN_PARSER_H_ */
-
-
-
-
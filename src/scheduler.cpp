@@ -0,0 +1,149 @@
+/********************************************************************
+ * scheduler.cpp: Decides which sensors need to be read when
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "scheduler.h"
+#include "config.h"
+#include "sensors.h"
+
+#include <algorithm>
+
+namespace thinkfan {
+
+
+SensorScheduler::SensorScheduler(const Config &config, TemperatureState &tstate)
+: last_temps_(tstate.biased_temps())
+, changed_(config.sensors().size(), false)
+, last_sleeptime_(tmp_sleeptime)
+, tstate_(tstate)
+{
+	clock::time_point now = clock::now();
+	heap_.reserve(config.sensors().size());
+	due_.reserve(config.sensors().size());
+	unsigned int offset = 0;
+	for (unsigned int i = 0; i < config.sensors().size(); ++i) {
+		SensorDriver *sensor = config.sensors()[i].get();
+		heap_.push_back({
+			now + interval(*sensor), now, sensor, dynamic_cast<HwmonSensorDriver *>(sensor), i, offset
+		});
+		offset += sensor->num_temps();
+	}
+	std::make_heap(heap_.begin(), heap_.end(), later);
+}
+
+
+void SensorScheduler::expedite_all()
+{
+	// All due dates are equal, so this is still a heap
+	for (Entry &e : heap_)
+		e.due = clock::time_point();
+}
+
+
+bool SensorScheduler::later(const Entry &a, const Entry &b)
+{ return a.due > b.due; }
+
+
+milliseconds SensorScheduler::interval(const SensorDriver &sensor)
+{
+	if (sensor.interval())
+		return *sensor.interval();
+	if (sensor.predictive())
+		return sensor.predicted_interval();
+	return tmp_sleeptime;
+}
+
+
+SensorScheduler::clock::time_point SensorScheduler::next_due() const
+{ return heap_.front().due; }
+
+
+void SensorScheduler::expedite(const SensorDriver *sensor)
+{
+	for (Entry &e : heap_)
+		if (e.sensor == sensor)
+			e.due = clock::time_point();
+	std::make_heap(heap_.begin(), heap_.end(), later);
+}
+
+
+bool SensorScheduler::poll(clock::time_point now)
+{
+	for (const Entry &e : due_)
+		changed_[e.index] = false;
+	due_.clear();
+	const clock::time_point due_until = now + std::min(slack_, tmp_sleeptime / 4);
+	while (!heap_.empty() && heap_.front().due <= due_until) {
+		std::pop_heap(heap_.begin(), heap_.end(), later);
+		due_.push_back(heap_.back());
+		heap_.pop_back();
+	}
+
+	// Get the slow ones going first so they can do their thing while we read the rest
+	for (Entry &e : due_)
+		e.sensor->prefetch_temps();
+
+	bool changed = false;
+	for (Entry &e : due_) {
+		if (likely(e.hwmon != nullptr))
+			e.hwmon->read_temps_fast();
+		else
+			e.sensor->read_temps();
+		e.last_read = now;
+
+		// Only the sensors we've just read can have changed
+		auto first = tstate_.biased_temps().begin() + e.offset;
+		auto last = first + e.sensor->num_temps();
+		auto last_first = last_temps_.begin() + e.offset;
+		if (!std::equal(first, last, last_first)) {
+			std::copy(first, last, last_first);
+			changed_[e.index] = true;
+			changed = true;
+		}
+	}
+
+	for (Entry &e : due_) {
+		e.due = now + interval(*e.sensor);
+		heap_.push_back(e);
+		std::push_heap(heap_.begin(), heap_.end(), later);
+	}
+
+	if (unlikely(tmp_sleeptime < last_sleeptime_)) {
+		// Temperatures are rising quickly, so bring forward the sensors that follow tmp_sleeptime
+		for (Entry &e : heap_)
+			if (!e.sensor->interval() && !e.sensor->predictive())
+				e.due = std::min(e.due, e.last_read + tmp_sleeptime);
+		std::make_heap(heap_.begin(), heap_.end(), later);
+	}
+	last_sleeptime_ = tmp_sleeptime;
+
+	if (!changed)
+		return false;
+
+	tstate_.update_tmax();
+	return true;
+}
+
+
+const vector<bool> &SensorScheduler::changed_sensors() const
+{ return changed_; }
+
+
+} // namespace thinkfan
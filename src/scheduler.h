@@ -0,0 +1,83 @@
+#pragma once
+
+/********************************************************************
+ * scheduler.h: Decides which sensors need to be read when
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "thinkfan.h"
+#include "temperature_state.h"
+
+namespace thinkfan {
+
+
+/** @brief Keeps track of when each sensor is due for its next read.
+ *  Sensors that have an explicit @a SensorDriver::interval() are read at that interval,
+ *  all others follow the (adaptive) @a tmp_sleeptime. The sensors are kept in a min-heap
+ *  ordered by their due time, so each loop only touches the sensors that actually need
+ *  to be read. */
+class SensorScheduler {
+public:
+	using clock = std::chrono::steady_clock;
+
+	SensorScheduler(const Config &config, TemperatureState &tstate);
+
+	/** @brief Read all sensors that are due at @a now and update @a TemperatureState::tmax.
+	 *  @return true if any (biased) temperature has changed since the last call. */
+	bool poll(clock::time_point now);
+
+	/// Make @a sensor due immediately, e.g. because one of its alarms has fired.
+	void expedite(const SensorDriver *sensor);
+
+	/// Make all sensors due immediately, e.g. after a resume from suspend.
+	void expedite_all();
+
+	/// The time at which the next sensor becomes due.
+	clock::time_point next_due() const;
+
+	/// Which sensors (indexed like @a Config::sensors()) have changed in the last @a poll().
+	const vector<bool> &changed_sensors() const;
+
+private:
+	struct Entry {
+		clock::time_point due;
+		clock::time_point last_read;
+		SensorDriver *sensor;
+		HwmonSensorDriver *hwmon; ///< Same as @a sensor if it is one, so poll() can take the fast path
+		unsigned int index;
+		unsigned int offset; ///< Of the sensor's first temperature in the TemperatureState
+	};
+
+	/** Sensors that are due within this time are read together to save wakeups. Limited
+	 *  to a fraction of @a tmp_sleeptime so short cycles don't read everything every time. */
+	static constexpr milliseconds slack_ { 200 };
+
+	static bool later(const Entry &a, const Entry &b);
+	static milliseconds interval(const SensorDriver &sensor);
+
+	vector<Entry> heap_;
+	vector<Entry> due_;
+	vector<int> last_temps_;
+	vector<bool> changed_;
+	milliseconds last_sleeptime_;
+	TemperatureState &tstate_;
+};
+
+
+} // namespace thinkfan
@@ -0,0 +1,1070 @@
+/********************************************************************
+ * self_check.cpp: Checks run by thinkfan-bench -S
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "self_check.h"
+#include "config.h"
+#include "sensors.h"
+#include "fans.h"
+#include "message.h"
+#include "error.h"
+#include "scheduler.h"
+#include "temperature_state.h"
+#include "parser.h"
+#include "metrics.h"
+#include "config_cache.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <random>
+#include <thread>
+
+
+/*----------------------------------------------------------------------------
+| Counting allocator: Replaces the global operator new for all of            |
+| thinkfan-bench, but only counts while an AllocationCounter is alive.       |
+----------------------------------------------------------------------------*/
+
+static std::atomic<bool> count_allocations(false);
+static std::atomic<unsigned long> allocations(0);
+
+void *operator new(size_t size)
+{
+	if (count_allocations.load(std::memory_order_relaxed))
+		allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void *p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{ return ::operator new(size); }
+
+void operator delete(void *p) noexcept
+{ std::free(p); }
+
+void operator delete[](void *p) noexcept
+{ std::free(p); }
+
+void operator delete(void *p, size_t) noexcept
+{ std::free(p); }
+
+void operator delete[](void *p, size_t) noexcept
+{ std::free(p); }
+
+
+namespace thinkfan {
+namespace self_check {
+
+
+class AllocationCounter {
+public:
+	AllocationCounter()
+	: start_(allocations.load())
+	{ count_allocations = true; }
+
+	~AllocationCounter()
+	{ count_allocations = false; }
+
+	unsigned long count() const
+	{ return allocations.load() - start_; }
+
+private:
+	const unsigned long start_;
+};
+
+
+/// A directory under $TMPDIR with some files in it, all of which are removed again.
+class TempDir {
+public:
+	TempDir()
+	{
+		const char *tmp = std::getenv("TMPDIR");
+		string tmpl = string(tmp && *tmp ? tmp : "/tmp") + "/thinkfan-check.XXXXXX";
+		if (!::mkdtemp(&tmpl[0]))
+			throw IOerror(tmpl + ": ", errno);
+		path_ = tmpl;
+	}
+
+	~TempDir()
+	{
+		for (auto it = files_.rbegin(); it != files_.rend(); ++it)
+			::unlink(it->c_str());
+		::rmdir(path_.c_str());
+	}
+
+	TempDir(const TempDir &) = delete;
+
+	const string &path() const
+	{ return path_; }
+
+	/// (Over)write @a name in this directory. @return Its full path.
+	string write(const string &name, const string &content)
+	{
+		const string file = path_ + "/" + name;
+		int fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0)
+			throw IOerror(file + ": ", errno);
+		bool ok = ::write(fd, content.data(), content.size()) == ssize_t(content.size());
+		int err = errno;
+		::close(fd);
+		if (!ok)
+			throw IOerror(file + ": ", err);
+		if (std::find(files_.begin(), files_.end(), file) == files_.end())
+			files_.push_back(file);
+		return file;
+	}
+
+private:
+	string path_;
+	vector<string> files_;
+};
+
+
+/// Point stderr at /dev/null for as long as this exists, so logging at TF_NFY stays quiet.
+class QuietStderr {
+public:
+	QuietStderr()
+	: saved_(::dup(STDERR_FILENO))
+	{
+		int null = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+		if (null >= 0) {
+			::dup2(null, STDERR_FILENO);
+			::close(null);
+		}
+	}
+
+	~QuietStderr()
+	{
+		if (saved_ >= 0) {
+			::dup2(saved_, STDERR_FILENO);
+			::close(saved_);
+		}
+	}
+
+private:
+	const int saved_;
+};
+
+
+
+/*----------------------------------------------------------------------------
+| alloc: The steady-state main loop must not allocate (cf. run()).           |
+----------------------------------------------------------------------------*/
+
+string alloc()
+{
+	TempDir dir;
+	dir.write("pwm1", "0\n");
+	dir.write("pwm1_enable", "2\n");
+	const string temp_files[] = {
+		dir.write("temp1_input", "40000\n"),
+		dir.write("temp2_input", "40000\n"),
+	};
+	const string conf = dir.write("thinkfan.conf",
+		"pwm_fan " + dir.path() + "/pwm1\n"
+		"hwmon " + temp_files[0] + "\n"
+		"hwmon " + temp_files[1] + "\n"
+		"(0, 0, 50)\n"
+		"(64, 45, 60)\n"
+		"(128, 55, 70)\n"
+		"(255, 65, 32767)\n"
+	);
+
+	// A sawtooth through all levels and back, the second sensor lagging behind the first
+	vector<vector<int>> trace;
+	for (int t = 40; t < 90; t += 2)
+		trace.push_back({ t, t - 8 });
+	for (int t = 90; t > 40; t -= 3)
+		trace.push_back({ t, t - 4 });
+
+	int fds[2];
+	for (int i = 0; i < 2; ++i) {
+		fds[i] = ::open(temp_files[i].c_str(), O_WRONLY | O_CLOEXEC);
+		if (fds[i] < 0)
+			throw IOerror(temp_files[i] + ": ", errno);
+	}
+	struct CloseFds {
+		~CloseFds() { ::close(fds[0]); ::close(fds[1]); }
+		int *fds;
+	} close_fds { fds };
+
+	tmp_sleeptime = sleeptime;
+	unique_ptr<Config> config(Config::read_config({ conf }));
+	config->init(temp_state);
+
+	read_sensors(*config);
+	for (auto &fan_config : config->fan_configs())
+		fan_config->init_fanspeed(temp_state);
+	config->commit_fans();
+
+	SensorScheduler scheduler(*config, temp_state);
+	auto now = std::chrono::steady_clock::now();
+	unsigned long ticks = 0, transitions = 0;
+
+	// Same as one iteration of run(), except that time passes as fast as we like
+	auto replay = [&] () {
+		char buf[16];
+		for (const vector<int> &sample : trace) {
+			for (int i = 0; i < 2; ++i) {
+				int len = std::snprintf(buf, sizeof(buf), "%d000\n", sample[i]);
+				if (::pwrite(fds[i], buf, size_t(len), 0) != len)
+					throw IOerror(temp_files[i] + ": ", errno);
+			}
+
+			now += tmp_sleeptime;
+			bool temps_changed = scheduler.poll(now);
+			bool did_something = false;
+			for (auto &fan_config : config->fan_configs()) {
+				if (temps_changed && fan_config->inputs_changed(scheduler.changed_sensors()))
+					did_something |= fan_config->set_fanspeed(temp_state);
+				else
+					did_something |= fan_config->keep_fanspeed();
+			}
+			config->commit_fans();
+			if (unlikely(did_something)) {
+				log(TF_NFY) << temp_state << " -> " << config->fan_configs() << flush;
+				++transitions;
+			}
+			++ticks;
+		}
+	};
+
+	QuietStderr quiet;
+	LogLevel log_lvl = Logger::instance().log_lvl();
+	Logger::instance().log_lvl() = TF_NFY;
+
+	// Let every level, string and buffer be seen once
+	replay();
+	ticks = transitions = 0;
+
+	unsigned long count;
+	{
+		AllocationCounter counter;
+		// Once with the level change messages formatted, once with them filtered out
+		replay();
+		replay();
+		Logger::instance().log_lvl() = TF_WRN;
+		replay();
+		count = counter.count();
+	}
+	Logger::instance().log_lvl() = log_lvl;
+
+	if (transitions == 0)
+		return "The fan level never changed while replaying the trace";
+	if (count > 0)
+		return std::to_string(count) + " allocations in " + std::to_string(ticks) + " steady-state ticks ("
+			+ std::to_string(transitions) + " level changes)";
+	return {};
+}
+
+
+/*----------------------------------------------------------------------------
+| parser: The legacy config parser must accept and reject the same things,   |
+| with the same result, as the one in thinkfan 2.0.0. The expected results   |
+| below are what the old parser makes of each input.                         |
+----------------------------------------------------------------------------*/
+
+#define H "pwm_fan /x/pwm1\n" "hwmon /x/temp1_input\n"
+#define H2 H "hwmon /x/temp2_input\n"
+
+static const struct {
+	const char *name;
+	const char *input;
+	const char *expected;
+} parser_corpus[] = {
+	{ "empty",
+		"",
+		""
+	},
+	{ "only_comments",
+		"# a\n"
+		"#b\n"
+		"   \n",
+		""
+	},
+	{ "simple",
+		"# comment\n"
+		"tp_fan /x/fan\n"
+		"hwmon /x/temp1_input\n"
+		"hwmon /x/temp2_input (5)\n"
+		"tp_thermal /x/thermal (0, 2)\n"
+		"\n"
+		"(0, 0, 55)\n"
+		"(1, 48, 60)\n"
+		"(2, 50, 61)\n"
+		"(\"level auto\", 60, 32767)\n",
+		"S hwmon sensor driver /x/temp1_input\n"
+		"S hwmon sensor driver /x/temp2_input (5)\n"
+		"S tpacpi sensor driver (not found) (0 2)\n"
+		"F tpacpi fan driver (not found)\n"
+		"L \"level 0\" 0 (0) (55)\n"
+		"L \"level 1\" 1 (48) (60)\n"
+		"L \"level 2\" 2 (50) (61)\n"
+		"L \"level auto\" . (60) (32767)\n"
+	},
+	{ "comments",
+		"   # leading\n"
+		"pwm_fan /x/pwm1 # trailing\n"
+		"hwmon /x/temp1_input #x\n"
+		"(0, # c\n"
+		"  0, 55) # xx\n"
+		"(  128 ,  45 , 60  )\n"
+		"(255 50 32767)\n"
+		"# end",
+		"S hwmon sensor driver /x/temp1_input\n"
+		"F hwmon fan driver /x/pwm1\n"
+		"L \"level 0\" 0 (0) (55)\n"
+		"L \"level 128\" 128 (45) (60)\n"
+		"L \"level 255\" 255 (50) (32767)\n"
+	},
+	{ "complex",
+		H2
+		"{0, (0, 0), (50, 55)}\n"
+		"{128 (45, 50) (60,.)}\n"
+		"{\"level full-speed\" (55 55) (. .)}\n"
+		"{ 255, {58, 60}, {32767, 32767} }\n",
+		"S hwmon sensor driver /x/temp1_input\n"
+		"S hwmon sensor driver /x/temp2_input\n"
+		"F hwmon fan driver /x/pwm1\n"
+		"L \"level 0\" 0 (0 0) (50 55)\n"
+		"L \"level 128\" 128 (45 50) (60 .)\n"
+		"L \"level full-speed\" . (55 55) (. .)\n"
+		"L \"level 255\" 255 (58 60) (32767 32767)\n"
+	},
+	{ "complex_nosep",
+		H
+		"(0(0)(55))\n"
+		"(\"level auto\"(50)(.))\n",
+		"S hwmon sensor driver /x/temp1_input\n"
+		"F hwmon fan driver /x/pwm1\n"
+		"L \"level 0\" 0 (0) (55)\n"
+		"L \"level auto\" . (50) (.)\n"
+	},
+	{ "complex_newlines",
+		H2
+		"(0,\n"
+		"  (0,\n"
+		"   0)\n"
+		"  (50, # comment\n"
+		"   55)\n"
+		")\n",
+		"S hwmon sensor driver /x/temp1_input\n"
+		"S hwmon sensor driver /x/temp2_input\n"
+		"F hwmon fan driver /x/pwm1\n"
+		"L \"level 0\" 0 (0 0) (50 55)\n"
+	},
+	{ "correction_next_line",
+		H
+		"(0, 0, 55)\n"
+		"hwmon /x/temp2_input (0, 10, 20)\n",
+		"S hwmon sensor driver /x/temp1_input\n"
+		"S hwmon sensor driver /x/temp2_input (0 10 20)\n"
+		"F hwmon fan driver /x/pwm1\n"
+		"L \"level 0\" 0 (0) (55)\n"
+	},
+	{ "correction_negative",
+		H
+		"hwmon /x/temp2_input (-3)\n"
+		"(0, 0, 55)\n",
+		"S hwmon sensor driver /x/temp1_input\n"
+		"S hwmon sensor driver /x/temp2_input (-3)\n"
+		"F hwmon fan driver /x/pwm1\n"
+		"L \"level 0\" 0 (0) (55)\n"
+	},
+	{ "level_after_sensor",
+		"pwm_fan /x/pwm1\n" "hwmon /x/temp1_input (\"level auto\", 0, 55)\n",
+		"S hwmon sensor driver /x/temp1_input\n"
+		"F hwmon fan driver /x/pwm1\n"
+		"L \"level auto\" . (0) (55)\n"
+	},
+	{ "deprecated_fan",
+		"fan /proc/acpi/ibm/fan\n",
+		"error: Guessing the fan type from the path is deprecated. Please use `tp_fan' or `pwm_fan' to make things clear.\n"
+	},
+	{ "deprecated_sensor",
+		"pwm_fan /x/pwm1\n" "sensor /x\n",
+		"error: The `sensor' keyword is deprecated. Please use the `hwmon' or `tp_thermal' keywords instead!\n"
+	},
+	{ "numbers",
+		H
+		"(0x0, 0, 055)\n"
+		"(+128, 45, 60,)\n"
+		"(-1, -5, 60)\n",
+		"error: Fan levels are not ordered correctly\n"
+	},
+	{ "keyword_newline",
+		"pwm_fan\n"
+		"/x/pwm1\n"
+		"hwmon\t/x/temp1_input\n"
+		"(0,0,55)(1,50,60)\n",
+		"S hwmon sensor driver /x/temp1_input\n"
+		"F hwmon fan driver /x/pwm1\n"
+		"L \"level 0\" 0 (0) (55)\n"
+		"L \"level 1\" 1 (50) (60)\n"
+	},
+	{ "quoted_path",
+		"pwm_fan \"/x/pwm1\"\n"
+		"hwmon \"/x/temp 1\"\n"
+		"(0, 0, 55)\n",
+		"S hwmon sensor driver \"/x/temp 1\"\n"
+		"F hwmon fan driver \"/x/pwm1\"\n"
+		"L \"level 0\" 0 (0) (55)\n"
+	},
+	{ "quoted_level_nosep",
+		H "(\"level 1\"0, 55)\n",
+		"syntax error\n"
+	},
+	{ "quoted_level_blanks",
+		H "(\"level auto\" 0 55)\n",
+		"S hwmon sensor driver /x/temp1_input\n"
+		"F hwmon fan driver /x/pwm1\n"
+		"L \"level auto\" . (0) (55)\n"
+	},
+	{ "two_fans",
+		"pwm_fan /x/pwm1\n"
+		"tp_fan /x/fan\n"
+		"hwmon /x/temp1_input\n"
+		"(0, 0, 55)\n",
+		"S hwmon sensor driver /x/temp1_input\n"
+		"F tpacpi fan driver (not found)\n"
+		"L \"level 0\" 0 (0) (55)\n"
+	},
+	{ "braces",
+		H
+		"{0, 0, 55}\n"
+		"{1, (0) {50}}\n",
+		"S hwmon sensor driver /x/temp1_input\n"
+		"F hwmon fan driver /x/pwm1\n"
+		"L \"level 0\" 0 (0) (55)\n"
+		"L \"level 1\" 1 (0) (50)\n"
+	},
+	{ "blanks",
+		H
+		"(0,   0,\t55)\n"
+		"(1  48  60)\n"
+		"   ( 2 , 50 , 61 )\n",
+		"S hwmon sensor driver /x/temp1_input\n"
+		"F hwmon fan driver /x/pwm1\n"
+		"L \"level 0\" 0 (0) (55)\n"
+		"L \"level 1\" 1 (48) (60)\n"
+		"L \"level 2\" 2 (50) (61)\n"
+	},
+	{ "dot_lower",
+		H2
+		"(0, (., 50) (70, 80))\n"
+		"(1, (0 .) (., 90))\n",
+		"error: LOWER limit doesn't overlap with previous UPPER limit\n"
+	},
+	{ "bad_bracket",
+		H "(0, 0, 55}\n",
+		"syntax error\n"
+	},
+	{ "bad_count",
+		H "(0, 0)\n",
+		"syntax error\n"
+	},
+	{ "bad_count_complex",
+		H "(0, (0) (50) (60))\n",
+		"syntax error\n"
+	},
+	{ "bad_keyword",
+		"pwm_fan /x/pwm1\n"
+		"hwmonx /x/temp1_input\n"
+		"(0, 0, 55)\n",
+		"syntax error\n"
+	},
+	{ "bad_separator",
+		H "(0,, 0, 55)\n",
+		"syntax error\n"
+	},
+	{ "dot_in_simple",
+		H "(0, 0, .)\n",
+		"syntax error\n"
+	},
+	{ "unterminated_string",
+		H "(\"level auto, 0, 55)\n",
+		"syntax error\n"
+	},
+	{ "unterminated_level",
+		H "(0, 0, 55\n",
+		"syntax error\n"
+	},
+	{ "garbage",
+		H
+		"(0, 0, 55)\n"
+		"foo\n",
+		"syntax error\n"
+	},
+	{ "keyword_only",
+		"pwm_fan\n",
+		"syntax error\n"
+	},
+	{ "int_overflow",
+		H "(4294967296, 0, 55)\n",
+		"syntax error\n"
+	},
+
+	// Rejected by thinkfan 2.0.0 and earlier, which didn't allow a "." or a closing bracket after
+	// a comma followed by a blank. Both are documented in thinkfan.conf.legacy(5) now.
+	{ "ext_dot_after_comma",
+		H2
+		"(0, (0, 0) (50, 55))\n"
+		"(1, (45, 50) (60, .))\n",
+		"S hwmon sensor driver /x/temp1_input\n"
+		"S hwmon sensor driver /x/temp2_input\n"
+		"F hwmon fan driver /x/pwm1\n"
+		"L \"level 0\" 0 (0 0) (50 55)\n"
+		"L \"level 1\" 1 (45 50) (60 .)\n"
+	},
+	{ "ext_trailing_comma",
+		H2
+		"(0, 0, 55, )\n"
+		"(1, (45, ) (60, ))\n",
+		"S hwmon sensor driver /x/temp1_input\n"
+		"S hwmon sensor driver /x/temp2_input\n"
+		"F hwmon fan driver /x/pwm1\n"
+		"L \"level 0\" 0 (0) (55)\n"
+		"L \"level 1\" 1 (45) (60)\n"
+	},
+};
+
+#undef H
+#undef H2
+
+
+static string format_limit(const vector<int> &limit)
+{
+	string rv = "(";
+	for (int t : limit) {
+		if (rv.length() > 1)
+			rv += ' ';
+		rv += t == INT_MAX ? "." : std::to_string(t);
+	}
+	return rv + ")";
+}
+
+
+/// One line per sensor, fan and level, or what went wrong while parsing.
+static string parse_and_dump(const char *input)
+{
+	string rv;
+	try {
+		ConfigParser parser;
+		unique_ptr<Config> config(parser.parse_config(input));
+		if (!config)
+			return "syntax error\n";
+
+		for (const unique_ptr<SensorDriver> &sensor : config->sensors()) {
+			sensor->try_lookup();
+			rv += "S " + sensor->name();
+			if (!sensor->correction().empty())
+				rv += ' ' + format_limit(sensor->correction());
+			rv += '\n';
+		}
+		for (const unique_ptr<FanConfig> &fan_cfg : config->fan_configs()) {
+			if (fan_cfg->fan()) {
+				fan_cfg->fan()->try_lookup();
+				rv += "F " + fan_cfg->fan()->name() + '\n';
+			}
+			for (const unique_ptr<Level> &lvl : dynamic_cast<const StepwiseMapping &>(*fan_cfg).levels()) {
+				rv += "L \"" + lvl->str() + "\" "
+					+ (lvl->num() == INT_MIN ? string(".") : std::to_string(lvl->num())) + ' '
+					+ format_limit(lvl->lower_limit()) + ' ' + format_limit(lvl->upper_limit()) + '\n';
+			}
+		}
+	} catch (ExpectedError &e) {
+		return string("error: ") + e.what() + "\n";
+	}
+	return rv;
+}
+
+
+/// Mess up @a input a little, using only characters that mean something to the parser.
+static string mutate(const string &input, std::mt19937 &rng)
+{
+	static const char charset[] = "(){},.\"# \n\t0123456789-xabehlmnoprstw";
+	auto pick = [&] (size_t n) { return std::uniform_int_distribution<size_t>(0, n - 1)(rng); };
+
+	string rv = input;
+	for (size_t n = 1 + pick(4); n > 0; --n) {
+		size_t pos = rv.empty() ? 0 : pick(rv.size());
+		switch (pick(rv.empty() ? 1 : 4)) {
+		case 0:
+			rv.insert(pos, 1, charset[pick(sizeof(charset) - 1)]);
+			break;
+		case 1:
+			rv.erase(pos, 1 + pick(3));
+			break;
+		case 2:
+			rv[pos] = charset[pick(sizeof(charset) - 1)];
+			break;
+		case 3:
+			rv.insert(pos, rv.substr(pos, 1 + pick(8)));
+			break;
+		}
+	}
+	return rv;
+}
+
+
+string parser()
+{
+	QuietStderr quiet;
+
+	for (const auto &c : parser_corpus) {
+		string result;
+		try {
+			result = parse_and_dump(c.input);
+		} catch (std::exception &e) {
+			return string(c.name) + ": " + e.what();
+		}
+		if (result != c.expected)
+			return string(c.name) + ": Expected\n" + c.expected + "but got\n" + result;
+	}
+
+	// Whatever the input, the parser must either give a config and consume all of it, or
+	// point somewhere into it and leave it alone. Any exception other than an ExpectedError
+	// would end up as an internal error in thinkfan.
+	std::mt19937 rng(1);
+	for (unsigned int i = 0; i < 20000; ++i) {
+		const string input = mutate(parser_corpus[i % std::size(parser_corpus)].input, rng);
+		const char *start = input.c_str();
+		const char *p = start;
+		try {
+			ConfigParser parser;
+			unique_ptr<Config> config(parser.parse_config(p));
+			if (config && p != start + input.size())
+				return "Input left over after a successful parse:\n" + input;
+			if (!config && p != start)
+				return "Input consumed by a failed parse:\n" + input;
+			if (!config && (parser.get_max_addr() < start || parser.get_max_addr() > start + input.size()))
+				return "Error position outside of the input:\n" + input;
+		} catch (ExpectedError &) {
+		} catch (std::exception &e) {
+			return string(e.what()) + " while parsing:\n" + input;
+		}
+	}
+
+	return {};
+}
+
+
+/*----------------------------------------------------------------------------
+| workers: A BlockingSensorDriver must wait for its first read, fall back to |
+| the last temperature when a read misses its deadline, pick up the late     |
+| result on a later read, and rethrow errors from the worker.                |
+----------------------------------------------------------------------------*/
+
+/// A fetch that blocks until it's released.
+class GatedSensorDriver : public BlockingSensorDriver {
+public:
+	GatedSensorDriver(std::chrono::milliseconds deadline)
+	: BlockingSensorDriver(false, deadline)
+	, released_(0)
+	, temp_(0)
+	, fail_(false)
+	{}
+
+	virtual ~GatedSensorDriver() noexcept(false) override
+	{
+		release(0);
+		finish();
+	}
+
+	/// Let one fetch through, which reports @a temp or fails if @a fail is set.
+	void release(int temp, bool fail = false)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		temp_ = temp;
+		fail_ = fail;
+		++released_;
+		cond_.notify_all();
+	}
+
+protected:
+	virtual void init() override
+	{ set_num_temps(1); }
+
+	virtual string lookup() override
+	{ return "gate"; }
+
+	virtual string type_name() const override
+	{ return "gated sensor driver"; }
+
+	virtual void fetch_temps_(vector<int> &temps) override
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_.wait(lock, [this] () { return released_ > 0; });
+		--released_;
+		if (fail_)
+			throw SystemError("Fetch failed");
+		temps[0] = temp_;
+	}
+
+private:
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	unsigned int released_;
+	int temp_;
+	bool fail_;
+};
+
+
+string workers()
+{
+	using namespace std::chrono;
+	using std::to_string;
+	const milliseconds deadline(50);
+	// Anything up to this much longer than the deadline is put down to a busy machine
+	const milliseconds slack(1000);
+
+	TemperatureState temps(1);
+	GatedSensorDriver sensor(deadline);
+	sensor.init_temp_state_ref(temps.ref(1));
+	sensor.try_init();
+	if (!sensor.initialized())
+		return "Failed to initialize the gated sensor";
+
+	auto timed_read = [&] () {
+		auto start = steady_clock::now();
+		sensor.prefetch_temps();
+		sensor.read_temps();
+		return duration_cast<milliseconds>(steady_clock::now() - start);
+	};
+
+	// The first read has nothing to fall back to, so it must wait past the deadline
+	std::thread releaser([&] () {
+		std::this_thread::sleep_for(3 * deadline);
+		sensor.release(40);
+	});
+	milliseconds t = timed_read();
+	releaser.join();
+	if (temps.temps()[0] != 40)
+		return "First read gave " + to_string(temps.temps()[0]) + " instead of 40";
+	if (t < 3 * deadline)
+		return "First read returned after " + to_string(t.count()) + " ms, before the fetch finished";
+
+	// Now the fetch blocks. The read must give up at the deadline and keep the last temperature.
+	t = timed_read();
+	if (temps.temps()[0] != 40)
+		return "Read that missed the deadline gave " + to_string(temps.temps()[0]) + " instead of 40";
+	if (t < deadline || t > deadline + slack)
+		return "Read that missed the " + to_string(deadline.count()) + " ms deadline took "
+			+ to_string(t.count()) + " ms";
+
+	// The late result must show up once the fetch is done, without another one being submitted
+	sensor.release(45);
+	auto give_up = steady_clock::now() + slack;
+	do {
+		std::this_thread::sleep_for(milliseconds(10));
+		t = timed_read();
+	} while (temps.temps()[0] == 40 && steady_clock::now() < give_up);
+	if (temps.temps()[0] != 45)
+		return "Late result never showed up, still at " + to_string(temps.temps()[0]);
+
+	// Errors on the worker reach the main thread like any other read error
+	sensor.release(0, true);
+	give_up = steady_clock::now() + slack;
+	try {
+		do
+			timed_read();
+		while (steady_clock::now() < give_up);
+	} catch (ExpectedError &e) {
+		if (string(e.what()).find("Fetch failed") == string::npos)
+			return string("Wrong error from the fetch: ") + e.what();
+		return {};
+	}
+	return "Error in the fetch was lost";
+}
+
+
+/*----------------------------------------------------------------------------
+| metrics: The MetricsExporter must serve exactly what was published last,   |
+| in OpenMetrics text format.                                                |
+----------------------------------------------------------------------------*/
+
+/// Send @a request to the UNIX socket at @a path. @return Everything that comes back.
+static string http_request(const string &path, const string &request)
+{
+	struct sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw IOerror("socket(): ", errno);
+	if (::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr))) {
+		int err = errno;
+		::close(fd);
+		throw IOerror(path + ": ", err);
+	}
+
+	string rv;
+	if (::send(fd, request.data(), request.length(), MSG_NOSIGNAL) == ssize_t(request.length())) {
+		char buf[4096];
+		ssize_t n;
+		while ((n = ::recv(fd, buf, sizeof(buf), 0)) > 0)
+			rv.append(buf, size_t(n));
+	}
+	::close(fd);
+	return rv;
+}
+
+
+static string metrics_body(const string &dir, int temp1, int temp2, int level)
+{
+	const string t1 = "sensor=\"hwmon sensor driver " + dir + "/temp1_input\",index=\"0\"";
+	const string t2 = "sensor=\"hwmon sensor driver " + dir + "/temp2_input\",index=\"1\"";
+	return
+		"# TYPE thinkfan_temperature_celsius gauge\n"
+		"# UNIT thinkfan_temperature_celsius celsius\n"
+		"# HELP thinkfan_temperature_celsius Sensor temperature after correction.\n"
+		"thinkfan_temperature_celsius{" + t1 + "} " + std::to_string(temp1) + "\n"
+		"thinkfan_temperature_celsius{" + t2 + "} " + std::to_string(temp2) + "\n"
+		"# TYPE thinkfan_temperature_bias_celsius gauge\n"
+		"# UNIT thinkfan_temperature_bias_celsius celsius\n"
+		"# HELP thinkfan_temperature_bias_celsius Bias added to the temperature due to a recent rise.\n"
+		"thinkfan_temperature_bias_celsius{" + t1 + "} 0\n"
+		"thinkfan_temperature_bias_celsius{" + t2 + "} 0\n"
+		"# TYPE thinkfan_fan_level gauge\n"
+		"# HELP thinkfan_fan_level Fan level as last written, NaN if symbolic (e.g. level auto).\n"
+		"thinkfan_fan_level{fan=\"hwmon fan driver " + dir + "/pwm1\",index=\"0\"} " + std::to_string(level) + "\n"
+		"# TYPE thinkfan_driver_errors counter\n"
+		"# HELP thinkfan_driver_errors I/O errors encountered by a sensor or fan driver.\n"
+		"thinkfan_driver_errors_total{driver=\"hwmon sensor driver " + dir + "/temp1_input\",index=\"sensor0\"} 0\n"
+		"thinkfan_driver_errors_total{driver=\"hwmon sensor driver " + dir + "/temp2_input\",index=\"sensor1\"} 0\n"
+		"thinkfan_driver_errors_total{driver=\"hwmon fan driver " + dir + "/pwm1\",index=\"fan0\"} 0\n"
+		"# EOF\n";
+}
+
+
+static string metrics_headers(size_t content_length)
+{
+	return "HTTP/1.0 200 OK\r\n"
+		"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		"Content-Length: " + std::to_string(content_length) + "\r\n"
+		"Connection: close\r\n\r\n";
+}
+
+
+string metrics()
+{
+	TempDir dir;
+	dir.write("pwm1", "0\n");
+	dir.write("pwm1_enable", "2\n");
+	dir.write("temp1_input", "40000\n");
+	dir.write("temp2_input", "45000\n");
+	const string conf = dir.write("thinkfan.conf",
+		"pwm_fan " + dir.path() + "/pwm1\n"
+		"hwmon " + dir.path() + "/temp1_input\n"
+		"hwmon " + dir.path() + "/temp2_input\n"
+		"(0, 0, 50)\n"
+		"(128, 45, 70)\n"
+		"(255, 65, 32767)\n"
+	);
+	const string socket = dir.path() + "/metrics.sock";
+
+	QuietStderr quiet;
+	tmp_sleeptime = sleeptime;
+	unique_ptr<Config> config(Config::read_config({ conf }));
+	config->init(temp_state);
+	read_sensors(*config);
+	for (auto &fan_config : config->fan_configs())
+		fan_config->init_fanspeed(temp_state);
+	config->commit_fans();
+
+	MetricsExporter exporter(socket);
+
+	// Nothing published yet
+	string response = http_request(socket, "GET /metrics HTTP/1.0\r\n\r\n");
+	if (response != metrics_headers(6) + "# EOF\n")
+		return "Before the first publish(), got:\n" + response;
+
+	exporter.set_config(*config);
+	exporter.publish(*config, temp_state);
+	string body = metrics_body(dir.path(), 40, 45, 128);
+	response = http_request(socket, "GET /metrics HTTP/1.0\r\nHost: localhost\r\n\r\n");
+	if (response != metrics_headers(body.length()) + body)
+		return "Expected\n" + metrics_headers(body.length()) + body + "but got\n" + response;
+
+	// The next publish() must replace everything
+	dir.write("temp1_input", "72000\n");
+	dir.write("temp2_input", "52000\n");
+	read_sensors(*config);
+	for (auto &fan_config : config->fan_configs())
+		fan_config->set_fanspeed(temp_state);
+	config->commit_fans();
+	exporter.publish(*config, temp_state);
+	body = metrics_body(dir.path(), 72, 52, 255);
+	response = http_request(socket, "GET /metrics HTTP/1.0\r\n\r\n");
+	if (response != metrics_headers(body.length()) + body)
+		return "After the second publish(), expected\n" + metrics_headers(body.length()) + body
+			+ "but got\n" + response;
+
+	response = http_request(socket, "HEAD /metrics HTTP/1.0\r\n\r\n");
+	if (response != metrics_headers(body.length()))
+		return "HEAD must give only the headers, but got:\n" + response;
+
+	response = http_request(socket, "POST /metrics HTTP/1.0\r\nContent-Length: 0\r\n\r\n");
+	if (response.compare(0, 33, "HTTP/1.0 405 Method Not Allowed\r\n"))
+		return "POST must be refused, but got:\n" + response;
+
+	return {};
+}
+
+
+/*----------------------------------------------------------------------------
+| cache: The ConfigCache must survive a restart with the same config, and    |
+| must be ignored when the config, the set of hwmons or the file is changed. |
+----------------------------------------------------------------------------*/
+
+#if defined(CACHE_FILE)
+
+/// @return The entry for @a key after loading the cache for @a fp from CACHE_FILE.
+static const ConfigCache::Entry *reload(const ConfigFingerprint &fp, const string &key)
+{
+	// Switch away first, since loading the current fingerprint again doesn't touch the file
+	ConfigCache &cache = ConfigCache::instance();
+	cache.load(ConfigFingerprint());
+	cache.load(fp);
+	return cache.find(key);
+}
+
+
+/// Remove CACHE_FILE when we're done, so the next run starts without one.
+class RemoveCacheFile {
+public:
+	RemoveCacheFile()
+	{ ::unlink(CACHE_FILE); }
+
+	~RemoveCacheFile()
+	{ ::unlink(CACHE_FILE); }
+};
+
+#endif // defined(CACHE_FILE)
+
+
+string cache()
+{
+#if defined(CACHE_FILE)
+	const string key = "hwmon temp1_input name=coretemp";
+	TempDir dir;
+	const string conf = dir.write("thinkfan.conf", "hwmon:\n  - name: coretemp\n");
+	string data;
+	const ConfigFingerprint fp = ConfigFingerprint::read(conf, data);
+
+	RemoveCacheFile remove_cache_file;
+	ConfigCache &cache = ConfigCache::instance();
+	cache.load(fp);
+	cache.store(key, { "/sys/class/hwmon/hwmon3", { "/sys/class/hwmon/hwmon3/temp1_input" } });
+	cache.save();
+
+	const ConfigCache::Entry *entry = reload(fp, key);
+	if (!entry)
+		return "Entry not found after reloading " CACHE_FILE;
+	if (entry->hwmon_dir != "/sys/class/hwmon/hwmon3" || entry->paths.size() != 1
+		|| entry->paths[0] != "/sys/class/hwmon/hwmon3/temp1_input"
+	)
+		return "Entry changed after reloading " CACHE_FILE;
+
+	// Same size and mtime, different content
+	struct stat st;
+	if (::stat(conf.c_str(), &st))
+		throw IOerror(conf + ": ", errno);
+	dir.write("thinkfan.conf", "hwmon:\n  - name: amdgpu00\n");
+	struct timespec times[2] = { st.st_atim, st.st_mtim };
+	if (::utimensat(AT_FDCWD, conf.c_str(), times, 0))
+		throw IOerror(conf + ": ", errno);
+	ConfigFingerprint changed = ConfigFingerprint::read(conf, data);
+	if (changed == fp || changed.mtime_ns != fp.mtime_ns || changed.size != fp.size)
+		return "Couldn't change the config without changing its size or mtime";
+	if (reload(changed, key))
+		return "Cache used after the config's content changed";
+
+	// Same content, different mtime
+	dir.write("thinkfan.conf", "hwmon:\n  - name: coretemp\n");
+	times[1].tv_sec = st.st_mtim.tv_sec - 60;
+	if (::utimensat(AT_FDCWD, conf.c_str(), times, 0))
+		throw IOerror(conf + ": ", errno);
+	changed = ConfigFingerprint::read(conf, data);
+	if (changed.hash != fp.hash || changed.mtime_ns == fp.mtime_ns)
+		return "Couldn't change the config's mtime without changing its content";
+	if (reload(changed, key))
+		return "Cache used after the config's mtime changed";
+
+	// Loading a stale cache mustn't have overwritten the file
+	if (!reload(fp, key))
+		return "Cache for the original config lost after loading a changed one";
+
+	string cache_data;
+	ConfigFingerprint::read(CACHE_FILE, cache_data);
+	auto rewrite_cache = [&] (const string &content) {
+		int fd = ::open(CACHE_FILE, O_WRONLY | O_TRUNC | O_CLOEXEC);
+		if (fd < 0)
+			throw IOerror(CACHE_FILE ": ", errno);
+		bool ok = ::write(fd, content.data(), content.size()) == ssize_t(content.size());
+		int err = errno;
+		::close(fd);
+		if (!ok)
+			throw IOerror(CACHE_FILE ": ", err);
+	};
+
+	// The hash of the hwmon devices follows the magic and the config's hash, size and mtime
+	const size_t devices_offset = 8 + 3 * 8;
+	string tampered = cache_data;
+	tampered[devices_offset] ^= 1;
+	rewrite_cache(tampered);
+	if (reload(fp, key))
+		return "Cache used after the hwmon devices changed";
+
+	rewrite_cache(cache_data.substr(0, cache_data.size() - 4));
+	if (reload(fp, key))
+		return "Truncated cache used";
+
+	rewrite_cache(cache_data);
+	if (!reload(fp, key))
+		return "Restored cache not used";
+
+	cache.clear();
+	return {};
+#else
+	return "thinkfan-bench was built without a CACHE_FILE";
+#endif // defined(CACHE_FILE)
+}
+
+
+} // namespace self_check
+} // namespace thinkfan
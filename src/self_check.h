@@ -0,0 +1,60 @@
+#pragma once
+
+/********************************************************************
+ * self_check.h: Checks run by thinkfan-bench -S
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "thinkfan.h"
+
+namespace thinkfan {
+namespace self_check {
+
+/* Each check sets up whatever files it needs in a temporary directory, so it can run
+ * without any hardware. They all return a description of the first thing that went wrong,
+ * or an empty string if the check passed. */
+
+
+/** @brief Replay a temperature trace through hwmon sensors and a PWM fan like the main loop
+ *  does, and count the allocations made after the fan levels have been seen once. */
+string alloc();
+
+
+/** @brief Compare the legacy config parser with the one in thinkfan 2.0.0 on a corpus of
+ *  configs, then check that it handles random mutations of them gracefully. */
+string parser();
+
+
+/** @brief Drive a BlockingSensorDriver whose fetches only finish when the check says so, and
+ *  see that reads wait, time out and recover as they should. */
+string workers();
+
+
+/** @brief Publish the state of a config with hwmon sensors into a MetricsExporter on a UNIX
+ *  socket and compare what a scrape gets with the expected OpenMetrics text. */
+string metrics();
+
+
+/** @brief Save a ConfigCache entry to CACHE_FILE, then check that it's loaded again only as
+ *  long as the config, the hwmon devices and the file itself are unchanged. */
+string cache();
+
+
+} // namespace self_check
+} // namespace thinkfan
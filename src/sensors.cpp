@@ -22,16 +22,16 @@
 #include "sensors.h"
 #include "error.h"
 #include "message.h"
+#include "event_loop.h"
 
+#include <unistd.h>
+#include <cstdlib>
 #include <fstream>
 #include <cstring>
 #include <thread>
 #include <typeinfo>
 #include <cmath>
-
-#ifdef USE_NVML
-#include <dlfcn.h>
-#endif
+#include <algorithm>
 
 namespace thinkfan {
 
@@ -44,35 +44,56 @@ SensorDriver::SensorDriver(bool optional, opt<vector<int>> correction, opt<unsig
 : Driver(optional, max_errors.value_or(0))
 , correction_(correction.value_or(vector<int>()))
 , num_temps_(0)
+, predictive_(false)
 {}
 
-void SensorDriver::init()
-{ readstream(path()); }
-
 SensorDriver::~SensorDriver() noexcept(false)
 {}
 
 
-inline int SensorDriver::readstream(const string &path) {
-	std::ifstream f(path);
-	if (!(f.is_open() && f.good()))
-		throw IOerror(MSG_T_GET(path), errno);
+void SensorDriver::set_correction(const vector<int> &correction)
+{
+	// Checked by set_num_temps() when the driver is initialized, since the number of
+	// temperatures isn't known before.
+	correction_ = correction;
+}
 
-	int tmp;
-	if (!(f >> tmp))
-		throw IOerror(MSG_T_GET(path), errno);
 
-	return tmp;
-}
+const vector<int> &SensorDriver::correction() const
+{ return correction_; }
 
 
-void SensorDriver::set_correction(const vector<int> &correction)
+const opt<milliseconds> &SensorDriver::interval() const
+{ return interval_; }
+
+
+void SensorDriver::set_interval(milliseconds interval)
+{ interval_ = interval; }
+
+
+bool SensorDriver::predictive() const
+{ return predictive_; }
+
+
+void SensorDriver::set_predictive(bool predictive)
 {
-	correction_ = correction;
-	check_correction_length();
+	predictive_ = predictive;
+	temp_state_.set_predictive(predictive);
 }
 
 
+const string &SensorDriver::id() const
+{ return id_; }
+
+
+void SensorDriver::set_id(const string &id)
+{ id_ = id; }
+
+
+milliseconds SensorDriver::predicted_interval() const
+{ return temp_state_.interval(); }
+
+
 void SensorDriver::set_num_temps(unsigned int n)
 {
 	num_temps_ = n;
@@ -85,20 +106,40 @@ void SensorDriver::set_num_temps(unsigned int n)
 
 bool SensorDriver::operator == (const SensorDriver &other) const
 {
+	// init() pads the correction with zeros, so an uninitialized driver may have a shorter one
+	const vector<int> &a = correction_.size() < other.correction_.size() ? correction_ : other.correction_;
+	const vector<int> &b = &a == &correction_ ? other.correction_ : correction_;
 	return typeid(*this) == typeid(other)
-			&& this->correction_ == other.correction_
-	&& this->path() == other.path();
+		&& std::equal(a.begin(), a.end(), b.begin())
+		&& std::all_of(b.begin() + a.size(), b.end(), [] (int c) { return c == 0; })
+		&& predictive_ == other.predictive_
+		&& this->path() == other.path();
+}
+
+
+void SensorDriver::take_settings(const SensorDriver &other)
+{
+	Driver::take_settings(other);
+	interval_ = other.interval_;
+	id_ = other.id_;
 }
 
 
 void SensorDriver::read_temps()
 {
+	ScopedTimer timer(latency_);
 	temp_state_.restart();
 	robust_io(&SensorDriver::read_temps_);
 }
 
 void SensorDriver::init_temp_state_ref(TemperatureState::Ref &&ref)
-{ temp_state_ = std::move(ref); }
+{
+	temp_state_ = std::move(ref);
+	temp_state_.set_predictive(predictive_);
+}
+
+void SensorDriver::prefetch_temps()
+{}
 
 
 void SensorDriver::check_correction_length()
@@ -117,7 +158,7 @@ void SensorDriver::skip_io_error(const ExpectedError &e)
 		// Completely ignore sensor. optional says we're good without it
 		temp_state_.add_temp(-128);
 	}
-	else if (tolerate_errors) {
+	else if (tolerate_errors || in_grace()) {
 		log(TF_NFY) << DriverLost(e).what();
 		// Read error on wakeup: keep last temp
 		temp_state_.skip_temp();
@@ -133,6 +174,120 @@ void SensorDriver::skip_io_error(const ExpectedError &e)
 
 
 
+/*----------------------------------------------------------------------------
+| BlockingSensorDriver: Superclass for sensors that are read on a worker     |
+| thread because the underlying library call may take a long time.          |
+----------------------------------------------------------------------------*/
+
+BlockingSensorDriver::BlockingSensorDriver(
+	bool optional,
+	std::chrono::milliseconds deadline,
+	opt<vector<int>> correction,
+	opt<unsigned int> max_errors
+)
+: SensorDriver(optional, correction, max_errors)
+, deadline_(deadline)
+, pending_(false)
+, stale_(false)
+, have_temps_(false)
+{}
+
+
+void BlockingSensorDriver::set_refresh(seconds interval)
+{ refresh_ = interval; }
+
+
+void BlockingSensorDriver::prefetch_temps()
+{
+	if (available() && initialized() && !pending_) {
+		auto now = std::chrono::steady_clock::now();
+		if (refresh_ && have_temps_ && now < submitted_ + *refresh_)
+			return;
+
+		fetched_.resize(num_temps());
+		submitted_ = now;
+		pending_ = true;
+		submit();
+	}
+}
+
+
+void BlockingSensorDriver::reinit()
+{
+	finish();
+	pending_ = false;
+	stale_ = false;
+	error_ = nullptr;
+	have_temps_ = false;
+	Driver::reinit();
+}
+
+
+void BlockingSensorDriver::discard_fetch()
+{ stale_ = pending_; }
+
+
+void BlockingSensorDriver::run()
+{
+	try {
+		fetch_temps_(fetched_);
+	} catch (...) {
+		error_ = std::current_exception();
+	}
+}
+
+
+void BlockingSensorDriver::read_temps_()
+{
+	if (unlikely(stale_)) {
+		// Submitted before we were looked up again, so the result is useless
+		if (have_temps_ && !wait_until(std::chrono::steady_clock::now())) {
+			for (unsigned int i = 0; i < num_temps(); ++i)
+				temp_state_.skip_temp();
+			return;
+		}
+		wait();
+		pending_ = false;
+		stale_ = false;
+		error_ = nullptr;
+	}
+
+	// Not prefetched, e.g. because we were just initialized
+	prefetch_temps();
+
+	if (unlikely(!have_temps_)) {
+		// There is no previous value we could fall back to
+		wait();
+	}
+	else if (refresh_ && !(pending_ && wait_until(submitted_))) {
+		// Background refresh: Never wait, just use whatever we have
+		for (unsigned int i = 0; i < num_temps(); ++i)
+			temp_state_.skip_temp();
+		return;
+	}
+	else if (!refresh_ && !wait_until(submitted_ + deadline_)) {
+		// Worker is still busy: Keep the last temperatures and check again next time
+		log(TF_DBG) << path() << ": Read did not finish within " << static_cast<unsigned int>(deadline_.count())
+			<< " ms, keeping last temperature(s)." << flush;
+		for (unsigned int i = 0; i < num_temps(); ++i)
+			temp_state_.skip_temp();
+		return;
+	}
+
+	pending_ = false;
+	if (unlikely(bool(error_))) {
+		std::exception_ptr e = error_;
+		error_ = nullptr;
+		std::rethrow_exception(e);
+	}
+
+	for (int t : fetched_)
+		temp_state_.add_temp(t);
+	have_temps_ = true;
+}
+
+
+
 /*----------------------------------------------------------------------------
 | HwmonSensorDriver: A driver for sensors provided by other kernel drivers,  |
 | typically somewhere in sysfs.                                              |
@@ -157,16 +312,72 @@ HwmonSensorDriver::HwmonSensorDriver(
 , hwmon_interface_(hwmon_interface)
 {}
 
+HwmonSensorDriver::~HwmonSensorDriver() noexcept(false)
+{ unwatch_alarms(); }
+
+
 void HwmonSensorDriver::init()
 {
-	SensorDriver::init();
+	input_.open(path());
+	input_.read_int();
 	set_num_temps(1);
+	watch_alarms();
+}
+
+
+const char *const HwmonSensorDriver::alarm_suffixes_[2] = { "_max_alarm", "_crit_alarm" };
+
+
+void HwmonSensorDriver::watch_alarms()
+{
+	unwatch_alarms();
+
+	string::size_type pos = path().rfind("_input");
+	if (pos == string::npos)
+		return;
+
+	for (size_t i = 0; i < 2; ++i) {
+		string alarm_path = path().substr(0, pos) + alarm_suffixes_[i];
+		if (::access(alarm_path.c_str(), R_OK))
+			continue;
+		try {
+			alarms_[i].open(alarm_path);
+			// A first read is needed before poll() reports a change
+			alarms_[i].read_int();
+			EventLoop::instance().watch(alarms_[i].fd(), this);
+			log(TF_DBG) << "Watching " << alarm_path << "." << flush;
+		} catch (ExpectedError &e) {
+			// Not all drivers support sysfs_notify(). We'll still see the temperature eventually.
+			log(TF_DBG) << "Can't watch " << alarm_path << ": " << e.what() << flush;
+			alarms_[i].close();
+		}
+	}
+}
+
+
+void HwmonSensorDriver::unwatch_alarms()
+{
+	for (DeviceFile &alarm : alarms_) {
+		if (alarm.is_open()) {
+			EventLoop::instance().unwatch(alarm.fd());
+			alarm.close();
+		}
+	}
 }
 
 void HwmonSensorDriver::read_temps_()
 {
 	temp_state_.add_temp(
-		readstream(path()) / 1000 + correction_[0]
+		input_.read_int() / 1000 + correction_[0]
+	);
+}
+
+
+void HwmonSensorDriver::read_error(int status)
+{
+	robust_op(
+		[&] () { input_.throw_read_error(status); },
+		[this] (const ExpectedError &e) { skip_io_error(e); }
 	);
 }
 
@@ -202,34 +413,32 @@ TpSensorDriver::TpSensorDriver(
 }
 
 
+const char *TpSensorDriver::read_buf(char *buf)
+{
+	size_t len = input_.read(buf, buf_size_);
+	if (len < skip_prefix_.size() || skip_prefix_.compare(0, skip_prefix_.size(), buf, skip_prefix_.size()))
+		throw SystemError(path() + ": Unknown file format.");
+	return buf + skip_prefix_.size();
+}
+
+
 void TpSensorDriver::init()
 {
+	char buf[buf_size_];
 	int tmp;
 	unsigned int count = 0;
 
-	string skip;
-	skip.resize(skip_prefix_.size());
-
-	std::ifstream f(path());
-	if (!(f.is_open() && f.good()))
-		throw IOerror(MSG_SENSOR_INIT(path()), errno);
-
-	if (!f.get(&*skip.begin(), static_cast<std::streamsize>(skip_prefix_.size() + 1)))
-		throw IOerror(MSG_SENSOR_INIT(path()), errno);
-
-	if (skip == skip_prefix_)
-		skip_bytes_ = f.tellg();
-	else
-		throw SystemError(path() + ": Unknown file format.");
-
-	while (!(f.eof() || f.fail())) {
-		f >> tmp;
-		if (f.bad())
-			throw IOerror(MSG_T_GET(path()), errno);
-		if (!f.fail())
-			++count;
+	try {
+		input_.open(path());
+	} catch (IOerror &e) {
+		throw IOerror(MSG_SENSOR_INIT(path()), e.code());
 	}
 
+	const char *p = read_buf(buf);
+	const char *end = p + std::char_traits<char>::length(p);
+	while ((p = DeviceFile::parse_int(p, end, tmp)))
+		++count;
+
 	if (temp_indices_) {
 		if (temp_indices_->size() > count)
 			throw ConfigError(
@@ -252,22 +461,15 @@ void TpSensorDriver::init()
 
 void TpSensorDriver::read_temps_()
 {
-	std::ifstream f(path());
-	if (!(f.is_open() && f.good()))
-		throw IOerror(MSG_T_GET(path()), errno);
-
-	f.seekg(skip_bytes_);
-	if (f.fail())
-		throw IOerror(MSG_T_GET(path()), errno);
+	char buf[buf_size_];
+	const char *p = read_buf(buf);
+	const char *end = p + std::char_traits<char>::length(p);
 
 	unsigned int tidx = 0;
 	unsigned int cidx = 0;
 	int tmp;
-	while (!(f.eof() || f.fail())) {
-		f >> tmp;
-		if (f.bad())
-			throw IOerror(MSG_T_GET(path()), errno);
-		if (!f.fail() && in_use_[tidx++])
+	while ((p = DeviceFile::parse_int(p, end, tmp)) && tidx < in_use_.size()) {
+		if (in_use_[tidx++])
 			temp_state_.add_temp(tmp + correction_[cidx++]);
 	}
 }
@@ -279,7 +481,7 @@ string TpSensorDriver::lookup()
 	if (f.is_open() && f.good())
 		return conf_path_;
 	else
-		throw IOerror(MSG_SENSOR_INIT(path()), errno);
+		throw IOerror(MSG_SENSOR_INIT(conf_path_), errno);
 }
 
 string TpSensorDriver::type_name() const
@@ -292,32 +494,78 @@ string TpSensorDriver::type_name() const
 | via device files like /dev/sda.                                            |
 ----------------------------------------------------------------------------*/
 
+constexpr seconds AtasmartSensorDriver::refresh_interval_;
+
+
 AtasmartSensorDriver::AtasmartSensorDriver(
 	string device_path,
 	bool optional,
 	opt<vector<int>> correction,
 	opt<unsigned int> max_errors
 )
-: SensorDriver(optional, correction, max_errors)
+: BlockingSensorDriver(optional, std::chrono::milliseconds(500), correction, max_errors)
+, disk_(nullptr)
 , device_path_(device_path)
 {
 	set_num_temps(1);
+	set_refresh(refresh_interval_);
+}
+
+
+opt<string> AtasmartSensorDriver::find_drivetemp() const
+{
+	char *real_path = ::realpath(path().c_str(), nullptr);
+	if (!real_path)
+		return nullopt;
+	string dev_name(real_path);
+	::free(real_path);
+	dev_name = dev_name.substr(dev_name.find_last_of('/') + 1);
+
+	HwmonIndex &index = HwmonIndex::instance();
+	for (const string &hwmon_dir : index.dir("/sys/block/" + dev_name + "/device/hwmon").hwmon_dirs) {
+		const HwmonIndex::Dir &dir = index.dir(hwmon_dir);
+		if (dir.name && *dir.name == "drivetemp" && dir.files.count("temp1_input"))
+			return hwmon_dir + "/temp1_input";
+	}
+
+	return nullopt;
 }
 
+
 void AtasmartSensorDriver::init()
 {
-	if (sk_disk_open(path().c_str(), &disk_) < 0) {
-		string msg = std::strerror(errno);
-		throw SystemError("sk_disk_open(" + path() + "): " + msg);
+	opt<string> drivetemp = find_drivetemp();
+	if (drivetemp) {
+		drivetemp_.open(*drivetemp);
+		log(TF_DBG) << path() << ": Using kernel drivetemp sensor " << *drivetemp << "." << flush;
+	}
+	else
+		drivetemp_.close();
+
+	// We only need libatasmart for the sleep check if the kernel can give us the temperature
+	if (disk_) {
+		sk_disk_free(disk_);
+		disk_ = nullptr;
+	}
+	if (!drivetemp_.is_open() || dnd_disk) {
+		if (sk_disk_open(path().c_str(), &disk_) < 0) {
+			disk_ = nullptr;
+			string msg = std::strerror(errno);
+			throw SystemError("sk_disk_open(" + path() + "): " + msg);
+		}
 	}
 }
 
 
 AtasmartSensorDriver::~AtasmartSensorDriver()
-{ sk_disk_free(disk_); }
+{
+	finish();
+	if (disk_)
+		sk_disk_free(disk_);
+}
 
 
-void AtasmartSensorDriver::read_temps_()
+void AtasmartSensorDriver::fetch_temps_(vector<int> &temps)
 {
 	SkBool disk_sleeping = false;
 
@@ -327,7 +575,11 @@ void AtasmartSensorDriver::read_temps_()
 	}
 
 	if (unlikely(disk_sleeping)) {
-		temp_state_.add_temp(0);
+		temps[0] = 0;
+	}
+	else if (drivetemp_.is_open()) {
+		// millidegrees Celsius like any other hwmon temperature
+		temps[0] = drivetemp_.read_int() / 1000 + correction_[0];
 	}
 	else {
 		uint64_t mKelvin;
@@ -349,7 +601,7 @@ void AtasmartSensorDriver::read_temps_()
 			throw SystemError(MSG_T_GET(path()) + std::to_string(tmp) + " isn't a valid temperature.");
 		}
 
-		temp_state_.add_temp(int(tmp) + correction_[0]);
+		temps[0] = int(tmp) + correction_[0];
 	}
 }
 
@@ -368,71 +620,41 @@ string AtasmartSensorDriver::type_name() const
 | nVidia Management Library that is included with the proprietary driver.    |
 ----------------------------------------------------------------------------*/
 
-NvmlSensorDriver::NvmlSensorDriver(string bus_id, bool optional, opt<vector<int>> correction, opt<unsigned int> max_errors)
-: SensorDriver(optional, correction, max_errors),
+NvmlSensorDriver::NvmlSensorDriver(
+	string bus_id,
+	bool optional,
+	opt<vector<int>> correction,
+	opt<unsigned int> max_errors,
+	bool memory_temp
+)
+: BlockingSensorDriver(optional, std::chrono::milliseconds(100), correction, max_errors),
   bus_id_(bus_id),
-  dl_nvmlInit_v2(nullptr),
-  dl_nvmlDeviceGetHandleByPciBusId_v2(nullptr),
-  dl_nvmlDeviceGetName(nullptr),
-  dl_nvmlDeviceGetTemperature(nullptr),
-  dl_nvmlShutdown(nullptr)
+  memory_temp_(memory_temp),
+  nvml_(NvmlInterface::instance())
 {
-	if (!(nvml_so_handle_ = dlopen("libnvidia-ml.so.1", RTLD_LAZY))) {
-		string msg = strerror(errno);
-		throw SystemError("Failed to load libnvidia-ml.so.1: " + msg);
-	}
-
-	/* Apparently GCC doesn't want to cast to function pointers, so we have to do
-	 * this kind of weird stuff.
-	 * See http://stackoverflow.com/questions/1096341/function-pointers-casting-in-c
-	 */
-	*reinterpret_cast<void **>(&dl_nvmlInit_v2) = dlsym(nvml_so_handle_, "nvmlInit_v2");
-	*reinterpret_cast<void **>(&dl_nvmlDeviceGetHandleByPciBusId_v2) = dlsym(
-			nvml_so_handle_, "nvmlDeviceGetHandleByPciBusId_v2");
-	*reinterpret_cast<void **>(&dl_nvmlDeviceGetName) = dlsym(nvml_so_handle_, "nvmlDeviceGetName");
-	*reinterpret_cast<void **>(&dl_nvmlDeviceGetTemperature) = dlsym(nvml_so_handle_, "nvmlDeviceGetTemperature");
-	*reinterpret_cast<void **>(&dl_nvmlShutdown) = dlsym(nvml_so_handle_, "nvmlShutdown");
-
-	if (!(dl_nvmlDeviceGetHandleByPciBusId_v2 && dl_nvmlDeviceGetName &&
-			dl_nvmlDeviceGetTemperature && dl_nvmlInit_v2 && dl_nvmlShutdown))
-		throw SystemError("Incompatible NVML driver.");
-	set_num_temps(1);
+	set_num_temps(memory_temp_ ? 2 : 1);
 }
 
 
 void NvmlSensorDriver::init()
 {
-	nvmlReturn_t ret;
-	string name, brand;
-	name.resize(256);
-	brand.resize(256);
-
-	if ((ret = dl_nvmlInit_v2()))
-		throw SystemError("Failed to initialize NVML driver. Error code (cf. nvml.h): " + std::to_string(ret));
-	if ((ret = dl_nvmlDeviceGetHandleByPciBusId_v2(path().c_str(), &device_)))
-		throw SystemError("Failed to open PCI device " + path() + ". Error code (cf. nvml.h): " + std::to_string(ret));
-	dl_nvmlDeviceGetName(device_, &*name.begin(), 255);
-	log(TF_DBG) << "Initialized NVML sensor on " << name << " at PCI " << path() << "." << flush;
+	size_t device = nvml_->open_device(path(), memory_temp_);
+	if (device_)
+		nvml_->close_device(*device_);
+	device_ = device;
 }
 
 
 NvmlSensorDriver::~NvmlSensorDriver() noexcept(false)
 {
-	nvmlReturn_t ret;
-	if ((ret = dl_nvmlShutdown()))
-		log(TF_ERR) << "Failed to shutdown NVML driver. Error code (cf. nvml.h): " << std::to_string(ret);
-	dlclose(nvml_so_handle_);
+	finish();
+	if (device_)
+		nvml_->close_device(*device_);
 }
 
 
-void NvmlSensorDriver::read_temps_()
-{
-	nvmlReturn_t ret;
-	unsigned int tmp;
-	if ((ret = dl_nvmlDeviceGetTemperature(device_, NVML_TEMPERATURE_GPU, &tmp)))
-		throw SystemError(MSG_T_GET(path()) + "Error code (cf. nvml.h): " + std::to_string(ret));
-	temp_state_.add_temp(int(tmp));
-}
+void NvmlSensorDriver::fetch_temps_(vector<int> &temps)
+{ nvml_->get_temps(*device_, memory_temp_, temps); }
 
 string NvmlSensorDriver::lookup()
 { return bus_id_; }
@@ -458,7 +680,7 @@ LMSensorsDriver::LMSensorsDriver(
 	opt<vector<int>> correction,
 	opt<unsigned int> max_errors
 )
-: SensorDriver(optional, correction, max_errors),
+: BlockingSensorDriver(optional, std::chrono::milliseconds(100), correction, max_errors),
   chip_name_(chip_name),
   feature_names_(feature_names)
 {
@@ -467,7 +689,11 @@ LMSensorsDriver::LMSensorsDriver(
 
 
 LMSensorsDriver::~LMSensorsDriver()
-{}
+{
+	finish();
+	if (libsensors_iface_)
+		libsensors_iface_->remove_client(this);
+}
 
 const string &LMSensorsDriver::chip_name() const
 { return chip_name_; }
@@ -485,7 +711,10 @@ void LMSensorsDriver::init()
 // cost us an additional vtable lookup on every read_temps(), so we choose to manipulate
 // the state here.
 void LMSensorsDriver::set_unavailable()
-{ path_.reset(); }
+{
+	path_.reset();
+	slots_.clear();
+}
 
 
 string LMSensorsDriver::lookup()
@@ -493,9 +722,12 @@ string LMSensorsDriver::lookup()
 	if (!libsensors_iface_)
 		libsensors_iface_ = LibsensorsInterface::instance();
 
+	// We may have been made unavailable while a fetch was still pending
+	discard_fetch();
+
 	// If a sensor is not found, uninit() is called on ALL OTHER LMSensorsDrivers
 	// instances and an exception is thrown.
-	return libsensors_iface_->lookup_client_features(this);
+	return libsensors_iface_->lookup_client_features(this, slots_);
 }
 
 
@@ -503,13 +735,14 @@ string LMSensorsDriver::type_name() const
 { return "libsensors sensor driver"; }
 
 
-void LMSensorsDriver::read_temps_()
+void LMSensorsDriver::fetch_temps_(vector<int> &temps)
 {
 	size_t index = 0;
-	for (double real_value : libsensors_iface_->get_temps(this))
-		temp_state_.add_temp(
-			int(real_value) + correction_[index++]
-		);
+	libsensors_iface_->get_temps(this, slots_, values_);
+	for (double real_value : values_) {
+		temps[index] = int(real_value) + correction_[index];
+		++index;
+	}
 }
 
 
@@ -25,8 +25,10 @@
 #include "thinkfan.h"
 #include "error.h"
 #include "driver.h"
+#include "device_file.h"
 #include "hwmon.h"
 #include "libsensors.h"
+#include "worker_pool.h"
 #include "temperature_state.h"
 
 #ifdef USE_ATASMART
@@ -34,7 +36,7 @@
 #endif /* USE_ATASMART */
 
 #ifdef USE_NVML
-#include <nvidia/gdk/nvml.h>
+#include "nvml.h"
 #endif /* USE_NVML */
 
 
@@ -57,15 +59,38 @@ public:
 	virtual ~SensorDriver() noexcept(false);
 	unsigned int num_temps() const { return *num_temps_; }
 	void set_correction(const vector<int> &correction);
+	const vector<int> &correction() const;
+
+	/// How often this sensor should be read. Follows @a tmp_sleeptime if not set.
+	const opt<milliseconds> &interval() const;
+	void set_interval(milliseconds interval);
+
+	/** @brief Bias the temperatures by their estimated trend instead of the default heuristic,
+	 *  and read this sensor more often while they change quickly (unless it has an
+	 *  @a interval()). */
+	bool predictive() const;
+	void set_predictive(bool predictive);
+
+	/// Lets fans refer to this sensor, cf. @a FanConfig::set_zone(). May be shared by several.
+	const string &id() const;
+	void set_id(const string &id);
+
+	/// When this sensor should be read next based on its trend. Only valid if @a predictive().
+	milliseconds predicted_interval() const;
+
 	bool operator == (const SensorDriver &other) const;
 
+	/// Also copies the @a interval() and @a id(), which @a operator==() doesn't compare.
+	void take_settings(const SensorDriver &other);
+
 	void read_temps();
 	void init_temp_state_ref(TemperatureState::Ref &&);
 
+	/// Start reading temperatures in the background if this is a @a BlockingSensorDriver.
+	virtual void prefetch_temps();
+
 protected:
-	virtual void init() override;
 	void set_num_temps(unsigned int n);
-	static inline int readstream(const string &path);
 	virtual void skip_io_error(const ExpectedError &e) override;
 	virtual void read_temps_() = 0;
 
@@ -76,10 +101,63 @@ protected:
 	 *  @param e The original error */
 private:
 	opt<unsigned int> num_temps_;
+	opt<milliseconds> interval_;
+	bool predictive_;
+	string id_;
 	void check_correction_length();
 };
 
 
+/** @brief Superclass for drivers that have to call into some library that may block for an
+ *  unpredictable amount of time. The actual read is done on a @a WorkerPool thread by
+ *  @a fetch_temps_(), so it can overlap with all other sensor reads. If it isn't finished
+ *  within the driver's deadline, the last temperatures are kept.
+ *  With @a set_refresh(), the fetch runs in the background only every so often, and reads
+ *  never wait (except for the very first one).
+ *  Subclasses must call @a finish() first thing in their destructor. */
+class BlockingSensorDriver : public SensorDriver, protected WorkerPool::Job {
+protected:
+	BlockingSensorDriver(
+		bool optional,
+		std::chrono::milliseconds deadline,
+		opt<vector<int>> correction = nullopt,
+		opt<unsigned int> max_errors = nullopt
+	);
+
+public:
+	virtual void prefetch_temps() override;
+
+	/// Wait for a fetch that may still be running, since init() usually replaces what it uses.
+	virtual void reinit() override;
+
+protected:
+	/** @brief Called on a worker thread. Must not log or touch @a temp_state_.
+	 *  @param temps Buffer with one entry for each of @a num_temps(), to be filled with the
+	 *  final (i.e. corrected) temperatures. */
+	virtual void fetch_temps_(vector<int> &temps) = 0;
+
+	virtual void read_temps_() override;
+
+	/// Fetch new temperatures only every @a interval and return the cached ones in between.
+	void set_refresh(seconds interval);
+
+	/// Ignore the result of a fetch that may still be running, without waiting for it.
+	void discard_fetch();
+
+private:
+	virtual void run() override;
+
+	const std::chrono::milliseconds deadline_;
+	opt<seconds> refresh_;
+	std::chrono::steady_clock::time_point submitted_;
+	bool pending_;
+	bool stale_;
+	bool have_temps_;
+	vector<int> fetched_;
+	std::exception_ptr error_;
+};
+
+
 class HwmonSensorDriver : public SensorDriver {
 public:
 	HwmonSensorDriver(const string &path, bool optional);
@@ -91,6 +169,13 @@ public:
 		opt<unsigned int> max_errors = nullopt
 	);
 
+	virtual ~HwmonSensorDriver() noexcept(false) override;
+
+	/** @brief Same as @a read_temps(), but without a virtual call and without exceptions
+	 *  unless the read fails. Used by the @a SensorScheduler, which knows which sensors are
+	 *  hwmons, since that's what most configs consist of. */
+	void read_temps_fast();
+
 protected:
 	virtual void init() override;
 	virtual void read_temps_() override;
@@ -98,10 +183,38 @@ protected:
 	virtual string type_name() const override;
 
 private:
+	/// The slow path of @a read_temps_fast(): Handle the error like @a read_temps() would.
+	void read_error(int status);
+
+	/// Register the temp*_max_alarm and temp*_crit_alarm attributes (if any) with the @a EventLoop.
+	void watch_alarms();
+	void unwatch_alarms();
+
+	static const char *const alarm_suffixes_[2];
+
 	shared_ptr<HwmonInterface<SensorDriver>> hwmon_interface_;
+	DeviceFile input_;
+	DeviceFile alarms_[2];
 };
 
 
+inline void HwmonSensorDriver::read_temps_fast()
+{
+	if (unlikely(!initialized() || !input_.is_open()))
+		return read_temps();
+
+	ScopedTimer timer(latency_);
+	temp_state_.restart();
+	int value;
+	if (int status = input_.try_read_int(value))
+		read_error(status);
+	else {
+		temp_state_.add_temp(value / 1000 + correction_[0]);
+		op_succeeded();
+	}
+}
+
+
 class TpSensorDriver : public SensorDriver {
 public:
 	TpSensorDriver(
@@ -119,7 +232,12 @@ protected:
 	virtual string type_name() const override;
 
 private:
-	std::char_traits<char>::off_type skip_bytes_;
+	/// Large enough for the 16 temperatures found on newer ThinkPads
+	static constexpr size_t buf_size_ = 256;
+
+	const char *read_buf(char *buf);
+
+	DeviceFile input_;
 	static const string skip_prefix_;
 	vector<bool> in_use_;
 	const opt<vector<unsigned int>> temp_indices_;
@@ -128,55 +246,61 @@ private:
 
 
 #ifdef USE_ATASMART
-class AtasmartSensorDriver : public SensorDriver {
+class AtasmartSensorDriver : public BlockingSensorDriver {
 public:
 	AtasmartSensorDriver(string device_path, bool optional, opt<vector<int>> correction = nullopt, opt<unsigned int> max_errors = nullopt);
 	virtual ~AtasmartSensorDriver();
 
 protected:
 	virtual void init() override;
-	virtual void read_temps_() override;
+	virtual void fetch_temps_(vector<int> &temps) override;
 	virtual string lookup() override;
 	virtual string type_name() const override;
 
 private:
+	/// @return The temp1_input of the kernel's drivetemp hwmon for this disk, if it has one.
+	opt<string> find_drivetemp() const;
+
+	/// How often to actually read S.M.A.R.T. data. Disk temperatures change slowly.
+	static constexpr seconds refresh_interval_ { 60 };
+
 	SkDisk *disk_;
+	DeviceFile drivetemp_;
 	const string device_path_;
 };
 #endif /* USE_ATASMART */
 
 
 #ifdef USE_NVML
-class NvmlSensorDriver : public SensorDriver {
+class NvmlSensorDriver : public BlockingSensorDriver {
 public:
-	NvmlSensorDriver(string bus_id, bool optional, opt<vector<int>> correction = nullopt, opt<unsigned int> max_errors = nullopt);
+	NvmlSensorDriver(
+		string bus_id,
+		bool optional,
+		opt<vector<int>> correction = nullopt,
+		opt<unsigned int> max_errors = nullopt,
+		bool memory_temp = false
+	);
 	virtual ~NvmlSensorDriver() noexcept(false) override;
 
 protected:
 	virtual void init() override;
-	virtual void read_temps_() override;
+	virtual void fetch_temps_(vector<int> &temps) override;
 	virtual string lookup() override;
 	virtual string type_name() const override;
 
 private:
 	const string bus_id_;
-	nvmlDevice_t device_;
-	void *nvml_so_handle_;
-
-	// Pointers to dynamically loaded functions from libnvidia-ml.so
-	nvmlReturn_t (*dl_nvmlInit_v2)();
-	nvmlReturn_t (*dl_nvmlDeviceGetHandleByPciBusId_v2)(const char *, nvmlDevice_t *);
-	nvmlReturn_t (*dl_nvmlDeviceGetName)(nvmlDevice_t, char *, unsigned int);
-	nvmlReturn_t (*dl_nvmlDeviceGetTemperature)(nvmlDevice_t, nvmlTemperatureSensors_t, unsigned int *);
-	nvmlReturn_t (*dl_nvmlShutdown)();
-
+	const bool memory_temp_;
+	shared_ptr<NvmlInterface> nvml_;
+	opt<size_t> device_;
 };
 #endif /* USE_NVML */
 
 
 #ifdef USE_LM_SENSORS
 
-class LMSensorsDriver : public SensorDriver {
+class LMSensorsDriver : public BlockingSensorDriver {
 public:
 	LMSensorsDriver(
 		string chip_name,
@@ -189,11 +313,13 @@ public:
 
 	const string &chip_name() const;
 	const vector<string> &feature_names() const;
+
+	/// Called by the @a LibsensorsInterface with its mutex held, since a fetch may be running.
 	void set_unavailable();
 
 protected:
 	virtual void init() override;
-	virtual void read_temps_() override;
+	virtual void fetch_temps_(vector<int> &temps) override;
 	virtual string lookup() override;
 	virtual string type_name() const override;
 
@@ -201,6 +327,8 @@ private:
 	const string chip_name_;
 	const std::vector<string> feature_names_;
 	shared_ptr<LibsensorsInterface> libsensors_iface_;
+	vector<size_t> slots_;
+	vector<double> values_;
 };
 
 #endif /* USE_LM_SENSORS */
@@ -0,0 +1,281 @@
+/********************************************************************
+ * simd.cpp: Vectorized comparison kernels
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "simd.h"
+
+#include <algorithm>
+
+#if defined(THINKFAN_BENCH)
+#include <climits>
+#include <random>
+#include <vector>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define THINKFAN_SIMD_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define THINKFAN_SIMD_NEON
+#endif
+
+namespace thinkfan {
+namespace simd {
+
+
+/*----------------------------------------------------------------------------
+| Scalar fallback. Also the reference implementation for all the others.     |
+----------------------------------------------------------------------------*/
+
+[[maybe_unused]]
+static bool all_less_scalar(const int16_t *a, const int16_t *b, size_t n)
+{
+	bool rv = true;
+	for (size_t i = 0; i < n; ++i)
+		rv &= a[i] < b[i];
+	return rv;
+}
+
+[[maybe_unused]]
+static int max_value_scalar(const int *v, size_t n)
+{ return *std::max_element(v, v + n); }
+
+
+
+#if defined(THINKFAN_SIMD_X86) && defined(__SSE2__)
+
+/*----------------------------------------------------------------------------
+| SSE2: Always available on x86_64.                                          |
+----------------------------------------------------------------------------*/
+
+static bool all_less_sse2(const int16_t *a, const int16_t *b, size_t n)
+{
+	__m128i acc = _mm_set1_epi16(-1);
+	for (size_t i = 0; i < n; i += 8) {
+		__m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+		__m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+		acc = _mm_and_si128(acc, _mm_cmplt_epi16(va, vb));
+	}
+	return _mm_movemask_epi8(acc) == 0xFFFF;
+}
+
+static int max_value_sse2(const int *v, size_t n)
+{
+	size_t i = 0;
+	int rv = v[0];
+	if (n >= 4) {
+		// No _mm_max_epi32 before SSE4.1, so select via compare & mask
+		__m128i max = _mm_loadu_si128(reinterpret_cast<const __m128i *>(v));
+		for (i = 4; i + 4 <= n; i += 4) {
+			__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(v + i));
+			__m128i gt = _mm_cmpgt_epi32(x, max);
+			max = _mm_or_si128(_mm_and_si128(gt, x), _mm_andnot_si128(gt, max));
+		}
+		alignas(16) int lanes[4];
+		_mm_store_si128(reinterpret_cast<__m128i *>(lanes), max);
+		rv = *std::max_element(lanes, lanes + 4);
+	}
+	for (; i < n; ++i)
+		rv = std::max(rv, v[i]);
+	return rv;
+}
+
+
+/*----------------------------------------------------------------------------
+| AVX2: Selected at runtime, so the rest of the binary stays portable.       |
+----------------------------------------------------------------------------*/
+
+__attribute__((target("avx2")))
+static bool all_less_avx2(const int16_t *a, const int16_t *b, size_t n)
+{
+	__m256i acc = _mm256_set1_epi16(-1);
+	for (size_t i = 0; i < n; i += 16) {
+		__m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+		__m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+		acc = _mm256_and_si256(acc, _mm256_cmpgt_epi16(vb, va));
+	}
+	return _mm256_movemask_epi8(acc) == -1;
+}
+
+__attribute__((target("avx2")))
+static int max_value_avx2(const int *v, size_t n)
+{
+	size_t i = 0;
+	int rv = v[0];
+	if (n >= 8) {
+		__m256i max = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(v));
+		for (i = 8; i + 8 <= n; i += 8)
+			max = _mm256_max_epi32(max, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(v + i)));
+		__m128i m = _mm_max_epi32(_mm256_castsi256_si128(max), _mm256_extracti128_si256(max, 1));
+		m = _mm_max_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+		m = _mm_max_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+		rv = _mm_cvtsi128_si32(m);
+	}
+	for (; i < n; ++i)
+		rv = std::max(rv, v[i]);
+	return rv;
+}
+
+#elif defined(THINKFAN_SIMD_NEON)
+
+/*----------------------------------------------------------------------------
+| NEON: Mandatory on aarch64, so no runtime check needed.                    |
+----------------------------------------------------------------------------*/
+
+static bool all_less_neon(const int16_t *a, const int16_t *b, size_t n)
+{
+	uint16x8_t acc = vdupq_n_u16(0xFFFF);
+	for (size_t i = 0; i < n; i += 8)
+		acc = vandq_u16(acc, vcltq_s16(vld1q_s16(a + i), vld1q_s16(b + i)));
+	return vminvq_u16(acc) == 0xFFFF;
+}
+
+static int max_value_neon(const int *v, size_t n)
+{
+	size_t i = 0;
+	int rv = v[0];
+	if (n >= 4) {
+		int32x4_t max = vld1q_s32(v);
+		for (i = 4; i + 4 <= n; i += 4)
+			max = vmaxq_s32(max, vld1q_s32(v + i));
+		rv = vmaxvq_s32(max);
+	}
+	for (; i < n; ++i)
+		rv = std::max(rv, v[i]);
+	return rv;
+}
+
+#endif
+
+
+
+struct Kernels {
+	bool (*all_less)(const int16_t *, const int16_t *, size_t);
+	int (*max_value)(const int *, size_t);
+	const char *isa;
+};
+
+
+static Kernels select_kernels()
+{
+#if defined(THINKFAN_SIMD_X86) && defined(__SSE2__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return { all_less_avx2, max_value_avx2, "AVX2" };
+	return { all_less_sse2, max_value_sse2, "SSE2" };
+#elif defined(THINKFAN_SIMD_NEON)
+	return { all_less_neon, max_value_neon, "NEON" };
+#else
+	return { all_less_scalar, max_value_scalar, "scalar" };
+#endif
+}
+
+
+static const Kernels kernels = select_kernels();
+
+
+bool all_less(const int16_t *a, const int16_t *b, size_t n)
+{ return kernels.all_less(a, b, n); }
+
+int max_value(const int *v, size_t n)
+{ return kernels.max_value(v, n); }
+
+const char *isa()
+{ return kernels.isa; }
+
+
+
+#if defined(THINKFAN_BENCH)
+
+/*----------------------------------------------------------------------------
+| Self check for thinkfan-bench -S: All kernels must agree with the scalar   |
+| fallback, including the lane that decides all_less on its own and a        |
+| maximum in the tail that doesn't fill a whole vector.                      |
+----------------------------------------------------------------------------*/
+
+static std::vector<Kernels> available_kernels()
+{
+	std::vector<Kernels> rv;
+#if defined(THINKFAN_SIMD_X86) && defined(__SSE2__)
+	rv.push_back({ all_less_sse2, max_value_sse2, "SSE2" });
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		rv.push_back({ all_less_avx2, max_value_avx2, "AVX2" });
+#elif defined(THINKFAN_SIMD_NEON)
+	rv.push_back({ all_less_neon, max_value_neon, "NEON" });
+#endif
+	return rv;
+}
+
+
+std::string self_check()
+{
+	std::mt19937 rng(0x7f);
+	std::uniform_int_distribution<int> small(-4, 4);
+	std::uniform_int_distribution<int> any_int(INT_MIN, INT_MAX);
+	const int16_t extremes[] = { INT16_MIN, INT16_MIN + 1, -1, 0, 1, INT16_MAX - 1, INT16_MAX };
+
+	for (const Kernels &k : available_kernels()) {
+		for (size_t n = 16; n <= 256; n += 16) {
+			std::vector<int16_t> a(n), b(n);
+			for (int round = 0; round < 64; ++round) {
+				// Mostly true, so that a single lane decides the result
+				for (size_t i = 0; i < n; ++i) {
+					a[i] = int16_t(small(rng) * 1000);
+					b[i] = int16_t(a[i] + 1 + (small(rng) & 3));
+				}
+				if (round & 1) {
+					size_t i = rng() % n;
+					b[i] = int16_t(a[i] - (round & 2 ? 0 : 1));
+				}
+				if (round & 4) {
+					size_t i = rng() % n;
+					a[i] = extremes[rng() % 7];
+					b[i] = extremes[rng() % 7];
+				}
+				if (k.all_less(a.data(), b.data(), n) != all_less_scalar(a.data(), b.data(), n))
+					return std::string(k.isa) + " all_less disagrees with the scalar version at n=" + std::to_string(n);
+			}
+		}
+
+		for (size_t n = 1; n <= 67; ++n) {
+			std::vector<int> v(n);
+			for (size_t max_pos = 0; max_pos < n; ++max_pos) {
+				for (int &x : v)
+					x = any_int(rng) / 2;
+				v[max_pos] = max_pos & 1 ? INT_MAX : INT_MAX / 2 + 1;
+				if (k.max_value(v.data(), n) != max_value_scalar(v.data(), n))
+					return std::string(k.isa) + " max_value disagrees with the scalar version at n=" + std::to_string(n);
+			}
+			std::fill(v.begin(), v.end(), INT_MIN);
+			if (k.max_value(v.data(), n) != INT_MIN)
+				return std::string(k.isa) + " max_value fails on INT_MIN at n=" + std::to_string(n);
+		}
+	}
+
+	return {};
+}
+
+#endif // THINKFAN_BENCH
+
+
+} // namespace simd
+} // namespace thinkfan
@@ -0,0 +1,50 @@
+#pragma once
+
+/********************************************************************
+ * simd.h: Vectorized comparison kernels
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace thinkfan {
+namespace simd {
+
+
+/** @brief Check whether a[i] < b[i] for all i < @a n.
+ *  @param n Must be a multiple of 16 (cf. @a LevelTable::lane_width). */
+bool all_less(const int16_t *a, const int16_t *b, size_t n);
+
+/// @return The largest of the @a n > 0 values in @a v.
+int max_value(const int *v, size_t n);
+
+/// For the debug output: Name of the instruction set selected at runtime.
+const char *isa();
+
+#if defined(THINKFAN_BENCH)
+/** @brief Cross-check every kernel set this CPU can run against the scalar one.
+ *  @return A description of the first mismatch, or an empty string if they all agree. */
+std::string self_check();
+#endif
+
+
+} // namespace simd
+} // namespace thinkfan
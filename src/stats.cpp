@@ -0,0 +1,83 @@
+/********************************************************************
+ * stats.cpp: Latency histograms for the main loop and the drivers
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "stats.h"
+
+#include <cmath>
+
+namespace thinkfan {
+
+
+Histogram::Histogram()
+: max_us_(0)
+{
+	for (std::atomic<uint32_t> &b : buckets_)
+		b.store(0, std::memory_order_relaxed);
+}
+
+
+void Histogram::record(duration d)
+{
+	uint64_t us = uint64_t(std::max<int64_t>(
+		std::chrono::duration_cast<std::chrono::microseconds>(d).count(), 0
+	));
+
+	size_t bucket = 0;
+	for (uint64_t v = us; v > 1 && bucket < num_buckets - 1; v >>= 1)
+		++bucket;
+	buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+
+	uint64_t prev = max_us_.load(std::memory_order_relaxed);
+	while (us > prev && !max_us_.compare_exchange_weak(prev, us, std::memory_order_relaxed));
+}
+
+
+uint64_t Histogram::count() const
+{
+	uint64_t rv = 0;
+	for (const std::atomic<uint32_t> &b : buckets_)
+		rv += b.load(std::memory_order_relaxed);
+	return rv;
+}
+
+
+std::chrono::microseconds Histogram::percentile(double p) const
+{
+	uint64_t total = count();
+	if (!total)
+		return std::chrono::microseconds(0);
+
+	uint64_t rank = uint64_t(std::ceil(p * double(total)));
+	uint64_t seen = 0;
+	for (size_t i = 0; i < num_buckets; ++i) {
+		seen += buckets_[i].load(std::memory_order_relaxed);
+		if (seen >= rank)
+			return std::min(std::chrono::microseconds(uint64_t(1) << (i + 1)), max());
+	}
+	return max();
+}
+
+
+std::chrono::microseconds Histogram::max() const
+{ return std::chrono::microseconds(max_us_.load(std::memory_order_relaxed)); }
+
+
+} // namespace thinkfan
@@ -0,0 +1,77 @@
+#pragma once
+
+/********************************************************************
+ * stats.h: Latency histograms for the main loop and the drivers
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "thinkfan.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace thinkfan {
+
+
+/** @brief A fixed-size histogram of durations with power-of-two buckets in microseconds,
+ *  i.e. bucket @a i counts durations in [2^i, 2^(i+1)) µs. Recording is lock-free and
+ *  doesn't allocate, so it can be done from the main loop and from worker threads alike.
+ *  Percentiles are only as exact as the bucket they fall into. */
+class Histogram {
+public:
+	using duration = std::chrono::steady_clock::duration;
+
+	Histogram();
+	Histogram(const Histogram &) = delete;
+
+	void record(duration d);
+
+	uint64_t count() const;
+
+	/// @return The upper bound of the bucket that contains the @a p quantile (0 < @a p <= 1)
+	std::chrono::microseconds percentile(double p) const;
+
+	std::chrono::microseconds max() const;
+
+	static constexpr size_t num_buckets = 32;
+
+private:
+	std::atomic<uint32_t> buckets_[num_buckets];
+	std::atomic<uint64_t> max_us_;
+};
+
+
+/// Record the lifetime of this object in a @a Histogram.
+class ScopedTimer {
+public:
+	ScopedTimer(Histogram &hist)
+	: hist_(hist)
+	, start_(std::chrono::steady_clock::now())
+	{}
+
+	~ScopedTimer()
+	{ hist_.record(std::chrono::steady_clock::now() - start_); }
+
+private:
+	Histogram &hist_;
+	const std::chrono::steady_clock::time_point start_;
+};
+
+
+} // namespace thinkfan
@@ -21,7 +21,9 @@
 
 #include "temperature_state.h"
 #include "error.h"
+#include "simd.h"
 #include <cmath>
+#include <algorithm>
 
 namespace thinkfan {
 
@@ -30,6 +32,8 @@ TemperatureState::TemperatureState(unsigned int num_temps)
 : temps_(num_temps, 0),
   biases_(num_temps, 0),
   biased_temps_(num_temps, 0),
+  slopes_(num_temps, 0),
+  read_times_(num_temps),
   refd_temps_(0),
   tmax(biased_temps_.begin())
 {}
@@ -38,15 +42,23 @@ TemperatureState::Ref::Ref(TemperatureState &ts, unsigned int offset)
 : temp0_(ts.temps_.begin() + offset),
   bias0_(ts.biases_.begin() + offset),
   biased_temp0_(ts.biased_temps_.begin() + offset),
+  slope0_(ts.slopes_.begin() + offset),
+  read_time0_(ts.read_times_.begin() + offset),
   temp_(temp0_),
   bias_(bias0_),
   biased_temp_(biased_temp0_),
-  tstate_(&ts)
+  slope_(slope0_),
+  read_time_(read_time0_),
+  tstate_(&ts),
+  predictive_(false),
+  max_slope_(0)
 {}
 
 
 
 TemperatureState::Ref::Ref()
+: predictive_(false),
+  max_slope_(0)
 {}
 
 void TemperatureState::Ref::restart()
@@ -54,11 +66,34 @@ void TemperatureState::Ref::restart()
 	temp_ = temp0_;
 	bias_ = bias0_;
 	biased_temp_ = biased_temp0_;
+	slope_ = slope0_;
+	read_time_ = read_time0_;
+	if (predictive_) {
+		now_ = clock::now();
+		max_slope_ = 0;
+	}
+}
+
+
+void TemperatureState::Ref::set_predictive(bool predictive)
+{ predictive_ = predictive; }
+
+
+milliseconds TemperatureState::Ref::interval() const
+{
+	static constexpr milliseconds min_interval { 100 };
+
+	if (max_slope_ * secondsf(sleeptime).count() <= 1)
+		return sleeptime;
+	return std::max(min_interval, milliseconds(std::lround(1000 / max_slope_)));
 }
 
 
 void TemperatureState::Ref::add_temp(int t)
 {
+	if (unlikely(predictive_))
+		return add_predicted_temp(t);
+
 	int diff = *temp_ > 0 ?
 		t - *temp_
 		: 0;
@@ -74,7 +109,7 @@ void TemperatureState::Ref::add_temp(int t)
 	else {
 		// Slowly return to normal sleeptime
 		if (unlikely(tmp_sleeptime < sleeptime))
-			tmp_sleeptime++;
+			tmp_sleeptime = std::min(sleeptime, tmp_sleeptime + seconds(1));
 		// slowly reduce the bias_
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wfloat-equal" // bias is set to 0 explicitly
@@ -89,17 +124,41 @@ void TemperatureState::Ref::add_temp(int t)
 
 	*biased_temp_ = *temp_ + int(*bias_);
 
-	if (*biased_temp_ > *tstate_->tmax)
-		tstate_->tmax = biased_temp_;
+	skip_temp();
+}
+
+void TemperatureState::Ref::add_predicted_temp(int t)
+{
+	// EWMA of the slope, weighted by the time since the last reading so it doesn't depend
+	// on how often the sensor is read. A time constant of a few readings at the default
+	// sleeptime filters out the 1 °C jitter of most sensors.
+	static constexpr float time_constant = 15;
+
+	float dt = std::chrono::duration<float>(now_ - *read_time_).count();
+	if (*temp_ > 0 && dt > 0) {
+		float alpha = 1 - std::exp(-dt / time_constant);
+		*slope_ += alpha * (float(t - *temp_) / dt - *slope_);
+	}
+	*read_time_ = now_;
+	*temp_ = t;
+	max_slope_ = std::max(max_slope_, std::abs(*slope_));
+
+	// Predict one sleeptime ahead, but only to ramp up early. Falling temperatures are
+	// left to the hysteresis of the fan levels.
+	*bias_ = std::max(0.f, *slope_ * float(secondsf(sleeptime).count()));
+	*biased_temp_ = *temp_ + int(*bias_);
 
 	skip_temp();
 }
 
+
 void TemperatureState::Ref::skip_temp()
 {
 	++temp_;
 	++bias_;
 	++biased_temp_;
+	++slope_;
+	++read_time_;
 }
 
 
@@ -113,10 +172,75 @@ const vector<int> & TemperatureState::temps() const
 const vector<float> & TemperatureState::biases() const
 { return biases_; }
 
+const vector<float> & TemperatureState::slopes() const
+{ return slopes_; }
+
 void TemperatureState::reset_refd_count()
 { refd_temps_ = 0; }
 
 
+void TemperatureState::copy(const TemperatureState &other, unsigned int from, unsigned int to, unsigned int count)
+{
+	if (from + count > other.temps_.size() || to + count > temps_.size())
+		throw Bug(string(__func__) + ": temperature range out of bounds");
+
+	std::copy_n(other.temps_.begin() + from, count, temps_.begin() + to);
+	std::copy_n(other.biases_.begin() + from, count, biases_.begin() + to);
+	std::copy_n(other.biased_temps_.begin() + from, count, biased_temps_.begin() + to);
+	std::copy_n(other.slopes_.begin() + from, count, slopes_.begin() + to);
+	std::copy_n(other.read_times_.begin() + from, count, read_times_.begin() + to);
+}
+
+void TemperatureState::update_tmax()
+{
+	if (unlikely(biased_temps_.empty()))
+		return;
+	int max = simd::max_value(biased_temps_.data(), biased_temps_.size());
+	tmax = std::find(biased_temps_.cbegin(), biased_temps_.cend(), max);
+}
+
+
+TemperatureZone::TemperatureZone()
+: all_(true),
+  offset_(0),
+  size_(0)
+{}
+
+
+void TemperatureZone::assign(const vector<unsigned int> &indices, unsigned int num_temps)
+{
+	indices_.clear();
+	offset_ = indices.empty() ? 0 : indices.front();
+	size_ = long(indices.size());
+	all_ = indices.size() == num_temps;
+	if (!indices.empty() && indices.back() - indices.front() + 1 != indices.size())
+		indices_ = indices;
+}
+
+
+unsigned int TemperatureZone::size() const
+{ return static_cast<unsigned int>(size_); }
+
+
+bool TemperatureZone::covers_all() const
+{ return all_; }
+
+
+int TemperatureZone::tmax(const TemperatureState &ts) const
+{
+	if (all_)
+		return *ts.tmax;
+	if (indices_.empty())
+		return simd::max_value(ts.biased_temps().data() + offset_, size_t(size_));
+
+	int rv = numeric_limits<int>::min();
+	for (unsigned int i : indices_)
+		rv = std::max(rv, ts.biased_temps()[i]);
+	return rv;
+}
+
+
+
 TemperatureState::Ref TemperatureState::ref(unsigned int num_temps)
 {
 	if (refd_temps_ + num_temps > temps_.size())
@@ -23,6 +23,8 @@
 
 #include "thinkfan.h"
 
+#include <algorithm>
+
 namespace thinkfan {
 
 
@@ -31,6 +33,8 @@ public:
 	template<typename T>
 	using Iter = typename vector<T>::iterator;
 
+	using clock = std::chrono::steady_clock;
+
 	class Ref {
 	public:
 		Ref();
@@ -38,19 +42,38 @@ public:
 		void skip_temp();
 		void restart();
 
+		/** @brief Instead of the default heuristic, estimate the trend of each temperature and
+		 *  bias it by where it will be after @a sleeptime. The global @a tmp_sleeptime is left
+		 *  alone, see @a interval() instead. */
+		void set_predictive(bool predictive);
+
+		/// How long until the fastest changing temperature is expected to change by one
+		/// degree, between 100 ms and @a sleeptime. Only meaningful if predictive.
+		milliseconds interval() const;
+
 	private:
 		friend TemperatureState;
 		Ref(TemperatureState &ts, unsigned int offset);
 
+		void add_predicted_temp(int t);
+
 		Iter<int> temp0_;
 		Iter<float> bias0_;
 		Iter<int> biased_temp0_;
+		Iter<float> slope0_;
+		Iter<clock::time_point> read_time0_;
 
 		Iter<int> temp_;
 		Iter<float> bias_;
 		Iter<int> biased_temp_;
+		Iter<float> slope_;
+		Iter<clock::time_point> read_time_;
 
 		TemperatureState *tstate_;
+
+		bool predictive_;
+		clock::time_point now_;
+		float max_slope_;
 	};
 
 	TemperatureState(unsigned int num_temps);
@@ -63,10 +86,21 @@ public:
 
 	void reset_refd_count();
 
+	/// Take over @a count temperatures and biases from @a other, starting at @a from, to @a to.
+	void copy(const TemperatureState &other, unsigned int from, unsigned int to, unsigned int count);
+
+	/// Re-evaluate @a tmax. Must be called after reading (some of) the sensors.
+	void update_tmax();
+
+	/// Estimated rate of change of each temperature in °C/s (predictive sensors only)
+	const vector<float> &slopes() const;
+
 private:
 	vector<int> temps_;
 	vector<float> biases_;
 	vector<int> biased_temps_;
+	vector<float> slopes_;
+	vector<clock::time_point> read_times_;
 	unsigned int refd_temps_;
 
 public:
@@ -74,4 +108,41 @@ public:
 };
 
 
+/** @brief The temperatures that a fan depends on, as indices into a @a TemperatureState.
+ *  Zones usually consist of adjacent sensor entries, so contiguous ones are kept as a plain
+ *  range and only scattered ones need an index list. By default, a zone covers everything. */
+class TemperatureZone {
+public:
+	TemperatureZone();
+
+	/// @param indices Ascending indices of the temperatures in this zone
+	/// @param num_temps Total number of temperatures, so we can tell if it's all of them
+	void assign(const vector<unsigned int> &indices, unsigned int num_temps);
+
+	unsigned int size() const;
+	bool covers_all() const;
+
+	/// Highest biased temperature in the zone
+	int tmax(const TemperatureState &ts) const;
+
+	/// Copy the zone's biased temperatures to @a out, transformed by @a f
+	template<class OutIter, class F>
+	void transform(const TemperatureState &ts, OutIter out, F f) const
+	{
+		const vector<int> &bt = ts.biased_temps();
+		if (indices_.empty())
+			std::transform(bt.begin() + offset_, bt.begin() + offset_ + size_, out, f);
+		else
+			for (unsigned int i : indices_)
+				*out++ = f(bt[i]);
+	}
+
+private:
+	bool all_;
+	long offset_;
+	long size_;
+	vector<unsigned int> indices_; ///< Empty if contiguous
+};
+
+
 } // namespace thinkfan
@@ -8,6 +8,11 @@ thinkfan \- A simple fan control program
 .OP \-c CONFIG
 .OP \-s SECONDS
 .OP \-p \fR[\fIDELAY\fR]\fI
+.OP \-m ADDRESS
+.OP \-r FILE
+.OP \-l NAME
+.OP \-H FILE
+.OP \-S PATH
 .YS
 
 
@@ -120,7 +125,9 @@ Show a short help message
 
 .TP
 .BI \-s " SECONDS"
-Maximum seconds between temperature updates (default: 5)
+Maximum seconds between temperature updates (default: 5).
+Fractions down to 0.1 are allowed, e.g. for hardware that heats up within a
+second.
 
 .TP
 .BI \-b " BIAS"
@@ -191,6 +198,115 @@ displayed/logged.
 Use the pulsing\-fan workaround (for older Thinkpads). Takes an optional
 floating\-point argument (0\-10s) as depulsing duration. Default 0.5s.
 
+.TP
+.BI \-m " ADDRESS"
+Serve the current temperatures, biases, fan levels and driver error counts in
+OpenMetrics (Prometheus) text format over HTTP.
+.I ADDRESS
+is either the absolute path of a UNIX socket (e.g.
+.IR /run/thinkfan.metrics ,
+which can be scraped with
+.BR "curl \-\-unix\-socket /run/thinkfan.metrics http://localhost/metrics" )
+or
+.IR HOST : PORT
+for a TCP socket. Scrapes are served from a separate thread and never delay the
+fan control loop.
+
+.TP
+.BI \-r " FILE"
+Record every set of temperatures that is evaluated to
+.I FILE
+in a compact binary format. The recording can be replayed against a different
+config or bias with
+.BR thinkfan\-bench ,
+which is built when thinkfan is configured with \-D BUILD_BENCH=ON.
+
+.TP
+.BI \-l " NAME"
+Publish the sensors, temperatures and fan speeds in the POSIX shared memory
+segment
+.I NAME
+(e.g.
+.IR /thinkfan ,
+i.e. /dev/shm/thinkfan), updated on every cycle.
+Local programs can map it read\-only and take consistent snapshots without any
+syscalls or reading the sensors again.
+The layout is described in the C header
+.IR thinkfan_shm.h ,
+which is installed along with thinkfan.
+The segment is removed when thinkfan exits.
+
+.TP
+.BI \-H " FILE"
+Keep a history of all temperatures, biases and fan levels in
+.IR FILE ,
+one sample per cycle. The samples are delta\-compressed, so an unchanged sample
+takes only two bytes, and writing them makes no syscalls. The file is a ring
+buffer: Once it's full, the oldest samples are overwritten. A new file is
+created with 4 MiB, an existing one keeps its size, so preallocate it with e.g.
+.B truncate \-s 64M
+to keep more. After a restart, thinkfan continues where it left off.
+Use
+.B thinkfan\-dump
+.I FILE
+to print the history as CSV.
+
+.TP
+.BI \-S " PATH"
+Accept commands on the UNIX socket
+.IR PATH ,
+which only root can connect to. Each command is a single line, and each is
+answered with zero or more lines of data followed by a line that starts with
+.B OK
+or
+.BR ERR .
+Changes take effect immediately and don't reload anything. The commands are:
+.RS
+.TP
+.BI "pin " "FAN LEVEL SECONDS"
+Set
+.I FAN
+(its index in the config, counting from 0, or its path) to
+.I LEVEL
+(e.g. 5, level auto or a PWM value), no matter what the temperatures are, for
+at most
+.I SECONDS
+(up to 86400).
+.TP
+.BI "unpin " FAN
+Return
+.I FAN
+to automatic control before its pin expires.
+.TP
+.BI "bias " BIAS
+.TQ
+.BI "sleeptime " SECONDS
+Change what the
+.B \-b
+or
+.B \-s
+option has set.
+.TP
+.BI "reinit fan " FAN
+.TQ
+.BI "reinit sensor " SENSOR
+Reopen and re-initialize a single driver, e.g. after its device was reset.
+.I SENSOR
+is its index, id or path.
+.TP
+.BI "tolerate " N
+Allow sensor read errors for the next
+.I N
+loops, like SIGPWR does for 4.
+.TP
+.B status
+Show the current settings, the drivers and their error counts, the fan speeds
+and any pins.
+.RE
+.IP
+For example:
+.B echo \(dqpin 0 level 7 30\(dq | socat \- UNIX\-CONNECT:/run/thinkfan.sock
+
 .TP
 .B \-d
 Do not read temperature from sleeping disks. Instead, 0 \[char176]C is used as that
@@ -213,23 +329,30 @@ config, we keep the old one.
 .P
 SIGUSR1 causes thinkfan to dump all currently known temperatures either to
 syslog, or to the console (if running with the \-n option).
+It also dumps timing statistics (median, 99th percentile and maximum) of the
+main loop and of each sensor and fan, along with the number of errors each
+of them has had since startup.
+.P
+Thinkfan notices by itself when the system has resumed from suspend or
+hibernation. It then immediately re\-initializes all fans, since most fan
+drivers reset fan control to automatic mode on wakeup. It also re\-opens all
+sensors, which may have been re\-created, and reads them right away. A sensor
+that isn't available again yet keeps its last temperature for up to 4 failed
+reads, but only until it can be read again. The other sensors get no such
+leeway.
 .P
 SIGPWR tells thinkfan that the system is about to go to sleep. Thinkfan will
-then allow sensor read errors for the next 4 loops because many sensors will
-take a few seconds before they are available again after waking up from a
-sleep state (suspend or hibernate). If the shipped systemd service file
-.B thinkfan-sleep.service
-is installed, it should take care of sending this singal when going to sleep.
-On non-systemd distributions, other mechanisms may have to be used.
+then allow sensor read errors for the next 4 loops. Since resumes are detected
+automatically, this is only needed if something else makes the sensors
+unavailable for a while.
 .P
-SIGUSR2 tells thinkfan to re-initialize fan control. This is required by most
-fan drivers after waking up from suspend because they tend to reset fan
-control to automatic mode on wakeup. Similar to SIGPWR, the systemd service
-file
-.B thinkfan-wakeup.service
-should take care of sending this signal on wakeup on systemd systems. On
-non-systemd distributions, other mechanisms may have to be used.
-
+SIGUSR2 tells thinkfan to re\-initialize fan control, e.g. after something other
+than a resume has reset the fan driver. The shipped systemd service files
+.B thinkfan\-sleep.service
+and
+.B thinkfan\-wakeup.service
+send SIGPWR and SIGUSR2 around a suspend, which does no harm but isn't
+necessary anymore.
 
 .SH RETURN VALUE
 
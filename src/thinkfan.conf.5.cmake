@@ -102,6 +102,7 @@ The syntax for identifying each type of sensors looks as follows:
 \f[CB]    indices: \f[CI]index-list\f[CR]        # Optional entry
 
 \f[CB]  \- nvml: \f[CI]nvml-bus-id\f[CR]          # Uses the proprietary nVidia driver
+\f[CB]    memory_temp: \f[CI]bool-memory-temp\f[CR] # Optional entry
 
 \f[CB]  \- atasmart: \f[CI]disk-device-file\f[CR] # Requires libatasmart support
 
@@ -120,6 +121,9 @@ behavior:
 \f[CB]    correction: \f[CI]correction-list\f[CR]  # Optional entry
 \f[CB]    optional: \f[CI]bool-ignore-errors\f[CR] # Optional entry
 \f[CB]    max_errors: \f[CI]num-max-errors\f[CR]   # Optional entry
+\f[CB]    interval: \f[CI]poll-interval\f[CR]      # Optional entry
+\f[CB]    predict: \f[CI]bool-predict\f[CR]        # Optional entry
+\f[CB]    id: \f[CI]sensor-id\f[CR]                # Optional entry
 \fR
 .fi
 
@@ -161,6 +165,9 @@ under the \fBlevels:\fR keyword:
 \f[CB]    optional: \f[CI]bool-ignore-errors\f[CR] # Optional entry
 \f[CB]    max_errors: \f[CI]num-max-errors\f[CR]   # Optional entry
 \f[CB]    levels: \f[CI]levels-section\f[CR]       # Optional entry
+\f[CB]    curve: \f[CI]curve-section\f[CR]         # Optional, hwmon only
+\f[CB]    max_step: \f[CI]pwm-per-second\f[CR]     # Optional, requires curve
+\f[CB]    sensors: \f[CI]sensor-id-list\f[CR]      # Optional entry
 
 
 .SS Values
@@ -298,6 +305,14 @@ Usually, nVidia cards will use the open source
 .B nouveau
 driver, which should support hwmon sensors instead.
 
+.TP
+.IR bool-memory-temp " (optional, \fBfalse\fR by default)"
+If \fBtrue\fR, an
+.B nvml
+sensor provides two temperatures: the GPU core followed by the memory
+(e.g. the memory junction temperature on GDDR6X cards).
+Requires a driver that supports NVML field values.
+
 .TP
 .I disk-device-file
 NOTE: only available if thinkfan was compiled with USE_ATASMART enabled.
@@ -310,6 +325,13 @@ option in
 that prevents thinkfan from waking up sleeping (mechanical) disks to read their
 temperature.
 
+S.M.A.R.T. data is read in the background at most once a minute, so a slow disk
+doesn't hold up the other sensors.
+If the kernel's
+.B drivetemp
+module provides a hwmon sensor for the disk, thinkfan reads that instead of
+going through libatasmart.
+
 .TP
 .IR correction-list " (optional, zeroes by default)"
 A YAML list that specifies temperature offsets for each sensor in use by the
@@ -348,6 +370,33 @@ When a device with a positive \fInum-max-errors\fR fails during runtime,
 thinkfan will likewise attempt to re-initialize it the given number of times
 before failing.
 
+.TP
+.IR poll-interval " (optional, follows the global cycle time by default)"
+A number of seconds (at least 0.1) that thinkfan waits between two reads of a
+given sensor.
+By default, sensors are read on every cycle, i.e. every \fB-s\fR seconds or
+more often while temperatures are rising quickly.
+Sensors that change slowly (e.g. hard disks) can be given a longer interval to
+save I/O.
+A sensor that has not been read in a cycle keeps its last temperature.
+The fan speed is only re-evaluated when at least one temperature has changed.
+
+.TP
+.IR bool-predict " (optional, default false)"
+Instead of the heuristic controlled by \fB-b\fR, estimate how fast each
+temperature of this sensor is changing and add what it would rise by within one
+cycle.
+This makes the fans react to a steady climb before it crosses a level boundary,
+while a single spike that isn't followed up has little effect.
+Unless it has a \fIpoll-interval\fR, the sensor is also read more often while its
+temperatures change quickly (at most every 100 ms), without affecting the
+other sensors.
+
+.TP
+.IR sensor-id " (optional)"
+A name that fans can refer to in their \fIsensor-id-list\fR.
+Several sensor entries can have the same id to be referred to as a group.
+
 .TP
 .IR levels-section " (optional, use global levels section by default)"
 As of thinkfan 2.0, multiple fans can be configured.
@@ -360,6 +409,43 @@ value(s) refer only the fans configured in that particular \fBfans:\fR entry.
 NOTE: Global and fan-specific \fBlevels:\fR are mutually exclusive, i.e.
 there cannot be both a global one and fan-specific sections.
 
+.TP
+.IR curve-section " (optional, hwmon fans only)"
+Instead of discrete \fBlevels:\fR, a PWM fan can follow a curve of
+\fB[\fItemperature\fB, \fIpwm\fB]\fR points:
+
+.nf
+\fC
+\f[CB]    curve:
+\f[CB]      \- [\f[CI]temp1\f[CB], \f[CI]pwm1\f[CB]]
+\f[CB]      \- [\f[CI]temp2\f[CB], \f[CI]pwm2\f[CB]]
+\f[CB]      \- \f[CR]...
+\fR
+.fi
+
+The temperatures must be strictly increasing and the PWM values must be
+between 0 and 255.
+Between two points, the PWM value is interpolated linearly from the highest
+temperature.
+Below the first and above the last point, the fan stays at the first and last
+PWM value, respectively.
+A \fBcurve:\fR section cannot be combined with a \fBlevels:\fR section.
+
+.TP
+.IR pwm-per-second " (optional, unlimited by default)"
+A positive integer that limits how fast the PWM value of a \fBcurve:\fR fan
+may change, in both directions.
+
+.TP
+.IR sensor-id-list " (optional, all sensors by default)"
+A list of \fIsensor-id\fRs that this fan depends on, e.g.
+\fB[cpu, gpu]\fR.
+The fan's levels or curve then only look at the temperatures of these
+sensors, so the limits in a detailed \fBlevels:\fR section need one entry for
+each of their temperatures only (in the order of the \fBsensors:\fR section).
+The fan is only re-evaluated when one of its sensors has changed, and other
+sensors can be added without touching its levels.
+
 
 .SH FAN SPEEDS
 
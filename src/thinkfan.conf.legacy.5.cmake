@@ -240,6 +240,20 @@ The optional commas have been omitted here for readability, and the curly
 braces are interchangeable with round braces.
 Note that it is not possible to mix simple fan levels with complex fan levels.
 .P
+Instead of a temperature, a bound may contain a single period
+(\fB.\fR), which stands for a temperature that is never reached.
+In an
+.IR upper-bound ,
+this means that the corresponding temperature never causes the next fan level
+to be selected.
+Periods are only accepted in complex mode.
+.P
+In both modes, the values of a fan level can be separated by any combination of
+commas, blanks, line breaks and comments, and a comma may follow the last value
+of a level or bound, e.g. \fB(0, 0, 55, )\fR.
+Versions up to 2.0.0 rejected a period or a closing brace that follows a comma
+and a blank, e.g. \fB(60, .)\fR or \fB(45, )\fR.
+.P
 Complex mode is generally the preferred mode of operation since it allows you
 to specify precisely what the fan should to to keep each component within its
 specified temperature range.
@@ -43,6 +43,13 @@
 #include "sensors.h"
 #include "fans.h"
 #include "temperature_state.h"
+#include "scheduler.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "trace.h"
+#include "live_state.h"
+#include "control.h"
+#include "history.h"
 
 
 namespace thinkfan {
@@ -50,16 +57,13 @@ namespace thinkfan {
 bool chk_sanity(true);
 bool quiet(false);
 bool daemonize(true);
-seconds sleeptime(5);
-seconds tmp_sleeptime = sleeptime;
+milliseconds sleeptime(seconds(5));
+milliseconds tmp_sleeptime = sleeptime;
 float bias_level(0);
 float depulse = 0;
 TemperatureState temp_state(0);
 std::atomic<unsigned char> tolerate_errors(0);
 
-std::condition_variable sleep_cond;
-std::mutex sleep_mutex;
-
 #ifdef USE_YAML
 vector<string> config_files { DEFAULT_YAML_CONFIG, DEFAULT_CONFIG };
 #else
@@ -67,6 +71,15 @@ vector<std::string> config_files { DEFAULT_CONFIG };
 #endif
 
 std::atomic<int> interrupted(0);
+opt<string> metrics_address;
+opt<string> trace_file;
+opt<string> shm_name;
+opt<string> control_socket;
+opt<string> history_file;
+
+// For SIGUSR1: Timing of complete main loop iterations and the config that's being run
+static Histogram loop_latency;
+static const Config *running_config = nullptr;
 
 #ifdef USE_ATASMART
 /** Do Not Disturb disk, i.e. don't get temperature from a sleeping disk */
@@ -123,13 +136,26 @@ void PidFileHolder::cleanup()
 #endif // defined(PID_FILE)
 
 
-void sleep(thinkfan::seconds duration) {
-	auto until = std::chrono::steady_clock::now() + duration;
+void sleep(thinkfan::milliseconds duration)
+{ sleep_until(std::chrono::steady_clock::now() + duration); }
+
+
+void sleep_until(std::chrono::steady_clock::time_point until)
+{ EventLoop::instance().wait_until(until); }
+
 
-	std::unique_lock<std::mutex> sleep_locked(sleep_mutex);
-	sleep_cond.wait_until(sleep_locked, until, [] () {
-		return interrupted != 0;
-	} );
+static void log_stats(const Config &config)
+{
+	log(TF_NFY) << "Main loop: " << loop_latency << flush;
+	for (const unique_ptr<SensorDriver> &sensor : config.sensors())
+		log(TF_NFY) << sensor->name() << ": " << sensor->latency()
+			<< " errors=" << sensor->total_errors() << flush;
+	for (const unique_ptr<FanConfig> &fan_cfg : config.fan_configs()) {
+		const FanDriver &fan = *fan_cfg->fan();
+		log(TF_NFY) << fan.name() << ": " << fan.latency()
+			<< " errors=" << fan.total_errors() << flush;
+		log(TF_NFY) << fan.name() << " level evaluation: " << fan_cfg->eval_latency() << flush;
+	}
 }
 
 
@@ -139,10 +165,11 @@ void sig_handler(int signum) {
 	case SIGINT:
 	case SIGTERM:
 		interrupted = signum;
-		sleep_cond.notify_all();
 		break;
 	case SIGUSR1:
 		log(TF_NFY) << temp_state << flush;
+		if (running_config)
+			log_stats(*running_config);
 		break;
 #ifndef DISABLE_BUGGER
 	case SIGSEGV:
@@ -151,7 +178,6 @@ void sig_handler(int signum) {
 #endif
 	case SIGUSR2:
 		interrupted = signum;
-		sleep_cond.notify_all();
 		log(TF_NFY) << "Received SIGUSR2: Re-initializing fan control." << flush;
 		break;
 	case SIGPWR:
@@ -162,45 +188,241 @@ void sig_handler(int signum) {
 }
 
 
-void run(const Config &config)
+void read_sensors(const Config &config)
 {
-	tmp_sleeptime = sleeptime;
+	// Get the slow ones going first so they can do their thing while we read the rest
+	for (const unique_ptr<SensorDriver> &sensor : config.sensors())
+		sensor->prefetch_temps();
 
 	for (const unique_ptr<SensorDriver> &sensor : config.sensors())
 		sensor->read_temps();
 
+	temp_state.update_tmax();
+}
+
+
+/** @brief Called right after a resume from suspend, which usually resets the fans to automatic
+ *  mode and may re-create some sensor devices. Instead of waiting for a write error or reading
+ *  from a stale file descriptor, re-initialize every driver now and read all sensors in the
+ *  same loop. Only drivers that aren't back yet may fail a few times more. */
+static void resume(const Config &config, SensorScheduler &scheduler, seconds suspended)
+{
+	log(TF_NFY) << MSG_RESUMED(std::to_string(suspended.count())) << flush;
+
+	for (const unique_ptr<FanConfig> &fan_cfg : config.fan_configs()) {
+		fan_cfg->fan()->set_grace(4);
+		fan_cfg->fan()->reinit();
+	}
+	for (const unique_ptr<SensorDriver> &sensor : config.sensors()) {
+		const unsigned int num_temps = sensor->available() ? sensor->num_temps() : 0;
+		sensor->set_grace(4);
+		sensor->reinit();
+		// The temperature state can't change its layout under the running config
+		if (sensor->initialized() && sensor->num_temps() != num_temps)
+			interrupted = SIGHUP;
+	}
+	scheduler.expedite_all();
+}
+
+
+/** @brief Remember the current level of each fan so @a log_transition() can tell which ones
+ *  changed. These are copies, since a pin that expires in between takes its level with it.
+ *  The strings keep their capacity, so this doesn't allocate once the levels have been seen. */
+static void save_levels(const Config &config, vector<string> &levels)
+{
+	levels.resize(config.fan_configs().size());
+	for (size_t i = 0; i < levels.size(); ++i)
+		levels[i].assign(config.fan_configs()[i]->fan()->current_speed());
+}
+
+
+/** @brief Log a change of fan levels. If we're running under journald and @a old_levels
+ *  have been saved, send a structured entry for every fan that has changed instead of
+ *  formatting the usual text line. */
+static void log_transition(const Config &config, const vector<string> &old_levels)
+{
+	if (!Logger::instance().journal(TF_NFY) || old_levels.size() != config.fan_configs().size()) {
+		log(TF_NFY) << temp_state << " -> " << config.fan_configs() << flush;
+		return;
+	}
+
+	for (size_t i = 0; i < old_levels.size(); ++i) {
+		const FanDriver &fan = *config.fan_configs()[i]->fan();
+		if (old_levels[i] == fan.current_speed())
+			continue;
+
+		string fields;
+		auto add_field = [&fields] (const char *name, const string &value) {
+			fields += name;
+			fields += '=';
+			fields += value;
+			fields += '\0';
+		};
+		add_field("MESSAGE_ID", MSG_ID_FAN_LEVEL);
+		add_field("MESSAGE", MSG_FAN_LEVEL_CHANGED);
+		add_field("THINKFAN_FAN", fan.path());
+		add_field("THINKFAN_LEVEL_OLD", old_levels[i]);
+		add_field("THINKFAN_LEVEL_NEW", fan.current_speed());
+		// Repeated fields keep their order, so the n-th bias belongs to the n-th temperature
+		for (int temp : temp_state.temps())
+			add_field("THINKFAN_TEMPERATURE", std::to_string(temp));
+		for (float bias : temp_state.biases())
+			add_field("THINKFAN_BIAS", std::to_string(bias));
+		Logger::instance().send_fields(TF_NFY, fields);
+	}
+}
+
+
+void run(const Config &config)
+{
+	tmp_sleeptime = sleeptime;
+	MetricsExporter *metrics = MetricsExporter::instance();
+	if (metrics)
+		metrics->set_config(config);
+	LiveState *live_state = LiveState::instance();
+	if (live_state)
+		live_state->set_config(config);
+	TraceWriter *trace = TraceWriter::instance();
+	HistoryWriter *history = HistoryWriter::instance();
+
+	read_sensors(config);
+	if (trace)
+		trace->record(temp_state, std::chrono::steady_clock::now());
+
+	// Only needed for structured logging
+	const bool journal = Logger::instance().journal(TF_NFY);
+	vector<string> old_levels;
+
 	// Set initial fan level
 	for (auto &fan_config : config.fan_configs())
 		fan_config->init_fanspeed(temp_state);
-	log(TF_NFY) << temp_state << " -> " << config.fan_configs() << flush;
+	if (journal)
+		save_levels(config, old_levels);
+	config.commit_fans();
+	if (metrics)
+		metrics->publish(config, temp_state);
+	if (live_state)
+		live_state->publish(config, temp_state);
+	if (history)
+		history->record(config, temp_state);
+	log_transition(config, old_levels);
+
+	SensorScheduler scheduler(config, temp_state);
+	auto last_tick = std::chrono::steady_clock::now();
+
+	// Don't let SIGUSR1 or the control socket see the config after we've returned, e.g. while
+	// it's being replaced
+	struct ConfigRef {
+		ConfigRef(const Config &c) {
+			running_config = &c;
+			if (ControlServer::instance())
+				ControlServer::instance()->set_config(&c);
+		}
+		~ConfigRef() {
+			running_config = nullptr;
+			if (ControlServer::instance())
+				ControlServer::instance()->set_config(nullptr);
+		}
+	} config_ref(config);
 
 	bool did_something = false;
 	while (likely(!interrupted)) {
-		sleep(tmp_sleeptime);
+		// Wake up at least every tmp_sleeptime, even if no sensor is due, so the fan
+		// watchdog and depulsing keep working.
+		bool alarm = EventLoop::instance().wait_until(
+			std::min(scheduler.next_due(), last_tick + tmp_sleeptime)
+		);
 
 		if (unlikely(interrupted))
 			break;
 
-		for (const unique_ptr<SensorDriver> &sensor : config.sensors())
-			sensor->read_temps();
+		if (unlikely(alarm)) {
+			for (SensorDriver *sensor : EventLoop::instance().alarmed())
+				scheduler.expedite(sensor);
+		}
+
+		if (unlikely(EventLoop::instance().suspended() > EventLoop::clock::duration::zero())) {
+			resume(config, scheduler, std::chrono::duration_cast<seconds>(EventLoop::instance().suspended()));
+			if (unlikely(interrupted))
+				break;
+		}
+
+		last_tick = std::chrono::steady_clock::now();
+		ScopedTimer timer(loop_latency);
+		bool temps_changed = scheduler.poll(last_tick);
+		if (trace && temps_changed)
+			trace->record(temp_state, last_tick);
 
 		if (unlikely(tolerate_errors) > 0)
 			tolerate_errors--;
 
-		for (auto &fan_config : config.fan_configs())
-			did_something |= fan_config->set_fanspeed(temp_state);
+		for (auto &fan_config : config.fan_configs()) {
+			if (temps_changed && fan_config->inputs_changed(scheduler.changed_sensors()))
+				did_something |= fan_config->set_fanspeed(temp_state);
+			else
+				did_something |= fan_config->keep_fanspeed();
+		}
+		if (unlikely(journal && did_something))
+			save_levels(config, old_levels);
+		config.commit_fans();
+		if (metrics)
+			metrics->publish(config, temp_state);
+		if (live_state)
+			live_state->publish(config, temp_state);
+		if (history)
+			history->record(config, temp_state);
 
 		if (unlikely(did_something))
-			log(TF_NFY) << temp_state << " -> " << config.fan_configs() << flush;
+			log_transition(config, old_levels);
 
 		did_something = false;
 	}
 }
 
 
+milliseconds parse_sleeptime(const string &arg)
+{
+	try {
+		size_t invalid;
+		float s = std::stof(arg, &invalid);
+		if (invalid < arg.length() || !std::isfinite(s))
+			throw InvocationError(MSG_OPT_S_INVAL(arg));
+		if (s > 15)
+			throw InvocationError(MSG_OPT_S_15(arg));
+		else if (s < 0)
+			throw InvocationError("Negative sleep time? Seriously?");
+		else if (s < 0.1f)
+			throw InvocationError(MSG_OPT_S_1(arg));
+		return milliseconds(std::lround(s * 1000));
+	} catch (std::invalid_argument &) {
+		throw InvocationError(MSG_OPT_S_INVAL(arg));
+	} catch (std::out_of_range &) {
+		throw InvocationError(MSG_OPT_S_INVAL(arg));
+	}
+}
+
+
+float parse_bias(const string &arg)
+{
+	try {
+		size_t invalid;
+		float b = std::stof(arg, &invalid);
+		if (invalid < arg.length())
+			error<InvocationError>(MSG_OPT_B_INVAL(arg));
+		if (b < -10 || b > 30)
+			error<InvocationError>(MSG_OPT_B);
+		return b / 10;
+	} catch (std::invalid_argument &) {
+		throw InvocationError(MSG_OPT_B_INVAL(arg));
+	} catch (std::out_of_range &) {
+		throw InvocationError(MSG_OPT_B_INVAL(arg));
+	}
+}
+
+
 int set_options(int argc, char **argv)
 {
-	const char *optstring = "c:s:b:p::hqDznv"
+	const char *optstring = "c:s:b:p::m:r:l:S:H:hqDznv"
 #ifdef USE_ATASMART
 			"d";
 #else
@@ -236,48 +458,29 @@ int set_options(int argc, char **argv)
 		case 'n':
 			daemonize = false;
 			break;
+		case 'm':
+			metrics_address = string(optarg);
+			break;
+		case 'r':
+			trace_file = string(optarg);
+			break;
+		case 'l':
+			shm_name = string(optarg);
+			break;
+		case 'S':
+			control_socket = string(optarg);
+			break;
+		case 'H':
+			history_file = string(optarg);
+			break;
 		case 's':
-			if (optarg) {
-				try {
-					size_t invalid;
-					int s;
-					string arg(optarg);
-					s = int(std::stoul(arg, &invalid));
-					if (invalid < arg.length())
-						throw InvocationError(MSG_OPT_S_INVAL(optarg));
-					if (s > 15)
-						throw InvocationError(MSG_OPT_S_15(s));
-					else if (s < 0)
-						throw InvocationError("Negative sleep time? Seriously?");
-					else if (s < 1)
-						throw InvocationError(MSG_OPT_S_1(s));
-					sleeptime = seconds(static_cast<unsigned int>(s));
-				} catch (std::invalid_argument &) {
-					throw InvocationError(MSG_OPT_S_INVAL(optarg));
-				} catch (std::out_of_range &) {
-					throw InvocationError(MSG_OPT_S_INVAL(optarg));
-				}
-			}
+			if (optarg)
+				sleeptime = parse_sleeptime(optarg);
 			else throw InvocationError(MSG_OPT_S);
 			break;
 		case 'b':
-			if (optarg) {
-				try {
-					size_t invalid;
-					float b;
-					string arg(optarg);
-					b = std::stof(arg, &invalid);
-					if (invalid < arg.length())
-						error<InvocationError>(MSG_OPT_B_INVAL(optarg));
-					if (b < -10 || b > 30)
-						error<InvocationError>(MSG_OPT_B);
-					bias_level = b / 10;
-				} catch (std::invalid_argument &) {
-					throw InvocationError(MSG_OPT_B_INVAL(optarg));
-				} catch (std::out_of_range &) {
-					throw InvocationError(MSG_OPT_B_INVAL(optarg));
-				}
-			}
+			if (optarg)
+				bias_level = parse_bias(optarg);
 			else throw InvocationError(MSG_OPT_B_NOARG);
 			break;
 		case 'p':
@@ -295,7 +498,7 @@ int set_options(int argc, char **argv)
 		}
 	}
 	if (depulse > 0)
-		log(TF_NFY) << MSG_DEPULSE(depulse, sleeptime.count()) << flush;
+		log(TF_NFY) << MSG_DEPULSE(depulse, float(secondsf(sleeptime).count())) << flush;
 
 	return 0;
 }
@@ -309,10 +512,15 @@ void noop()
 } // namespace thinkfan
 
 
+// thinkfan-bench has its own main() but needs everything else
+#if not defined(THINKFAN_BENCH)
+
 int main(int argc, char **argv) {
 	using namespace thinkfan;
 
+#if not defined(DISABLE_BUGGER)
 	struct sigaction handler;
+#endif
 #if defined(PID_FILE)
 	unique_ptr<PidFileHolder> pid_file;
 #endif
@@ -325,26 +533,24 @@ int main(int argc, char **argv) {
 	std::set_terminate(handle_uncaught);
 #endif
 
+#if not defined(DISABLE_BUGGER)
 	memset(&handler, 0, sizeof(handler));
 	handler.sa_handler = sig_handler;
 
-	if (sigaction(SIGHUP, &handler, nullptr)
-	 || sigaction(SIGINT, &handler, nullptr)
-	 || sigaction(SIGTERM, &handler, nullptr)
-	 || sigaction(SIGUSR1, &handler, nullptr)
-	 || sigaction(SIGPWR, &handler, nullptr)
-#if not defined(DISABLE_BUGGER)
-	 || sigaction(SIGSEGV, &handler, nullptr)
-#endif
-	 || sigaction(SIGUSR2, &handler, nullptr)) {
+	if (sigaction(SIGSEGV, &handler, nullptr)) {
 		string msg = strerror(errno);
 		log(TF_ERR) << "sigaction: " << msg;
 		return 1;
 	}
+#endif
 
 #if not defined(DISABLE_EXCEPTION_CATCHING)
 	try {
 #endif // DISABLE_EXCEPTION_CATCHING
+		// All other signals are handled synchronously in the event loop. This has to
+		// happen before any threads are started so they don't receive them.
+		EventLoop event_loop({ SIGHUP, SIGINT, SIGTERM, SIGUSR1, SIGUSR2, SIGPWR }, sig_handler);
+
 		switch (set_options(argc, argv)) {
 		case 1:
 			return 0;
@@ -369,8 +575,7 @@ int main(int argc, char **argv) {
 
 				test_cfg->init(temp_state);
 
-				for (auto &sensor : test_cfg->sensors())
-					sensor->read_temps();
+				read_sensors(*test_cfg);
 
 				// Own scope so the config gets destroyed before forking
 			}
@@ -401,8 +606,26 @@ int main(int argc, char **argv) {
 		}
 #endif
 
+		// Not before forking since the threads wouldn't survive it
+		Logger::instance().start_drain();
+		unique_ptr<MetricsExporter> metrics;
+		if (metrics_address)
+			metrics.reset(new MetricsExporter(*metrics_address));
+		unique_ptr<TraceWriter> trace;
+		if (trace_file)
+			trace.reset(new TraceWriter(*trace_file));
+		unique_ptr<LiveState> live_state;
+		if (shm_name)
+			live_state.reset(new LiveState(*shm_name));
+		unique_ptr<ControlServer> control;
+		if (control_socket)
+			control.reset(new ControlServer(*control_socket));
+		unique_ptr<HistoryWriter> history;
+		if (history_file)
+			history.reset(new HistoryWriter(*history_file));
+
 		// Load the config for real after forking & enabling syslog
-		unique_ptr<const Config> config(Config::read_config(config_files));
+		unique_ptr<Config> config(Config::read_config(config_files));
 
 		do {
 			config->init(temp_state);
@@ -410,14 +633,23 @@ int main(int argc, char **argv) {
 
 			if (interrupted == SIGHUP) {
 				log(TF_NFY) << MSG_RELOAD_CONF << flush;
-				try {
-					unique_ptr<const Config> config_new(Config::read_config(config_files));
-					config.swap(config_new);
-				} catch(ExpectedError &) {
-					log(TF_ERR) << MSG_CONF_RELOAD_ERR << flush;
-				} catch(std::exception &e) {
-					log(TF_ERR) << "read_config: " << e.what() << flush;
-					log(TF_ERR) << MSG_CONF_RELOAD_ERR << flush;
+				if (!config->reload_needed(config_files)) {
+					log(TF_NFY) << MSG_CONF_UNCHANGED << flush;
+					config->keep_all();
+				}
+				else {
+					try {
+						unique_ptr<Config> config_new(Config::read_config(config_files));
+						config_new->take_over(*config);
+						config.swap(config_new);
+					} catch(ExpectedError &) {
+						log(TF_ERR) << MSG_CONF_RELOAD_ERR << flush;
+						config->keep_all();
+					} catch(std::exception &e) {
+						log(TF_ERR) << "read_config: " << e.what() << flush;
+						log(TF_ERR) << MSG_CONF_RELOAD_ERR << flush;
+						config->keep_all();
+					}
 				}
 				interrupted = 0;
 			}
@@ -450,6 +682,7 @@ int main(int argc, char **argv) {
 	return 0;
 }
 
+#endif // THINKFAN_BENCH
 
 
 
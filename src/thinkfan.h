@@ -60,6 +60,7 @@ typedef std::ifstream ifstream;
 typedef std::ofstream ofstream;
 typedef std::fstream fstream;
 typedef std::chrono::duration<unsigned int> seconds;
+typedef std::chrono::milliseconds milliseconds;
 typedef std::chrono::duration<double> secondsf;
 
 template<typename T>
@@ -88,6 +89,7 @@ inline constexpr std::nullopt_t nullopt = std::nullopt;
 using std::forward;
 
 class Config;
+class TemperatureState;
 class Level;
 class Driver;
 class FanDriver;
@@ -135,7 +137,16 @@ public:
 #endif // defined(PID_FILE)
 
 
-void sleep(thinkfan::seconds duration);
+void sleep(thinkfan::milliseconds duration);
+void sleep_until(std::chrono::steady_clock::time_point until);
+void read_sensors(const Config &config);
+
+/// Parse an argument to -s or -b, which can also be changed at runtime. Throws an @a InvocationError.
+milliseconds parse_sleeptime(const string &arg);
+float parse_bias(const string &arg);
+
+/// The temperatures that @a read_sensors() updates
+extern TemperatureState temp_state;
 
 void noop();
 
@@ -147,15 +158,18 @@ extern bool daemonize;
 #ifdef USE_ATASMART
 extern bool dnd_disk;
 #endif /* USE_ATASMART */
-extern seconds sleeptime, tmp_sleeptime;
+extern milliseconds sleeptime, tmp_sleeptime;
 extern float bias_level;
 extern std::atomic<int> interrupted;
 extern vector<string> config_files;
+extern opt<string> metrics_address;
+extern opt<string> trace_file;
+extern opt<string> shm_name;
+extern opt<string> control_socket;
+extern opt<string> history_file;
 extern float depulse;
 extern std::atomic<unsigned char> tolerate_errors;
 
-extern std::condition_variable sleep_cond;
-extern std::mutex sleep_mutex;
 
 
 
@@ -0,0 +1,115 @@
+/********************************************************************
+ * thinkfan_shm.h: Layout of the live state that thinkfan -l publishes
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#ifndef THINKFAN_SHM_H_
+#define THINKFAN_SHM_H_
+
+/* This is a plain C header, so other programs can read thinkfan's live state without
+ * linking against anything:
+ *
+ *     int fd = shm_open("/thinkfan", O_RDONLY, 0);
+ *     const struct thinkfan_shm *shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+ *     struct thinkfan_shm snapshot;
+ *     if (thinkfan_shm_read(shm, &snapshot) == 0)
+ *         ...
+ *
+ * thinkfan updates the segment once per main loop iteration. Each update is enclosed in a
+ * seqlock: @a seq is odd while an update is in progress and is incremented again when it's
+ * done, so a reader that sees the same even @a seq before and after copying has a
+ * consistent snapshot. Reading never makes a syscall and never blocks thinkfan. */
+
+#include <stdint.h>
+#include <string.h>
+
+#define THINKFAN_SHM_MAGIC 0x4e414654u /* "TFAN" in little endian */
+#define THINKFAN_SHM_VERSION 1u
+#define THINKFAN_SHM_DEFAULT_NAME "/thinkfan"
+
+/* Capacities are fixed so the segment never has to be resized on a config reload. Anything
+ * beyond them is left out and flagged in @a thinkfan_shm::flags. */
+#define THINKFAN_SHM_MAX_SENSORS 32
+#define THINKFAN_SHM_MAX_TEMPS 256
+#define THINKFAN_SHM_MAX_FANS 16
+#define THINKFAN_SHM_NAME_LEN 112
+#define THINKFAN_SHM_SPEED_LEN 32
+
+#define THINKFAN_SHM_TRUNCATED 0x1u /* Not all sensors, temperatures or fans fit */
+
+struct thinkfan_shm_sensor {
+	char name[THINKFAN_SHM_NAME_LEN]; /* Driver type and path, NUL-terminated */
+	uint32_t first_temp; /* Index of this sensor's first entry in @a thinkfan_shm::temps */
+	uint32_t num_temps;
+};
+
+struct thinkfan_shm_temp {
+	int32_t temp;        /* °C, after correction */
+	int32_t biased_temp; /* °C, what the fan levels are compared against */
+};
+
+struct thinkfan_shm_fan {
+	char name[THINKFAN_SHM_NAME_LEN];
+	char speed[THINKFAN_SHM_SPEED_LEN]; /* As written to the driver, e.g. "level 3" or "128" */
+};
+
+struct thinkfan_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;       /* sizeof(struct thinkfan_shm) as seen by thinkfan */
+	uint32_t seq;        /* Seqlock sequence number, odd during an update */
+	int32_t pid;         /* Of the thinkfan process that's writing */
+	uint32_t flags;
+	uint64_t update_ns;  /* CLOCK_MONOTONIC time of the last update in nanoseconds */
+	uint64_t updates;    /* Number of updates since thinkfan started */
+	uint32_t num_sensors;
+	uint32_t num_temps;
+	uint32_t num_fans;
+	uint32_t reserved;
+	struct thinkfan_shm_sensor sensors[THINKFAN_SHM_MAX_SENSORS];
+	struct thinkfan_shm_temp temps[THINKFAN_SHM_MAX_TEMPS];
+	struct thinkfan_shm_fan fans[THINKFAN_SHM_MAX_FANS];
+};
+
+
+/* Copy a consistent snapshot of @a shm to @a out.
+ * @return 0 on success, -1 if @a shm isn't a compatible thinkfan segment, or -2 if no
+ * consistent copy could be made, e.g. because thinkfan was killed during an update. */
+static inline int thinkfan_shm_read(const struct thinkfan_shm *shm, struct thinkfan_shm *out)
+{
+	int tries;
+	for (tries = 0; tries < 1000; ++tries) {
+		uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(out, (const void *)shm, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		if (out->magic != THINKFAN_SHM_MAGIC || out->version != THINKFAN_SHM_VERSION
+			|| out->size != sizeof(*out))
+			return -1;
+		return 0;
+	}
+	return -2;
+}
+
+
+#endif /* THINKFAN_SHM_H_ */
@@ -0,0 +1,183 @@
+/********************************************************************
+ * trace.cpp: Recording and replaying temperature traces
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "trace.h"
+#include "error.h"
+#include "message.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+namespace thinkfan {
+
+
+static constexpr char trace_magic[8] = { 'T', 'F', 'T', 'R', 'A', 'C', 'E', '1' };
+static constexpr uint32_t layout_marker = 0xffffffff;
+
+
+static void put_le(string &buf, uint32_t v, unsigned int bytes)
+{
+	for (unsigned int i = 0; i < bytes; ++i)
+		buf += char((v >> (8 * i)) & 0xff);
+}
+
+static bool get_le(const char *&p, const char *end, uint32_t &v, unsigned int bytes)
+{
+	if (end - p < ptrdiff_t(bytes))
+		return false;
+	v = 0;
+	for (unsigned int i = 0; i < bytes; ++i)
+		v |= uint32_t(static_cast<unsigned char>(*p++)) << (8 * i);
+	return true;
+}
+
+
+
+/*----------------------------------------------------------------------------
+| TraceWriter                                                                |
+----------------------------------------------------------------------------*/
+
+TraceWriter *TraceWriter::instance_ = nullptr;
+
+
+TraceWriter::TraceWriter(const string &path)
+: path_(path),
+  file_(std::fopen(path.c_str(), "we")),
+  num_temps_(0)
+{
+	if (!file_)
+		throw IOerror(MSG_TRACE_OPEN(path), errno);
+	if (std::fwrite(trace_magic, sizeof(trace_magic), 1, file_) != 1) {
+		int err = errno;
+		std::fclose(file_);
+		throw IOerror(MSG_TRACE_WRITE(path), err);
+	}
+	log(TF_NFY) << MSG_TRACE_RECORDING(path) << flush;
+	instance_ = this;
+}
+
+
+TraceWriter::~TraceWriter()
+{
+	if (std::fclose(file_))
+		log(TF_ERR) << MSG_TRACE_WRITE(path_) << strerror(errno) << flush;
+	instance_ = nullptr;
+}
+
+
+TraceWriter *TraceWriter::instance()
+{ return instance_; }
+
+
+void TraceWriter::record(const TemperatureState &ts, std::chrono::steady_clock::time_point t)
+{
+	buf_.clear();
+	if (ts.temps().size() != num_temps_) {
+		num_temps_ = ts.temps().size();
+		put_le(buf_, layout_marker, 4);
+		put_le(buf_, uint32_t(num_temps_), 2);
+	}
+
+	int64_t delta = last_ ?
+		std::chrono::duration_cast<std::chrono::milliseconds>(t - *last_).count()
+		: 0;
+	put_le(buf_, uint32_t(std::min<int64_t>(delta, layout_marker - 1)), 4);
+	for (int temp : ts.temps())
+		put_le(buf_, uint32_t(std::max(SHRT_MIN, std::min(SHRT_MAX, temp))), 2);
+	last_ = t;
+
+	// Buffered by stdio, so this very rarely makes a syscall
+	if (std::fwrite(buf_.data(), buf_.size(), 1, file_) != 1) {
+		log(TF_ERR) << MSG_TRACE_WRITE(path_) << strerror(errno) << flush;
+		std::clearerr(file_);
+	}
+}
+
+
+
+/*----------------------------------------------------------------------------
+| TraceReader                                                                |
+----------------------------------------------------------------------------*/
+
+TraceReader::TraceReader(const string &path)
+: num_temps_(0)
+{
+	std::ifstream f(path, std::ios_base::in | std::ios_base::binary);
+	if (!f.is_open())
+		throw IOerror(MSG_TRACE_OPEN(path), errno);
+	data_.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	if (f.bad())
+		throw IOerror(MSG_TRACE_OPEN(path), errno);
+
+	if (data_.size() < sizeof(trace_magic) || std::memcmp(data_.data(), trace_magic, sizeof(trace_magic)))
+		throw ExpectedError(MSG_TRACE_INVALID(path));
+	p_ = data_.data() + sizeof(trace_magic);
+	read_layout();
+}
+
+
+bool TraceReader::read_layout()
+{
+	const char *end = data_.data() + data_.size();
+	const char *p = p_;
+	uint32_t marker, n;
+	while (get_le(p, end, marker, 4) && marker == layout_marker && get_le(p, end, n, 2)) {
+		num_temps_ = n;
+		p_ = p;
+	}
+	return p_ != end;
+}
+
+
+unsigned int TraceReader::num_temps()
+{
+	read_layout();
+	return num_temps_;
+}
+
+
+bool TraceReader::next(Sample &sample)
+{
+	if (!read_layout())
+		return false;
+
+	const char *end = data_.data() + data_.size();
+	const char *p = p_;
+	uint32_t delta, temp;
+	if (!get_le(p, end, delta, 4))
+		return false;
+	sample.delta = std::chrono::milliseconds(delta);
+	sample.temps.resize(num_temps_);
+	for (int &t : sample.temps) {
+		if (!get_le(p, end, temp, 2))
+			return false;
+		t = int16_t(temp);
+	}
+	p_ = p;
+	return true;
+}
+
+
+} // namespace thinkfan
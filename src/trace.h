@@ -0,0 +1,93 @@
+#pragma once
+
+/********************************************************************
+ * trace.h: Recording and replaying temperature traces
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "thinkfan.h"
+#include "temperature_state.h"
+
+#include <cstdint>
+#include <cstdio>
+
+namespace thinkfan {
+
+
+/* A trace is the magic "TFTRACE1" followed by a list of entries, all integers little-endian:
+ *  - u32 milliseconds since the previous sample, then one i16 per temperature (in °C, after
+ *    correction but before bias), or
+ *  - u32 0xffffffff, then u16 number of temperatures in all following samples.
+ * The number of temperatures is always set before the first sample. */
+
+
+/** @brief Appends the temperatures to a trace file whenever the main loop sees them change,
+ *  so they can be replayed by thinkfan-bench. Reads that didn't change anything are left
+ *  out since replaying them wouldn't change anything either. Writes are buffered, so at most
+ *  a few KiB are lost when thinkfan is killed. Like the @a MetricsExporter, there is at most
+ *  one instance. */
+class TraceWriter {
+public:
+	TraceWriter(const string &path);
+	~TraceWriter();
+	TraceWriter(const TraceWriter &) = delete;
+
+	/// @return The running recorder or nullptr if there is none.
+	static TraceWriter *instance();
+
+	void record(const TemperatureState &ts, std::chrono::steady_clock::time_point t);
+
+private:
+	static TraceWriter *instance_;
+
+	const string path_;
+	std::FILE *file_;
+	opt<std::chrono::steady_clock::time_point> last_;
+	size_t num_temps_;
+	string buf_;
+};
+
+
+class TraceReader {
+public:
+	struct Sample {
+		std::chrono::milliseconds delta;
+		vector<int> temps;
+	};
+
+	/// Reads all of @a path at once. Throws an @a IOerror on failure.
+	TraceReader(const string &path);
+
+	/** @return false at the end of the trace. A truncated last sample (i.e. from a
+	 *  recording that was killed) is ignored. */
+	bool next(Sample &sample);
+
+	/// @return The number of temperatures in the next sample.
+	unsigned int num_temps();
+
+private:
+	bool read_layout();
+
+	string data_;
+	const char *p_;
+	unsigned int num_temps_;
+};
+
+
+} // namespace thinkfan
@@ -0,0 +1,148 @@
+/********************************************************************
+ * worker_pool.cpp: Background threads for blocking sensor reads
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "worker_pool.h"
+
+#include <algorithm>
+
+namespace thinkfan {
+
+std::weak_ptr<WorkerPool> WorkerPool::instance_;
+
+
+WorkerPool::WorkerPool()
+: idle_(0)
+, stopping_(false)
+{ queue_.reserve(16); }
+
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	work_cond_.notify_all();
+	for (std::thread &t : threads_)
+		t.join();
+}
+
+
+shared_ptr<WorkerPool> WorkerPool::instance()
+{
+	shared_ptr<WorkerPool> rv;
+	if (instance_.expired()) {
+		rv.reset(new WorkerPool());
+		instance_ = rv;
+	}
+	else
+		rv = instance_.lock();
+
+	return rv;
+}
+
+
+void WorkerPool::work()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true) {
+		++idle_;
+		work_cond_.wait(lock, [this] () {
+			return stopping_ || !queue_.empty();
+		} );
+		--idle_;
+
+		if (stopping_)
+			return;
+
+		Job *job = queue_.front();
+		queue_.erase(queue_.begin());
+
+		lock.unlock();
+		job->run();
+		lock.lock();
+
+		job->busy_ = false;
+		done_cond_.notify_all();
+	}
+}
+
+
+
+WorkerPool::Job::Job()
+: busy_(false)
+, pool_(WorkerPool::instance())
+{}
+
+
+WorkerPool::Job::~Job() noexcept(false)
+{ finish(); }
+
+
+void WorkerPool::Job::submit()
+{
+	WorkerPool &pool = *pool_;
+	std::unique_lock<std::mutex> lock(pool.mutex_);
+	if (busy_)
+		return;
+
+	busy_ = true;
+	pool.queue_.push_back(this);
+	if (pool.idle_ < pool.queue_.size() && pool.threads_.size() < max_threads_)
+		pool.threads_.emplace_back(&WorkerPool::work, &pool);
+	pool.work_cond_.notify_one();
+}
+
+
+bool WorkerPool::Job::wait_until(std::chrono::steady_clock::time_point deadline)
+{
+	std::unique_lock<std::mutex> lock(pool_->mutex_);
+	return pool_->done_cond_.wait_until(lock, deadline, [this] () {
+		return !busy_;
+	} );
+}
+
+
+void WorkerPool::Job::wait()
+{
+	std::unique_lock<std::mutex> lock(pool_->mutex_);
+	pool_->done_cond_.wait(lock, [this] () {
+		return !busy_;
+	} );
+}
+
+
+void WorkerPool::Job::finish()
+{
+	WorkerPool &pool = *pool_;
+	std::unique_lock<std::mutex> lock(pool.mutex_);
+	auto it = std::find(pool.queue_.begin(), pool.queue_.end(), this);
+	if (it != pool.queue_.end()) {
+		pool.queue_.erase(it);
+		busy_ = false;
+	}
+	pool.done_cond_.wait(lock, [this] () {
+		return !busy_;
+	} );
+}
+
+
+} // namespace thinkfan
@@ -0,0 +1,89 @@
+#pragma once
+
+/********************************************************************
+ * worker_pool.h: Background threads for blocking sensor reads
+ * (C) 2022, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "thinkfan.h"
+
+#include <thread>
+
+namespace thinkfan {
+
+
+/** @brief A small pool of threads shared by all drivers that have to call into some
+ *  potentially slow library (libatasmart, NVML, libsensors).
+ *  Like the @a LibsensorsInterface, there is only one instance, which lives as long as
+ *  some @a Job holds a reference to it. */
+class WorkerPool {
+public:
+	class Job {
+	public:
+		Job();
+		virtual ~Job() noexcept(false);
+
+		/// Queue this job unless it is already queued or running.
+		void submit();
+
+		/** @brief Wait for the job to finish.
+		 *  @return false if the job was still queued or running at @a deadline. */
+		bool wait_until(std::chrono::steady_clock::time_point deadline);
+
+		/// Wait for the job to finish, however long it takes.
+		void wait();
+
+		/** @brief Block until the job is finished (or dequeue it if it hasn't started yet).
+		 *  Must be called by the destructor of the most-derived class, i.e. before anything
+		 *  that @a run() depends on is destroyed. */
+		void finish();
+
+	protected:
+		/// Called on some worker thread. Must not log or touch any global state.
+		virtual void run() = 0;
+
+	private:
+		friend WorkerPool;
+		bool busy_; // guarded by WorkerPool::mutex_
+		shared_ptr<WorkerPool> pool_;
+	};
+
+	~WorkerPool();
+	WorkerPool(const WorkerPool &) = delete;
+
+	static shared_ptr<WorkerPool> instance();
+
+private:
+	WorkerPool();
+	void work();
+
+	static constexpr unsigned int max_threads_ = 4;
+	static std::weak_ptr<WorkerPool> instance_;
+
+	mutable std::mutex mutex_;
+	std::condition_variable work_cond_;
+	std::condition_variable done_cond_;
+	vector<Job *> queue_;
+	vector<std::thread> threads_;
+	unsigned int idle_;
+	bool stopping_;
+};
+
+
+} // namespace thinkfan
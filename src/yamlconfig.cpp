@@ -4,6 +4,8 @@
 #include "fans.h"
 #include "sensors.h"
 
+#include <algorithm>
+#include <cmath>
 #include <tuple>
 #include <memory>
 #include <unordered_set>
@@ -95,7 +97,7 @@ bool convert_driver<vector<wtf_ptr<HwmonSensorDriver>>>(
 		return false;
 
 	allowed_keywords(node, {
-		kw_hwmon, kw_correction, kw_name, kw_optional, kw_max_errors, kw_indices
+		kw_hwmon, kw_correction, kw_name, kw_optional, kw_max_errors, kw_indices, kw_interval, kw_predict, kw_id
 	});
 
 	string path = node[kw_hwmon].as<string>();
@@ -151,7 +153,7 @@ bool convert_driver<wtf_ptr<TpSensorDriver>>(const Node &node, wtf_ptr<TpSensorD
 		return false;
 
 	allowed_keywords(node, {
-		kw_tpacpi, kw_correction, kw_indices, kw_optional, kw_max_errors
+		kw_tpacpi, kw_correction, kw_indices, kw_optional, kw_max_errors, kw_interval, kw_predict, kw_id
 	});
 
 	opt<vector<int>> correction = decode_opt<vector<int>>(node[kw_correction]);
@@ -185,14 +187,17 @@ bool convert_driver<wtf_ptr<NvmlSensorDriver>>(const Node &node, wtf_ptr<NvmlSen
 		return false;
 
 	allowed_keywords(node, {
-		kw_nvidia, kw_correction, kw_optional, kw_max_errors
+		kw_nvidia, kw_correction, kw_optional, kw_max_errors, kw_interval, kw_predict, kw_id, kw_memory_temp
 	});
 
 	opt<vector<int>> correction = decode_opt<vector<int>>(node[kw_correction]);
 	bool optional = node[kw_optional] ? node[kw_optional].as<bool>() : false;
 	opt<unsigned int> max_errors = decode_opt<unsigned int>(node[kw_max_errors]);
+	bool memory_temp = node[kw_memory_temp] ? node[kw_memory_temp].as<bool>() : false;
 
-	sensor = wtf_ptr<NvmlSensorDriver>(new NvmlSensorDriver(node[kw_nvidia].as<string>(), optional, correction, max_errors));
+	sensor = wtf_ptr<NvmlSensorDriver>(new NvmlSensorDriver(
+		node[kw_nvidia].as<string>(), optional, correction, max_errors, memory_temp
+	));
 
 	return true;
 }
@@ -207,7 +212,7 @@ bool convert_driver<wtf_ptr<AtasmartSensorDriver>>(const Node &node, wtf_ptr<Ata
 		return false;
 
 	allowed_keywords(node, {
-		kw_atasmart, kw_correction, kw_optional, kw_max_errors
+		kw_atasmart, kw_correction, kw_optional, kw_max_errors, kw_interval, kw_predict, kw_id
 	});
 
 	opt<vector<int>> correction = decode_opt<vector<int>>(node[kw_correction]);
@@ -229,7 +234,7 @@ bool convert_driver<wtf_ptr<LMSensorsDriver>>(const Node &node, wtf_ptr<LMSensor
 		return false;
 
 	allowed_keywords(node, {
-		kw_chip, kw_ids, kw_correction, kw_optional, kw_max_errors
+		kw_chip, kw_ids, kw_correction, kw_optional, kw_max_errors, kw_interval, kw_predict, kw_id
 	});
 
 	if (!node[kw_ids]) {
@@ -263,7 +268,7 @@ bool convert_driver<wtf_ptr<TpFanDriver>>(const Node &node, wtf_ptr<TpFanDriver>
 		return false;
 
 	allowed_keywords(node, {
-		kw_tpacpi, kw_optional, kw_max_errors, kw_levels
+		kw_tpacpi, kw_optional, kw_max_errors, kw_levels, kw_sensors
 	});
 
 	bool optional = node[kw_optional] ? node[kw_optional].as<bool>() : false;
@@ -281,7 +286,7 @@ bool convert_driver<vector<wtf_ptr<HwmonFanDriver>>>(const Node &node, vector<wt
 		return false;
 
 	allowed_keywords(node, {
-		kw_hwmon, kw_name, kw_indices, kw_optional, kw_max_errors, kw_levels
+		kw_hwmon, kw_name, kw_indices, kw_optional, kw_max_errors, kw_levels, kw_curve, kw_max_step, kw_sensors
 	});
 
 	string path = node[kw_hwmon].as<string>();
@@ -301,8 +306,10 @@ bool convert_driver<vector<wtf_ptr<HwmonFanDriver>>>(const Node &node, vector<wt
 			"An optional hwmon fan must have an \"indices\" entry so thinkfan knows how many temperatures to expect."
 		);
 
+	shared_ptr<HwmonFanGroup> group = std::make_shared<HwmonFanGroup>();
+
 	for (unsigned int i = 0; i < (indices ? indices->size() : 1); ++i)
-		fans.push_back(wtf_ptr<HwmonFanDriver>(new HwmonFanDriver(hwmon_iface, optional, max_errors)));
+		fans.push_back(wtf_ptr<HwmonFanDriver>(new HwmonFanDriver(hwmon_iface, group, optional, max_errors)));
 
 	return true;
 }
@@ -317,6 +324,7 @@ struct convert<vector<wtf_ptr<SensorDriver>>> {
 		if (!node.IsSequence())
 			throw YamlError(get_mark_compat(node), "Sensor entries must be a sequence. Forgot the dashes?");
 		for (Node::const_iterator it = node.begin(); it != node.end(); ++it) {
+			auto entry_start = sensors.size();
 			if ((*it)[kw_hwmon])
 				for (wtf_ptr<HwmonSensorDriver> h : it->as<vector<wtf_ptr<HwmonSensorDriver>>>())
 					sensors.push_back(std::move(h));
@@ -344,6 +352,25 @@ struct convert<vector<wtf_ptr<SensorDriver>>> {
 #endif // USE_LM_SENSORS
 			else
 				throw YamlError(get_mark_compat(*it), "Invalid sensor entry");
+
+			if ((*it)[kw_interval]) {
+				float interval = (*it)[kw_interval].as<float>();
+				if (!(interval >= 0.1f))
+					throw YamlError(get_mark_compat((*it)[kw_interval]), "Sensor interval must be at least 0.1 seconds.");
+				for (auto s = sensors.begin() + long(entry_start); s != sensors.end(); ++s)
+					(*s)->set_interval(milliseconds(std::lround(interval * 1000)));
+			}
+
+			if ((*it)[kw_predict] && (*it)[kw_predict].as<bool>()) {
+				for (auto s = sensors.begin() + long(entry_start); s != sensors.end(); ++s)
+					(*s)->set_predictive(true);
+			}
+
+			if ((*it)[kw_id]) {
+				const string id = (*it)[kw_id].as<string>();
+				for (auto s = sensors.begin() + long(entry_start); s != sensors.end(); ++s)
+					(*s)->set_id(id);
+			}
 		}
 
 		return sensors.size() > initial_size;
@@ -406,7 +433,47 @@ struct convert<vector<wtf_ptr<FanConfig>>> {
 			}
 
 			const Node levels_node = (*fans_it)[kw_levels];
-			if (levels_node) {
+			const Node curve_node = (*fans_it)[kw_curve];
+			const Node zone_node = (*fans_it)[kw_sensors];
+			vector<string> zone;
+			if (zone_node) {
+				if (!zone_node.IsSequence() || !zone_node.size())
+					throw YamlError(get_mark_compat(zone_node), "A fan's 'sensors:' must be a list of sensor ids");
+				zone = zone_node.as<vector<string>>();
+			}
+			if (levels_node && curve_node)
+				throw YamlError(get_mark_compat(curve_node), "A fan can have either a 'levels:' or a 'curve:' section, not both");
+			else if (!curve_node && (*fans_it)[kw_max_step])
+				throw YamlError(get_mark_compat((*fans_it)[kw_max_step]), "'max_step:' only applies to a 'curve:' section");
+
+			if (curve_node) {
+				if (!curve_node.IsSequence())
+					throw YamlError(
+						get_mark_compat(curve_node),
+						"Curve points must be a sequence. Forgot the dashes?"
+					);
+
+				opt<unsigned int> max_step = decode_opt<unsigned int>((*fans_it)[kw_max_step]);
+
+				for (unique_ptr<FanDriver> &fan_drv : fan_drivers) {
+					unique_ptr<CurveMapping> mapping = std::make_unique<CurveMapping>(std::move(fan_drv));
+					for (const Node &point : curve_node) {
+						if (!point.IsSequence() || point.size() != 2)
+							throw YamlError(get_mark_compat(point), "A curve point must be a [temperature, pwm] pair");
+						try {
+							mapping->add_point(point[0].as<int>(), point[1].as<int>());
+						} catch (ConfigError &e) {
+							throw YamlError(get_mark_compat(point), e.what());
+						}
+					}
+					if (max_step)
+						mapping->set_max_step(*max_step);
+					mapping->set_zone(zone);
+					fan_configs.push_back(wtf_ptr<FanConfig>(new unique_ptr<FanConfig>(std::move(mapping))));
+				}
+				fan_drivers.clear();
+			}
+			else if (levels_node) {
 				if (!levels_node.IsSequence())
 					throw YamlError(
 						get_mark_compat(levels_node),
@@ -419,6 +486,7 @@ struct convert<vector<wtf_ptr<FanConfig>>> {
 					stepwise_mappings.push_back(
 						std::make_unique<StepwiseMapping>(std::move(fan_drv))
 					);
+					stepwise_mappings.back()->set_zone(zone);
 				}
 				fan_drivers.clear();
 
@@ -575,6 +643,21 @@ bool convert<wtf_ptr<Config>>::decode(const Node &node, wtf_ptr<Config> &config)
 	else
 		throw YamlError(get_mark_compat(node), "Missing \"sensors:\" entry");
 
+	if (node[kw_fans] && node[kw_fans].IsSequence()) {
+		// Check the fans' sensor ids here where we can still point at them
+		for (const Node &fan : node[kw_fans]) {
+			if (!fan.IsMap() || !fan[kw_sensors] || !fan[kw_sensors].IsSequence())
+				continue;
+			for (const Node &id : fan[kw_sensors]) {
+				const string id_s = id.as<string>();
+				if (std::none_of(config->sensors().begin(), config->sensors().end(),
+					[&] (const unique_ptr<SensorDriver> &s) { return s->id() == id_s; }
+				))
+					throw YamlError(get_mark_compat(id), MSG_CONF_ZONE_ID(id_s));
+			}
+		}
+	}
+
 	if (node[kw_fans]) {
 		try {
 			// Each fan with its own levels section (supports multiple fans)
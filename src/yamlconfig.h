@@ -20,6 +20,7 @@ const string kw_tpacpi("tpacpi");
 const string kw_hwmon("hwmon");
 #ifdef USE_NVML
 const string kw_nvidia("nvml");
+const string kw_memory_temp("memory_temp");
 #endif
 #ifdef USE_ATASMART
 const string kw_atasmart("atasmart");
@@ -37,6 +38,11 @@ const string kw_indices("indices");
 const string kw_correction("correction");
 const string kw_optional("optional");
 const string kw_max_errors("max_errors");
+const string kw_interval("interval");
+const string kw_predict("predict");
+const string kw_id("id");
+const string kw_curve("curve");
+const string kw_max_step("max_step");
 
 
 template<>